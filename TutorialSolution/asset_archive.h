@@ -0,0 +1,344 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+// Packed asset archive.
+//
+// One file instead of a loose file per shader and mesh: a single open and one memory mapping, no matter how many
+// assets there are.  That matters most on slow or network storage, where every open and seek is a round trip.
+//
+// Layout (little endian):
+//   ArchiveHeader
+//   entry data, every entry starting at a multiple of ARCHIVE_ENTRY_ALIGNMENT
+//   ArchiveEntry[entryCount], the index, at header.indexOffset
+//
+// Each entry is either stored as is or compressed as a single LZ4 block (see lz4CompressBlock).  The alignment is
+// large enough for any optimalBufferCopyOffsetAlignment and nonCoherentAtomSize, and keeps SPIR-V word aligned, so
+// a stored entry can be used straight from the mapping.
+constexpr char ARCHIVE_MAGIC[4] = { 'T', 'P', 'A', 'K' };
+constexpr uint32_t ARCHIVE_VERSION = 1;
+constexpr uint64_t ARCHIVE_ENTRY_ALIGNMENT = 256;
+constexpr size_t ARCHIVE_MAX_NAME_LENGTH = 47; // Plus the terminating zero.
+
+enum class AssetCodec : uint32_t {
+	Stored = 0,
+	Lz4 = 1,
+};
+
+struct ArchiveHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t entryCount;
+	uint32_t reserved;
+	uint64_t indexOffset;
+};
+
+struct ArchiveEntry {
+	char name[ARCHIVE_MAX_NAME_LENGTH + 1];
+	uint64_t offset;     // From the start of the file.
+	uint64_t storedSize; // Bytes in the file.
+	uint64_t size;       // Bytes once decompressed.
+	AssetCodec codec;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(ArchiveHeader) == 24, "archive header layout changed");
+static_assert(sizeof(ArchiveEntry) == 80, "archive entry layout changed");
+
+// LZ4 block format
+// ----------------
+// A block is a run of sequences.  Each one starts with a token byte: the high nibble is the number of literal bytes
+// that follow, the low nibble the match length minus LZ4_MIN_MATCH.  A nibble of 15 means more length bytes follow,
+// each added on, until one is below 255.  After the literals comes the 16-bit offset back into the output where
+// the match is copied from.  The last sequence has literals only.  Decompression is little more than memcpy, which
+// is why LZ4 is the codec of choice when decode speed matters more than ratio.
+constexpr size_t LZ4_MIN_MATCH = 4;
+constexpr size_t LZ4_LAST_LITERALS = 5; // The last 5 bytes are always literals.
+constexpr size_t LZ4_MATCH_FIND_LIMIT = 12; // No match may start in the last 12 bytes.
+constexpr size_t LZ4_MAX_OFFSET = 65535;
+
+inline void lz4WriteLength(std::vector<uint8_t>& out, size_t length) {
+	while (length >= 255) {
+		out.push_back(255);
+		length -= 255;
+	}
+	out.push_back(static_cast<uint8_t>(length));
+}
+
+// Greedy single-pass compressor with a hash table of recent 4-byte sequences.  Fast rather than tight, which is
+// fine for packing assets once.
+inline std::vector<uint8_t> lz4CompressBlock(const uint8_t* src, size_t size) {
+	const uint32_t HASH_BITS = 16;
+	std::vector<uint32_t> table(size_t(1) << HASH_BITS, 0); // Position + 1 of the last sequence with this hash, 0 if none.
+	auto read32 = [src](size_t position) {
+		uint32_t value;
+		std::memcpy(&value, src + position, sizeof(value));
+		return value;
+	};
+
+	std::vector<uint8_t> out;
+	out.reserve(size + size / 255 + 16);
+	size_t anchor = 0; // Start of the literals not written yet.
+	size_t position = 0;
+
+	while (size >= LZ4_MATCH_FIND_LIMIT && position + LZ4_MATCH_FIND_LIMIT <= size) {
+		uint32_t sequence = read32(position);
+		uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+		size_t candidate = table[hash];
+		table[hash] = static_cast<uint32_t>(position + 1);
+		if (candidate == 0 || position - (candidate - 1) > LZ4_MAX_OFFSET || read32(candidate - 1) != sequence) {
+			position++;
+			continue;
+		}
+
+		size_t match = candidate - 1;
+		size_t length = LZ4_MIN_MATCH;
+		while (position + length < size - LZ4_LAST_LITERALS && src[match + length] == src[position + length]) {
+			length++;
+		}
+
+		size_t literals = position - anchor;
+		size_t extra = length - LZ4_MIN_MATCH;
+		out.push_back(static_cast<uint8_t>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(extra, 15)));
+		if (literals >= 15) {
+			lz4WriteLength(out, literals - 15);
+		}
+		out.insert(out.end(), src + anchor, src + position);
+		size_t offset = position - match;
+		out.push_back(static_cast<uint8_t>(offset & 0xff));
+		out.push_back(static_cast<uint8_t>(offset >> 8));
+		if (extra >= 15) {
+			lz4WriteLength(out, extra - 15);
+		}
+
+		position += length;
+		anchor = position;
+	}
+
+	size_t literals = size - anchor;
+	out.push_back(static_cast<uint8_t>(std::min<size_t>(literals, 15) << 4));
+	if (literals >= 15) {
+		lz4WriteLength(out, literals - 15);
+	}
+	out.insert(out.end(), src + anchor, src + size);
+	return out;
+}
+
+// Decompress exactly dstSize bytes.  Returns false on corrupt input instead of reading or writing out of bounds.
+inline bool lz4DecompressBlock(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize) {
+	size_t in = 0;
+	size_t out = 0;
+	auto readLength = [&](size_t& length) {
+		uint8_t byte;
+		do {
+			if (in >= srcSize) {
+				return false;
+			}
+			byte = src[in++];
+			length += byte;
+		} while (byte == 255);
+		return true;
+	};
+
+	while (in < srcSize) {
+		uint8_t token = src[in++];
+
+		size_t literals = token >> 4;
+		if (literals == 15 && !readLength(literals)) {
+			return false;
+		}
+		if (literals > srcSize - in || literals > dstSize - out) {
+			return false;
+		}
+		if (literals > 0) {
+			std::memcpy(dst + out, src + in, literals);
+		}
+		in += literals;
+		out += literals;
+		if (in == srcSize) {
+			break;  // The last sequence has no match.
+		}
+
+		if (srcSize - in < 2) {
+			return false;
+		}
+		size_t offset = src[in] | (size_t(src[in + 1]) << 8);
+		in += 2;
+		size_t length = token & 15;
+		if (length == 15 && !readLength(length)) {
+			return false;
+		}
+		length += LZ4_MIN_MATCH;
+		if (offset == 0 || offset > out || length > dstSize - out) {
+			return false;
+		}
+
+		// Matches may overlap their own output (offset < length repeats a pattern), which memcpy must not see.
+		const uint8_t* match = dst + out - offset;
+		if (offset >= length) {
+			std::memcpy(dst + out, match, length);
+		}
+		else {
+			for (size_t i = 0; i < length; i++) {
+				dst[out + i] = match[i];
+			}
+		}
+		out += length;
+	}
+	return out == dstSize;
+}
+
+// Read side.  Maps the archive once and hands out entries by name.  All of it is read-only, so any number of
+// threads may read entries at the same time.
+class AssetArchive {
+public:
+	AssetArchive() = default;
+
+	// Throws if the file is missing or is not a valid archive.
+	explicit AssetArchive(const std::string& path) : file(path) {
+		ArchiveHeader header{};
+		if (file.size() < sizeof(header)) {
+			throw std::runtime_error(path + " is not an asset archive!");
+		}
+		std::memcpy(&header, file.data(), sizeof(header));
+		if (std::memcmp(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0 || header.version != ARCHIVE_VERSION) {
+			throw std::runtime_error(path + " is not an asset archive!");
+		}
+		if (header.indexOffset > file.size() || (file.size() - header.indexOffset) / sizeof(ArchiveEntry) < header.entryCount) {
+			throw std::runtime_error(path + " has a truncated index!");
+		}
+
+		index.resize(header.entryCount);
+		std::memcpy(index.data(), file.data() + header.indexOffset, header.entryCount * sizeof(ArchiveEntry));
+		for (auto& entry : index) {
+			entry.name[ARCHIVE_MAX_NAME_LENGTH] = '\0';
+			if (entry.offset > file.size() || entry.storedSize > file.size() - entry.offset ||
+				(entry.codec == AssetCodec::Stored && entry.storedSize != entry.size) ||
+				(entry.codec != AssetCodec::Stored && entry.codec != AssetCodec::Lz4)) {
+				throw std::runtime_error(path + " has a corrupt entry " + entry.name + "!");
+			}
+		}
+	}
+
+	bool isOpen() const {
+		return !file.empty();
+	}
+
+	const std::vector<ArchiveEntry>& entries() const {
+		return index;
+	}
+
+	// nullptr if there is no such entry.
+	const ArchiveEntry* find(const std::string& name) const {
+		for (const auto& entry : index) {
+			if (name == entry.name) {
+				return &entry;
+			}
+		}
+		return nullptr;
+	}
+
+	// The entry's data in the mapping if it is stored uncompressed, nullptr if it has to be decompressed.
+	const uint8_t* view(const ArchiveEntry& entry) const {
+		return entry.codec == AssetCodec::Stored ? file.data() + entry.offset : nullptr;
+	}
+
+	// Decompress (or copy) the entry into destination, which must hold entry.size bytes.  Throws on corrupt data.
+	void read(const ArchiveEntry& entry, void* destination) const {
+		const uint8_t* source = file.data() + entry.offset;
+		if (entry.codec == AssetCodec::Stored) {
+			std::memcpy(destination, source, entry.size);
+		}
+		else if (!lz4DecompressBlock(source, entry.storedSize, static_cast<uint8_t*>(destination), entry.size)) {
+			throw std::runtime_error(std::string("failed to decompress ") + entry.name + "!");
+		}
+	}
+
+private:
+	MappedFile file;
+	std::vector<ArchiveEntry> index;
+};
+
+// Write side, for packing assets.  Entries are kept in memory until write.
+class AssetArchiveWriter {
+public:
+	// Compress with LZ4 unless that does not make the entry any smaller.
+	void add(const std::string& name, const void* data, size_t size, bool compress = true) {
+		if (name.size() > ARCHIVE_MAX_NAME_LENGTH) {
+			throw std::runtime_error("asset name " + name + " is too long!");
+		}
+		Pending pending;
+		pending.name = name;
+		pending.size = size;
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		if (compress && size > 0) {
+			pending.data = lz4CompressBlock(bytes, size);
+		}
+		if (pending.data.empty() || pending.data.size() >= size) {
+			pending.data.assign(bytes, bytes + size);
+			pending.codec = AssetCodec::Stored;
+		}
+		else {
+			pending.codec = AssetCodec::Lz4;
+		}
+		entries.push_back(std::move(pending));
+	}
+
+	void write(const std::string& path) const {
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		if (!out.is_open()) {
+			throw std::runtime_error("failed to create " + path + "!");
+		}
+
+		std::vector<ArchiveEntry> index;
+		uint64_t offset = sizeof(ArchiveHeader);
+		std::vector<char> padding;
+		out.seekp(static_cast<std::streamoff>(offset));
+		for (const auto& pending : entries) {
+			uint64_t aligned = (offset + ARCHIVE_ENTRY_ALIGNMENT - 1) / ARCHIVE_ENTRY_ALIGNMENT * ARCHIVE_ENTRY_ALIGNMENT;
+			padding.assign(static_cast<size_t>(aligned - offset), 0);
+			out.write(padding.data(), padding.size());
+
+			ArchiveEntry entry{};
+			std::memcpy(entry.name, pending.name.c_str(), pending.name.size());
+			entry.offset = aligned;
+			entry.storedSize = pending.data.size();
+			entry.size = pending.size;
+			entry.codec = pending.codec;
+			index.push_back(entry);
+
+			out.write(reinterpret_cast<const char*>(pending.data.data()), pending.data.size());
+			offset = aligned + pending.data.size();
+		}
+
+		ArchiveHeader header{};
+		std::memcpy(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+		header.version = ARCHIVE_VERSION;
+		header.entryCount = static_cast<uint32_t>(index.size());
+		header.indexOffset = offset;
+		out.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(ArchiveEntry));
+		out.seekp(0);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		if (!out) {
+			throw std::runtime_error("failed to write " + path + "!");
+		}
+	}
+
+private:
+	struct Pending {
+		std::string name;
+		size_t size = 0;
+		AssetCodec codec = AssetCodec::Stored;
+		std::vector<uint8_t> data;
+	};
+	std::vector<Pending> entries;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "asset_archive.h"
+
+// Background asset loader.
+//
+// Decompressing assets is pure CPU work, so a worker thread does it while the render loop keeps going.  Each
+// request names an archive entry and where its bytes should go, normally a reserved piece of the staging ring, so
+// the data lands right where the GPU copies it from and never passes through another buffer.  Finished requests
+// are picked up with takeCompleted, and only then may the destination be handed to the GPU.
+//
+// The archive and every destination must stay valid until the request has completed (or stop has returned).
+class AssetStreamer {
+public:
+	struct Completion {
+		uint64_t id;
+		std::string error; // Empty on success.
+	};
+
+	AssetStreamer() : worker([this]() { workerLoop(); }) {}
+
+	~AssetStreamer() {
+		stop();
+	}
+
+	AssetStreamer(const AssetStreamer&) = delete;
+	AssetStreamer& operator=(const AssetStreamer&) = delete;
+
+	// Queue entry to be read into destination, which must hold entry.size bytes.  Returns the id takeCompleted
+	// reports it under.
+	uint64_t request(const AssetArchive& archive, const ArchiveEntry& entry, void* destination) {
+		std::lock_guard<std::mutex> lock(mutex);
+		uint64_t id = ++lastId;
+		jobs.push_back({ id, &archive, &entry, destination });
+		wakeWorker.notify_one();
+		return id;
+	}
+
+	// Requests finished since the last call, in the order they were made.
+	std::vector<Completion> takeCompleted() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<Completion> result;
+		result.swap(completed);
+		return result;
+	}
+
+	// Block until every request made so far has completed.
+	void waitIdle() {
+		std::unique_lock<std::mutex> lock(mutex);
+		idle.wait(lock, [this]() { return jobs.empty() && !busy; });
+	}
+
+	// Drop requests that have not started and wait for the one in progress.  Nothing runs afterwards.
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			jobs.clear();
+		}
+		wakeWorker.notify_all();
+		if (worker.joinable()) {
+			worker.join();
+		}
+	}
+
+private:
+	struct Job {
+		uint64_t id;
+		const AssetArchive* archive;
+		const ArchiveEntry* entry;
+		void* destination;
+	};
+
+	std::mutex mutex;
+	std::condition_variable wakeWorker; // New request or shutdown.
+	std::condition_variable idle;       // Queue drained.
+	std::deque<Job> jobs;
+	std::vector<Completion> completed;
+	uint64_t lastId = 0;
+	bool busy = false;
+	bool stopping = false;
+	std::thread worker; // Last, so everything above exists before the thread starts.
+
+	void workerLoop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wakeWorker.wait(lock, [this]() { return stopping || !jobs.empty(); });
+			if (stopping) {
+				busy = false;
+				idle.notify_all();
+				return;
+			}
+			Job job = jobs.front();
+			jobs.pop_front();
+			busy = true;
+			lock.unlock();
+
+			Completion completion{ job.id, {} };
+			try {
+				job.archive->read(*job.entry, job.destination);
+			}
+			catch (const std::exception& e) {
+				completion.error = e.what();
+			}
+
+			lock.lock();
+			completed.push_back(completion);
+			busy = false;
+			if (jobs.empty()) {
+				idle.notify_all();
+			}
+		}
+	}
+};
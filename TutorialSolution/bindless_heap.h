@@ -0,0 +1,230 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// Bindless descriptor heap.
+//
+// Instead of a descriptor set per draw (or per material), every buffer and texture shaders read goes into one big
+// descriptor set, which is bound once per command buffer and never changes.  Shaders pick their resources by
+// index, usually one that comes with the draw's push constants.  That takes descriptor set allocation, updates and
+// binding out of the draw loop entirely, which is where they hurt in scenes with many draws.
+//
+// The set has two arrays:
+// -- binding 0 (BUFFER_BINDING): storage buffers
+// -- binding 1 (TEXTURE_BINDING): combined image samplers
+// Both are created with Vulkan 1.2 descriptor indexing flags: UPDATE_AFTER_BIND, so slots can be written while
+// the set is bound in recorded command buffers; UPDATE_UNUSED_WHILE_PENDING, so that may even happen while those
+// are executing, as long as they do not use the slot; and PARTIALLY_BOUND, so unused slots may stay empty.
+//
+// Slots are handed out and given back by the heap, but it knows nothing about frames.  A slot the GPU may still be
+// reading has to be kept until the frames using it have completed before it is removed.
+class BindlessHeap {
+public:
+	static constexpr uint32_t BUFFER_BINDING = 0;
+	static constexpr uint32_t TEXTURE_BINDING = 1;
+	static constexpr uint32_t INVALID_INDEX = UINT32_MAX;
+
+	BindlessHeap() = default;
+	BindlessHeap(const BindlessHeap&) = delete;
+	BindlessHeap& operator=(const BindlessHeap&) = delete;
+
+	// The descriptor indexing features the heap relies on.  supported is what the device reports.  Shaders pick
+	// the element with an index from push constants, which is dynamically uniform indexing and needs the Vulkan 1.0
+	// array dynamic indexing features for both bindings.
+	static bool isSupported(const VkPhysicalDeviceFeatures& supported10, const VkPhysicalDeviceVulkan12Features& supported) {
+		return supported10.shaderStorageBufferArrayDynamicIndexing && supported10.shaderSampledImageArrayDynamicIndexing &&
+			supported.runtimeDescriptorArray && supported.descriptorBindingPartiallyBound &&
+			supported.descriptorBindingUpdateUnusedWhilePending &&
+			supported.descriptorBindingStorageBufferUpdateAfterBind &&
+			supported.descriptorBindingSampledImageUpdateAfterBind;
+	}
+
+	static void enableFeatures(VkPhysicalDeviceFeatures& features10, VkPhysicalDeviceVulkan12Features& features) {
+		features10.shaderStorageBufferArrayDynamicIndexing = VK_TRUE;
+		features10.shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+		features.runtimeDescriptorArray = VK_TRUE;
+		features.descriptorBindingPartiallyBound = VK_TRUE;
+		features.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+		features.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+		features.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+	}
+
+	// Create the layout, pool and set.  The array sizes are capped by the device's update-after-bind limits.
+	// stages are the shader stages that may read the heap.
+	void init(VkPhysicalDevice physicalDevice, VkDevice logicalDevice, uint32_t maxBuffers, uint32_t maxTextures,
+		VkShaderStageFlags stages) {
+		device = logicalDevice;
+
+		VkPhysicalDeviceDescriptorIndexingProperties limits{};
+		limits.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES;
+		VkPhysicalDeviceProperties2 properties{};
+		properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+		properties.pNext = &limits;
+		vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+
+		// A combined image sampler counts as both a sampled image and a sampler.  Both arrays also share the
+		// per-stage resource limit, which the buffers get half of.
+		bufferCapacity = std::min({ maxBuffers, limits.maxPerStageDescriptorUpdateAfterBindStorageBuffers,
+			limits.maxDescriptorSetUpdateAfterBindStorageBuffers, limits.maxPerStageUpdateAfterBindResources / 2 });
+		textureCapacity = std::min({ maxTextures, limits.maxPerStageDescriptorUpdateAfterBindSampledImages,
+			limits.maxPerStageDescriptorUpdateAfterBindSamplers, limits.maxDescriptorSetUpdateAfterBindSampledImages,
+			limits.maxDescriptorSetUpdateAfterBindSamplers, limits.maxPerStageUpdateAfterBindResources - bufferCapacity });
+		if (bufferCapacity == 0 || textureCapacity == 0) {
+			throw std::runtime_error("failed to size bindless descriptor heap!");
+		}
+
+		VkDescriptorSetLayoutBinding bindings[2]{};
+		bindings[0].binding = BUFFER_BINDING;
+		bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		bindings[0].descriptorCount = bufferCapacity;
+		bindings[0].stageFlags = stages;
+		bindings[1].binding = TEXTURE_BINDING;
+		bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		bindings[1].descriptorCount = textureCapacity;
+		bindings[1].stageFlags = stages;
+
+		VkDescriptorBindingFlags bindingFlags[2];
+		bindingFlags[0] = bindingFlags[1] = VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+			VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+
+		VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo{};
+		bindingFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+		bindingFlagsInfo.bindingCount = 2;
+		bindingFlagsInfo.pBindingFlags = bindingFlags;
+
+		VkDescriptorSetLayoutCreateInfo layoutInfo{};
+		layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+		layoutInfo.pNext = &bindingFlagsInfo;
+		layoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+		layoutInfo.bindingCount = 2;
+		layoutInfo.pBindings = bindings;
+
+		if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &setLayout) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create descriptor set layout!");
+		}
+
+		VkDescriptorPoolSize poolSizes[2]{};
+		poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		poolSizes[0].descriptorCount = bufferCapacity;
+		poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		poolSizes[1].descriptorCount = textureCapacity;
+
+		VkDescriptorPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+		poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+		poolInfo.poolSizeCount = 2;
+		poolInfo.pPoolSizes = poolSizes;
+		poolInfo.maxSets = 1;
+
+		if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create descriptor pool!");
+		}
+
+		VkDescriptorSetAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+		allocInfo.descriptorPool = pool;
+		allocInfo.descriptorSetCount = 1;
+		allocInfo.pSetLayouts = &setLayout;
+
+		if (vkAllocateDescriptorSets(device, &allocInfo, &descriptorSet) != VK_SUCCESS) {
+			throw std::runtime_error("failed to allocate descriptor sets!");
+		}
+	}
+
+	void destroy() {
+		if (device == VK_NULL_HANDLE) {
+			return;
+		}
+		vkDestroyDescriptorPool(device, pool, nullptr);  // Frees the set too.
+		vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
+		device = VK_NULL_HANDLE;
+	}
+
+	VkDescriptorSetLayout layout() const {
+		return setLayout;
+	}
+
+	VkDescriptorSet set() const {
+		return descriptorSet;
+	}
+
+	// Put range bytes of buffer from offset into a free buffer slot and return its index.
+	uint32_t addStorageBuffer(VkBuffer buffer, VkDeviceSize offset = 0, VkDeviceSize range = VK_WHOLE_SIZE) {
+		uint32_t index = allocateSlot(freeBuffers, usedBuffers, bufferCapacity);
+
+		VkDescriptorBufferInfo bufferInfo{};
+		bufferInfo.buffer = buffer;
+		bufferInfo.offset = offset;
+		bufferInfo.range = range;
+
+		VkWriteDescriptorSet descriptorWrite{};
+		descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrite.dstSet = descriptorSet;
+		descriptorWrite.dstBinding = BUFFER_BINDING;
+		descriptorWrite.dstArrayElement = index;
+		descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		descriptorWrite.descriptorCount = 1;
+		descriptorWrite.pBufferInfo = &bufferInfo;
+		vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+		return index;
+	}
+
+	// Put an image view and sampler into a free texture slot and return its index.
+	uint32_t addTexture(VkImageView view, VkSampler sampler, VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+		uint32_t index = allocateSlot(freeTextures, usedTextures, textureCapacity);
+
+		VkDescriptorImageInfo imageInfo{};
+		imageInfo.imageView = view;
+		imageInfo.sampler = sampler;
+		imageInfo.imageLayout = layout;
+
+		VkWriteDescriptorSet descriptorWrite{};
+		descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrite.dstSet = descriptorSet;
+		descriptorWrite.dstBinding = TEXTURE_BINDING;
+		descriptorWrite.dstArrayElement = index;
+		descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		descriptorWrite.descriptorCount = 1;
+		descriptorWrite.pImageInfo = &imageInfo;
+		vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+		return index;
+	}
+
+	// Give a slot back.  Only once no submitted work reads it any more (see above).
+	void removeStorageBuffer(uint32_t index) {
+		freeBuffers.push_back(index);
+	}
+
+	void removeTexture(uint32_t index) {
+		freeTextures.push_back(index);
+	}
+
+private:
+	VkDevice device = VK_NULL_HANDLE;
+	VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+	VkDescriptorPool pool = VK_NULL_HANDLE;
+	VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+	uint32_t bufferCapacity = 0;
+	uint32_t textureCapacity = 0;
+	uint32_t usedBuffers = 0;  // Slots below this have been handed out at least once.
+	uint32_t usedTextures = 0;
+	std::vector<uint32_t> freeBuffers; // Given back slots, reused before new ones.
+	std::vector<uint32_t> freeTextures;
+
+	static uint32_t allocateSlot(std::vector<uint32_t>& freeSlots, uint32_t& used, uint32_t capacity) {
+		if (!freeSlots.empty()) {
+			uint32_t index = freeSlots.back();
+			freeSlots.pop_back();
+			return index;
+		}
+		if (used == capacity) {
+			throw std::runtime_error("bindless descriptor heap is full!");
+		}
+		return used++;
+	}
+};
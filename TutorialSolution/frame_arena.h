@@ -0,0 +1,141 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+// Per-frame linear allocators.
+//
+// Data that lives for one frame (uniforms, instance data, the arrays that go into a submit) does not need a
+// general purpose allocator.  Everything allocated during a frame is thrown away together, so a bump pointer does:
+// an allocation is an aligned add, and freeing is moving the pointer back to the start once nothing uses the
+// memory any more.  After the first few frames neither of these ever calls into the heap or vkAllocateMemory.
+
+// GPU side: one persistently mapped host visible buffer, split into a region per frame in flight.  begin rewinds a
+// region, which is only safe once the frame that last used it has completed on the GPU.  The mapping and the
+// buffer belong to the caller.
+class FrameArena {
+public:
+	struct Allocation {
+		VkDeviceSize offset; // From the start of the buffer, ready for a descriptor or vkCmdBindVertexBuffers.
+		void* data;
+	};
+
+	// offsetAlignment is what every allocation's offset is a multiple of, typically the larger of
+	// minUniformBufferOffsetAlignment and minStorageBufferOffsetAlignment.  Always a power of two.
+	void init(void* mappedBuffer, VkDeviceSize bytesPerRegion, VkDeviceSize offsetAlignment) {
+		mapped = static_cast<uint8_t*>(mappedBuffer);
+		regionSize = bytesPerRegion & ~(offsetAlignment - 1);  // Keeps every region start aligned too.
+		alignment = offsetAlignment;
+		head = end = 0;
+	}
+
+	// Start handing out region from its beginning again.
+	void begin(uint32_t region) {
+		head = regionSize * region;
+		end = head + regionSize;
+	}
+
+	Allocation allocate(VkDeviceSize size) {
+		VkDeviceSize offset = (head + alignment - 1) & ~(alignment - 1);
+		if (offset + size > end) {
+			throw std::runtime_error("frame arena is full!");
+		}
+		head = offset + size;
+		return { offset, mapped + offset };
+	}
+
+	template <typename T>
+	T* allocateArray(size_t count, VkDeviceSize* offset) {
+		Allocation allocation = allocate(sizeof(T) * count);
+		*offset = allocation.offset;
+		return static_cast<T*>(allocation.data);
+	}
+
+private:
+	uint8_t* mapped = nullptr;
+	VkDeviceSize regionSize = 0;
+	VkDeviceSize alignment = 1;
+	VkDeviceSize head = 0; // Next free byte of the current region.
+	VkDeviceSize end = 0;  // End of the current region.
+};
+
+// CPU side: a bump allocator for the temporary containers of a frame, behind std::pmr::memory_resource so that
+// std::pmr::vector and friends can use it.  Deallocation does nothing; reset takes everything back at once.
+//
+// Running out of space is not an error.  Whatever does not fit comes from the heap instead, and the next reset
+// grows the block so that a frame like that fits from then on.  Not thread safe: one arena per thread.
+class ScratchArena : public std::pmr::memory_resource {
+public:
+	explicit ScratchArena(size_t initialCapacity) : capacity(initialCapacity), block(new std::byte[initialCapacity]) {}
+
+	ScratchArena(const ScratchArena&) = delete;
+	ScratchArena& operator=(const ScratchArena&) = delete;
+
+	~ScratchArena() override {
+		freeOverflow();
+	}
+
+	// Everything allocated so far is released.  Call once per frame, when none of it is used any more.
+	void reset() {
+		if (!overflow.empty()) {
+			size_t needed = used + overflowBytes;
+			freeOverflow();
+			capacity = std::max(capacity * 2, needed * 2);
+			block.reset(new std::byte[capacity]);
+		}
+		used = 0;
+	}
+
+	size_t blockCapacity() const {
+		return capacity;
+	}
+
+private:
+	struct OverflowAllocation {
+		void* pointer;
+		size_t bytes;
+		size_t alignment;
+	};
+
+	size_t capacity;
+	std::unique_ptr<std::byte[]> block;
+	size_t used = 0;
+	std::vector<OverflowAllocation> overflow; // Came from the heap, freed by the next reset.
+	size_t overflowBytes = 0;
+
+	void* do_allocate(size_t bytes, size_t alignment) override {
+		uintptr_t base = reinterpret_cast<uintptr_t>(block.get());
+		uintptr_t start = (base + used + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+		if (start + bytes <= base + capacity) {
+			used = start + bytes - base;
+			return reinterpret_cast<void*>(start);
+		}
+		void* pointer = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+		overflow.push_back({ pointer, bytes, alignment });
+		overflowBytes += bytes + alignment;
+		return pointer;
+	}
+
+	void do_deallocate(void*, size_t, size_t) override {
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+		return this == &other;
+	}
+
+	void freeOverflow() {
+		for (const auto& allocation : overflow) {
+			std::pmr::new_delete_resource()->deallocate(allocation.pointer, allocation.bytes, allocation.alignment);
+		}
+		overflow.clear();
+		overflowBytes = 0;
+	}
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// CPU side phases of drawFrame, in the order they happen.
+enum class FramePhase : uint32_t {
+	FenceWait, // Waiting for the frame in flight (and the swap chain image) to be free again.
+	Acquire,   // vkAcquireNextImageKHR.
+	Record,    // Compute pass and command buffer recording.
+	Submit,    // Upload batch and vkQueueSubmit.
+	Present,   // vkQueuePresentKHR.
+	Count
+};
+
+inline const char* framePhaseName(FramePhase phase) {
+	switch (phase) {
+	case FramePhase::FenceWait: return "fence_wait";
+	case FramePhase::Acquire: return "acquire";
+	case FramePhase::Record: return "record";
+	case FramePhase::Submit: return "submit";
+	case FramePhase::Present: return "present";
+	default: return "unknown";
+	}
+}
+
+// Per-phase CPU frame timings.
+//
+// beginFrame starts the clock, and every mark(phase) charges the time since the previous mark to that phase, so the
+// phases of a frame always add up to its total.  A frame only counts once endFrame is called; discardFrame drops a
+// frame that was abandoned halfway, such as one whose acquire found the swap chain out of date.
+//
+// Every sample is kept so the summary can report exact percentiles.  At a few dozen bytes per frame that is fine
+// for benchmark runs, which is the only time the application records.
+class FrameStats {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	void beginFrame() {
+		frameStart = Clock::now();
+		lastMark = frameStart;
+		current.fill(0.0);
+		inFrame = true;
+	}
+
+	void mark(FramePhase phase) {
+		if (!inFrame) {
+			return;
+		}
+		Clock::time_point now = Clock::now();
+		current[static_cast<size_t>(phase)] += std::chrono::duration<double, std::milli>(now - lastMark).count();
+		lastMark = now;
+	}
+
+	void endFrame() {
+		if (!inFrame) {
+			return;
+		}
+		for (size_t i = 0; i < PHASE_COUNT; i++) {
+			phaseSamples[i].push_back(current[i]);
+		}
+		frameSamples.push_back(std::chrono::duration<double, std::milli>(lastMark - frameStart).count());
+		inFrame = false;
+	}
+
+	void discardFrame() {
+		inFrame = false;
+	}
+
+	void clear() {
+		for (auto& samples : phaseSamples) {
+			samples.clear();
+		}
+		frameSamples.clear();
+	}
+
+	uint64_t frameCount() const {
+		return frameSamples.size();
+	}
+
+	// Write {"frame": {...}, "fence_wait": {...}, ...} where every entry holds mean/min/p50/p90/p99/max in
+	// milliseconds.  indent is prefixed to every line after the opening brace.
+	void writeJson(std::ostream& out, const char* indent) const {
+		out << "{\n";
+		writeSummary(out, indent, "frame", frameSamples);
+		for (size_t i = 0; i < PHASE_COUNT; i++) {
+			out << ",\n";
+			writeSummary(out, indent, framePhaseName(static_cast<FramePhase>(i)), phaseSamples[i]);
+		}
+		out << "\n" << indent << "}";
+	}
+
+private:
+	static constexpr size_t PHASE_COUNT = static_cast<size_t>(FramePhase::Count);
+
+	Clock::time_point frameStart;
+	Clock::time_point lastMark;
+	std::array<double, PHASE_COUNT> current{};
+	bool inFrame = false;
+	std::array<std::vector<double>, PHASE_COUNT> phaseSamples;
+	std::vector<double> frameSamples;
+
+	// Nearest rank percentile of an already sorted, non-empty list.
+	static double percentile(const std::vector<double>& sorted, double fraction) {
+		size_t rank = static_cast<size_t>(fraction * sorted.size() + 0.5);
+		return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+	}
+
+	static void writeSummary(std::ostream& out, const char* indent, const char* name, const std::vector<double>& samples) {
+		out << indent << "  \"" << name << "\": {";
+		if (samples.empty()) {
+			out << "}";
+			return;
+		}
+		std::vector<double> sorted = samples;
+		std::sort(sorted.begin(), sorted.end());
+		double sum = 0.0;
+		for (double sample : sorted) {
+			sum += sample;
+		}
+		out << "\"mean_ms\": " << sum / sorted.size()
+			<< ", \"min_ms\": " << sorted.front()
+			<< ", \"p50_ms\": " << percentile(sorted, 0.50)
+			<< ", \"p90_ms\": " << percentile(sorted, 0.90)
+			<< ", \"p99_ms\": " << percentile(sorted, 0.99)
+			<< ", \"max_ms\": " << sorted.back() << "}";
+	}
+};
@@ -0,0 +1,438 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define FRUSTUM_CULLER_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define FRUSTUM_CULLER_NEON 1
+#include <arm_neon.h>
+#endif
+
+// The AVX2 kernels are compiled for AVX2 even when the rest of the program is not, and only ever called once
+// detectInstructionSet has seen the CPU supports it.  MSVC allows the intrinsics anywhere; GCC and Clang need the
+// target attribute.
+#if defined(FRUSTUM_CULLER_X86) && (defined(__GNUC__) || defined(__clang__))
+#define FRUSTUM_CULLER_AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define FRUSTUM_CULLER_AVX2_TARGET
+#endif
+
+// CPU-side transform and frustum culling.
+//
+// Works on structures of arrays: every coordinate of every object in its own array, so a SIMD register holds the
+// same coordinate of 4 (SSE, NEON) or 8 (AVX2) objects and one plane test covers all of them.  The result is a
+// compact list of the indices of the visible objects, in order, ready to be turned into draws or copied into
+// instance data.
+//
+// The kernels are picked once, when the culler is created, from what the CPU supports.  The scalar ones are the
+// fallback and the reference: every kernel gives the same answer for the same input.
+class FrustumCuller {
+public:
+	enum class InstructionSet {
+		Scalar,
+		Sse,
+		Avx2,
+		Neon,
+	};
+
+	// A plane is inside for points with x*p.x + y*p.y + z*p.z + w >= 0.
+	struct Plane {
+		float x, y, z, w;
+	};
+	// left, right, bottom, top, near, far.
+	struct Frustum {
+		Plane planes[6];
+	};
+
+	// count spheres.
+	struct Spheres {
+		const float* x;
+		const float* y;
+		const float* z;
+		const float* radius;
+	};
+	// count boxes as center and half size per axis.
+	struct Boxes {
+		const float* centerX;
+		const float* centerY;
+		const float* centerZ;
+		const float* extentX;
+		const float* extentY;
+		const float* extentZ;
+	};
+	struct Points {
+		float* x;
+		float* y;
+		float* z;
+	};
+
+	explicit FrustumCuller(InstructionSet requested = detectInstructionSet()) : instructionSet(requested) {}
+
+	// The widest one this build and this CPU both support.
+	static InstructionSet detectInstructionSet() {
+#if defined(FRUSTUM_CULLER_X86)
+		return cpuHasAvx2() ? InstructionSet::Avx2 : InstructionSet::Sse;
+#elif defined(FRUSTUM_CULLER_NEON)
+		return InstructionSet::Neon;
+#else
+		return InstructionSet::Scalar;
+#endif
+	}
+
+	static const char* name(InstructionSet set) {
+		switch (set) {
+		case InstructionSet::Sse:
+			return "SSE";
+		case InstructionSet::Avx2:
+			return "AVX2";
+		case InstructionSet::Neon:
+			return "NEON";
+		default:
+			return "scalar";
+		}
+	}
+
+	InstructionSet activeInstructionSet() const {
+		return instructionSet;
+	}
+
+	// Frustum of a column major (glm) view projection matrix with Vulkan's [0, 1] depth range.  The planes are
+	// normalized, so plane distances are true distances and sphere radii can be compared against them directly.
+	static Frustum frustumFromMatrix(const float* m) {
+		auto row = [m](int r) { return Plane{ m[r], m[4 + r], m[8 + r], m[12 + r] }; };
+		auto add = [](Plane a, Plane b) { return Plane{ a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w }; };
+		auto subtract = [](Plane a, Plane b) { return Plane{ a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w }; };
+		Plane x = row(0), y = row(1), z = row(2), w = row(3);
+
+		Frustum frustum{ { add(w, x), subtract(w, x), add(w, y), subtract(w, y), z, subtract(w, z) } };
+		for (Plane& plane : frustum.planes) {
+			float length = std::sqrt(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+			plane = { plane.x / length, plane.y / length, plane.z / length, plane.w / length };
+		}
+		return frustum;
+	}
+
+	// Write the indices of the spheres at least partly inside frustum to visible, which must have room for count,
+	// and return how many there are.
+	uint32_t cullSpheres(const Frustum& frustum, const Spheres& spheres, uint32_t count, uint32_t* visible) const {
+		switch (instructionSet) {
+#if defined(FRUSTUM_CULLER_X86)
+		case InstructionSet::Avx2:
+			return cullSpheresAvx2(frustum, spheres, count, visible);
+		case InstructionSet::Sse:
+			return cullSpheresSse(frustum, spheres, count, visible);
+#elif defined(FRUSTUM_CULLER_NEON)
+		case InstructionSet::Neon:
+			return cullSpheresNeon(frustum, spheres, count, visible);
+#endif
+		default:
+			return cullSpheresScalar(frustum, spheres, 0, count, visible, 0);
+		}
+	}
+
+	// Same for boxes.  A box counts as outside only if it lies entirely behind one of the planes, so boxes near
+	// the frustum's corners may be kept even though they are not visible; they are never wrongly dropped.
+	uint32_t cullBoxes(const Frustum& frustum, const Boxes& boxes, uint32_t count, uint32_t* visible) const {
+		switch (instructionSet) {
+#if defined(FRUSTUM_CULLER_X86)
+		case InstructionSet::Avx2:
+			return cullBoxesAvx2(frustum, boxes, count, visible);
+		case InstructionSet::Sse:
+			return cullBoxesSse(frustum, boxes, count, visible);
+#elif defined(FRUSTUM_CULLER_NEON)
+		case InstructionSet::Neon:
+			return cullBoxesNeon(frustum, boxes, count, visible);
+#endif
+		default:
+			return cullBoxesScalar(frustum, boxes, 0, count, visible, 0);
+		}
+	}
+
+	// Transform count points in place by the affine part of the column major matrix m.
+	void transformPoints(const float* m, const Points& points, uint32_t count) const {
+		switch (instructionSet) {
+#if defined(FRUSTUM_CULLER_X86)
+		case InstructionSet::Avx2:
+			transformPointsAvx2(m, points, count);
+			return;
+		case InstructionSet::Sse:
+			transformPointsSse(m, points, count);
+			return;
+#elif defined(FRUSTUM_CULLER_NEON)
+		case InstructionSet::Neon:
+			transformPointsNeon(m, points, count);
+			return;
+#endif
+		default:
+			transformPointsScalar(m, points, 0, count);
+		}
+	}
+
+private:
+	InstructionSet instructionSet;
+
+	// Scalar kernels.  They also finish off whatever is left over after the last full SIMD register, so they
+	// take the first index and the number of visible objects found so far.
+	static uint32_t cullSpheresScalar(const Frustum& frustum, const Spheres& spheres, uint32_t first, uint32_t count,
+		uint32_t* visible, uint32_t visibleCount) {
+		for (uint32_t i = first; i < count; i++) {
+			bool inside = true;
+			for (const Plane& plane : frustum.planes) {
+				float distance = plane.x * spheres.x[i] + plane.y * spheres.y[i] + plane.z * spheres.z[i] + plane.w;
+				inside = inside && distance >= -spheres.radius[i];
+			}
+			visible[visibleCount] = i;
+			visibleCount += inside ? 1 : 0;  // Always write, only keep it if visible: no branch to mispredict.
+		}
+		return visibleCount;
+	}
+
+	static uint32_t cullBoxesScalar(const Frustum& frustum, const Boxes& boxes, uint32_t first, uint32_t count,
+		uint32_t* visible, uint32_t visibleCount) {
+		for (uint32_t i = first; i < count; i++) {
+			bool inside = true;
+			for (const Plane& plane : frustum.planes) {
+				float distance = plane.x * boxes.centerX[i] + plane.y * boxes.centerY[i] + plane.z * boxes.centerZ[i] + plane.w;
+				float reach = std::fabs(plane.x) * boxes.extentX[i] + std::fabs(plane.y) * boxes.extentY[i] +
+					std::fabs(plane.z) * boxes.extentZ[i];
+				inside = inside && distance >= -reach;
+			}
+			visible[visibleCount] = i;
+			visibleCount += inside ? 1 : 0;
+		}
+		return visibleCount;
+	}
+
+	static void transformPointsScalar(const float* m, const Points& points, uint32_t first, uint32_t count) {
+		for (uint32_t i = first; i < count; i++) {
+			float x = points.x[i], y = points.y[i], z = points.z[i];
+			points.x[i] = m[0] * x + m[4] * y + m[8] * z + m[12];
+			points.y[i] = m[1] * x + m[5] * y + m[9] * z + m[13];
+			points.z[i] = m[2] * x + m[6] * y + m[10] * z + m[14];
+		}
+	}
+
+	// Append the indices first + lane of the lanes set in mask.
+	static uint32_t appendVisible(uint32_t mask, uint32_t lanes, uint32_t first, uint32_t* visible, uint32_t visibleCount) {
+		for (uint32_t lane = 0; lane < lanes; lane++) {
+			visible[visibleCount] = first + lane;
+			visibleCount += (mask >> lane) & 1;
+		}
+		return visibleCount;
+	}
+
+#if defined(FRUSTUM_CULLER_X86)
+	static bool cpuHasAvx2() {
+		// AVX2 needs the CPU to have it (leaf 7, EBX bit 5) and the OS to save the YMM registers (OSXSAVE, and
+		// XCR0 bits 1 and 2).
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) {
+			return false;
+		}
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+		if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+			return false;
+		}
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");  // Checks the OS support as well.
+#endif
+	}
+
+	static uint32_t cullSpheresSse(const Frustum& frustum, const Spheres& spheres, uint32_t count, uint32_t* visible) {
+		uint32_t visibleCount = 0;
+		uint32_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m128 x = _mm_loadu_ps(spheres.x + i);
+			__m128 y = _mm_loadu_ps(spheres.y + i);
+			__m128 z = _mm_loadu_ps(spheres.z + i);
+			__m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(spheres.radius + i));
+			__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			for (const Plane& plane : frustum.planes) {
+				__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), x), _mm_mul_ps(_mm_set1_ps(plane.y), y)),
+					_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.z), z), _mm_set1_ps(plane.w)));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+			}
+			visibleCount = appendVisible(static_cast<uint32_t>(_mm_movemask_ps(inside)), 4, i, visible, visibleCount);
+		}
+		return cullSpheresScalar(frustum, spheres, i, count, visible, visibleCount);
+	}
+
+	static uint32_t cullBoxesSse(const Frustum& frustum, const Boxes& boxes, uint32_t count, uint32_t* visible) {
+		uint32_t visibleCount = 0;
+		uint32_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m128 x = _mm_loadu_ps(boxes.centerX + i);
+			__m128 y = _mm_loadu_ps(boxes.centerY + i);
+			__m128 z = _mm_loadu_ps(boxes.centerZ + i);
+			__m128 extentX = _mm_loadu_ps(boxes.extentX + i);
+			__m128 extentY = _mm_loadu_ps(boxes.extentY + i);
+			__m128 extentZ = _mm_loadu_ps(boxes.extentZ + i);
+			__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			for (const Plane& plane : frustum.planes) {
+				__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), x), _mm_mul_ps(_mm_set1_ps(plane.y), y)),
+					_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.z), z), _mm_set1_ps(plane.w)));
+				__m128 reach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(std::fabs(plane.x)), extentX),
+					_mm_mul_ps(_mm_set1_ps(std::fabs(plane.y)), extentY)), _mm_mul_ps(_mm_set1_ps(std::fabs(plane.z)), extentZ));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, _mm_sub_ps(_mm_setzero_ps(), reach)));
+			}
+			visibleCount = appendVisible(static_cast<uint32_t>(_mm_movemask_ps(inside)), 4, i, visible, visibleCount);
+		}
+		return cullBoxesScalar(frustum, boxes, i, count, visible, visibleCount);
+	}
+
+	static void transformPointsSse(const float* m, const Points& points, uint32_t count) {
+		uint32_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m128 x = _mm_loadu_ps(points.x + i);
+			__m128 y = _mm_loadu_ps(points.y + i);
+			__m128 z = _mm_loadu_ps(points.z + i);
+			for (int r = 0; r < 3; r++) {
+				__m128 result = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[r]), x), _mm_mul_ps(_mm_set1_ps(m[4 + r]), y)),
+					_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[8 + r]), z), _mm_set1_ps(m[12 + r])));
+				float* out = r == 0 ? points.x : r == 1 ? points.y : points.z;
+				_mm_storeu_ps(out + i, result);
+			}
+		}
+		transformPointsScalar(m, points, i, count);
+	}
+
+	FRUSTUM_CULLER_AVX2_TARGET
+	static uint32_t cullSpheresAvx2(const Frustum& frustum, const Spheres& spheres, uint32_t count, uint32_t* visible) {
+		uint32_t visibleCount = 0;
+		uint32_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m256 x = _mm256_loadu_ps(spheres.x + i);
+			__m256 y = _mm256_loadu_ps(spheres.y + i);
+			__m256 z = _mm256_loadu_ps(spheres.z + i);
+			__m256 negativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(spheres.radius + i));
+			__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+			for (const Plane& plane : frustum.planes) {
+				__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.x), x), _mm256_mul_ps(_mm256_set1_ps(plane.y), y)),
+					_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.z), z), _mm256_set1_ps(plane.w)));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negativeRadius, _CMP_GE_OQ));
+			}
+			visibleCount = appendVisible(static_cast<uint32_t>(_mm256_movemask_ps(inside)), 8, i, visible, visibleCount);
+		}
+		return cullSpheresScalar(frustum, spheres, i, count, visible, visibleCount);
+	}
+
+	FRUSTUM_CULLER_AVX2_TARGET
+	static uint32_t cullBoxesAvx2(const Frustum& frustum, const Boxes& boxes, uint32_t count, uint32_t* visible) {
+		uint32_t visibleCount = 0;
+		uint32_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m256 x = _mm256_loadu_ps(boxes.centerX + i);
+			__m256 y = _mm256_loadu_ps(boxes.centerY + i);
+			__m256 z = _mm256_loadu_ps(boxes.centerZ + i);
+			__m256 extentX = _mm256_loadu_ps(boxes.extentX + i);
+			__m256 extentY = _mm256_loadu_ps(boxes.extentY + i);
+			__m256 extentZ = _mm256_loadu_ps(boxes.extentZ + i);
+			__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+			for (const Plane& plane : frustum.planes) {
+				__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.x), x), _mm256_mul_ps(_mm256_set1_ps(plane.y), y)),
+					_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.z), z), _mm256_set1_ps(plane.w)));
+				__m256 reach = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(std::fabs(plane.x)), extentX),
+					_mm256_mul_ps(_mm256_set1_ps(std::fabs(plane.y)), extentY)), _mm256_mul_ps(_mm256_set1_ps(std::fabs(plane.z)), extentZ));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, _mm256_sub_ps(_mm256_setzero_ps(), reach), _CMP_GE_OQ));
+			}
+			visibleCount = appendVisible(static_cast<uint32_t>(_mm256_movemask_ps(inside)), 8, i, visible, visibleCount);
+		}
+		return cullBoxesScalar(frustum, boxes, i, count, visible, visibleCount);
+	}
+
+	FRUSTUM_CULLER_AVX2_TARGET
+	static void transformPointsAvx2(const float* m, const Points& points, uint32_t count) {
+		uint32_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m256 x = _mm256_loadu_ps(points.x + i);
+			__m256 y = _mm256_loadu_ps(points.y + i);
+			__m256 z = _mm256_loadu_ps(points.z + i);
+			for (int r = 0; r < 3; r++) {
+				__m256 result = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[r]), x), _mm256_mul_ps(_mm256_set1_ps(m[4 + r]), y)),
+					_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[8 + r]), z), _mm256_set1_ps(m[12 + r])));
+				float* out = r == 0 ? points.x : r == 1 ? points.y : points.z;
+				_mm256_storeu_ps(out + i, result);
+			}
+		}
+		transformPointsScalar(m, points, i, count);
+	}
+#endif
+
+#if defined(FRUSTUM_CULLER_NEON)
+	// NEON has no movemask: pick one bit per lane and add them up.
+	static uint32_t laneMask(uint32x4_t inside) {
+		const uint32_t bitValues[4] = { 1, 2, 4, 8 };
+		uint32x4_t bits = vandq_u32(inside, vld1q_u32(bitValues));
+		uint32x2_t pairs = vadd_u32(vget_low_u32(bits), vget_high_u32(bits));
+		return vget_lane_u32(vpadd_u32(pairs, pairs), 0);
+	}
+
+	static uint32_t cullSpheresNeon(const Frustum& frustum, const Spheres& spheres, uint32_t count, uint32_t* visible) {
+		uint32_t visibleCount = 0;
+		uint32_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			float32x4_t x = vld1q_f32(spheres.x + i);
+			float32x4_t y = vld1q_f32(spheres.y + i);
+			float32x4_t z = vld1q_f32(spheres.z + i);
+			float32x4_t negativeRadius = vnegq_f32(vld1q_f32(spheres.radius + i));
+			uint32x4_t inside = vdupq_n_u32(~0u);
+			for (const Plane& plane : frustum.planes) {
+				float32x4_t distance = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(plane.w), x, plane.x), y, plane.y), z, plane.z);
+				inside = vandq_u32(inside, vcgeq_f32(distance, negativeRadius));
+			}
+			visibleCount = appendVisible(laneMask(inside), 4, i, visible, visibleCount);
+		}
+		return cullSpheresScalar(frustum, spheres, i, count, visible, visibleCount);
+	}
+
+	static uint32_t cullBoxesNeon(const Frustum& frustum, const Boxes& boxes, uint32_t count, uint32_t* visible) {
+		uint32_t visibleCount = 0;
+		uint32_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			float32x4_t x = vld1q_f32(boxes.centerX + i);
+			float32x4_t y = vld1q_f32(boxes.centerY + i);
+			float32x4_t z = vld1q_f32(boxes.centerZ + i);
+			float32x4_t extentX = vld1q_f32(boxes.extentX + i);
+			float32x4_t extentY = vld1q_f32(boxes.extentY + i);
+			float32x4_t extentZ = vld1q_f32(boxes.extentZ + i);
+			uint32x4_t inside = vdupq_n_u32(~0u);
+			for (const Plane& plane : frustum.planes) {
+				float32x4_t distance = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(plane.w), x, plane.x), y, plane.y), z, plane.z);
+				float32x4_t reach = vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(extentX, std::fabs(plane.x)), extentY, std::fabs(plane.y)),
+					extentZ, std::fabs(plane.z));
+				inside = vandq_u32(inside, vcgeq_f32(distance, vnegq_f32(reach)));
+			}
+			visibleCount = appendVisible(laneMask(inside), 4, i, visible, visibleCount);
+		}
+		return cullBoxesScalar(frustum, boxes, i, count, visible, visibleCount);
+	}
+
+	static void transformPointsNeon(const float* m, const Points& points, uint32_t count) {
+		uint32_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			float32x4_t x = vld1q_f32(points.x + i);
+			float32x4_t y = vld1q_f32(points.y + i);
+			float32x4_t z = vld1q_f32(points.z + i);
+			for (int r = 0; r < 3; r++) {
+				float32x4_t result = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(m[12 + r]), x, m[r]), y, m[4 + r]), z, m[8 + r]);
+				float* out = r == 0 ? points.x : r == 1 ? points.y : points.z;
+				vst1q_f32(out + i, result);
+			}
+		}
+		transformPointsScalar(m, points, i, count);
+	}
+#endif
+};
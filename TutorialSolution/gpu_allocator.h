@@ -0,0 +1,392 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+// GPU memory sub-allocator.
+//
+// Drivers only guarantee maxMemoryAllocationCount (often 4096) live vkAllocateMemory calls, and every call can be
+// slow and rounds up to a large page.  Instead, memory is taken from the driver in big blocks, one set of blocks
+// per memory type, and every buffer or image gets a piece of a block.
+//
+// Each block is split with a buddy allocator: the block is a power of two in size, and a request is rounded up to
+// a power of two node.  Larger free nodes are halved until one of the right size exists, and freed nodes merge
+// back with their neighbour ("buddy") whenever that one is free too.  Node offsets are multiples of their size, so
+// any power of two alignment up to the node size comes for free.
+//
+// bufferImageGranularity is the page size at which the GPU can tell linear resources (buffers, linear images) from
+// optimally tiled images.  A linear and a tiled resource must never share such a page.  Rather than padding every
+// neighbour, linear and tiled resources simply come from separate pools of blocks.
+//
+// Requests larger than half a block, and render targets whose caller asks for it, get a vkAllocateMemory of their
+// own.  Given the image or buffer (allocateImage, allocateBuffer), that is a real dedicated allocation: the driver
+// is told through VkMemoryDedicatedAllocateInfo which resource the memory is for, so it can place and compress it
+// as it sees fit, and resources the driver prefers or requires to have one get one.  Host visible blocks are
+// mapped once when created and stay mapped.
+
+enum class GpuResourceKind : uint32_t {
+	Linear,   // Buffers and VK_IMAGE_TILING_LINEAR images.
+	Optimal,  // VK_IMAGE_TILING_OPTIMAL images.
+};
+
+// One block of device memory carved up by the buddy allocator.
+struct GpuMemoryBlock {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize size = 0;
+	uint8_t* mapped = nullptr;
+	std::vector<std::set<VkDeviceSize>> freeNodes; // [order] offsets of free nodes of size minNodeSize << order.
+	uint32_t allocationCount = 0;
+};
+
+struct GpuAllocation {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;       // Size that was asked for.
+	void* mapped = nullptr;      // Host pointer to offset when the memory is host visible, otherwise nullptr.
+
+	// Bookkeeping for GpuAllocator::free.
+	GpuMemoryBlock* block = nullptr; // nullptr for dedicated allocations.
+	uint32_t memoryTypeIndex = 0;
+	uint32_t order = 0;
+	GpuResourceKind kind = GpuResourceKind::Linear;
+};
+
+struct GpuAllocatorStats {
+	uint32_t deviceAllocations = 0;  // Live vkAllocateMemory calls, blocks and dedicated allocations together.
+	uint32_t blocks = 0;
+	uint32_t allocations = 0;        // Live sub-allocations.
+	uint32_t dedicatedAllocations = 0;
+	VkDeviceSize blockBytes = 0;     // Memory held in blocks, used or not.
+	VkDeviceSize usedBytes = 0;      // Bytes of blocks handed out, including rounding up to the node size.
+	VkDeviceSize requestedBytes = 0; // Bytes actually asked for in sub-allocations.
+	VkDeviceSize dedicatedBytes = 0;
+};
+
+class GpuAllocator {
+public:
+	static constexpr VkDeviceSize MIN_NODE_SIZE = 256;
+	static constexpr VkDeviceSize DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024;
+
+	GpuAllocator() = default;
+	GpuAllocator(const GpuAllocator&) = delete;
+	GpuAllocator& operator=(const GpuAllocator&) = delete;
+
+	void init(VkPhysicalDevice physicalDevice, VkDevice logicalDevice, VkDeviceSize preferredBlockSize = DEFAULT_BLOCK_SIZE) {
+		device = logicalDevice;
+		vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		nonCoherentAtomSize = properties.limits.nonCoherentAtomSize;
+		maxDeviceAllocations = properties.limits.maxMemoryAllocationCount;
+
+		pools.resize(memoryProperties.memoryTypeCount * 2);
+		for (uint32_t type = 0; type < memoryProperties.memoryTypeCount; type++) {
+			// Small heaps, such as the 256 MB of device local memory the CPU can see directly, get smaller blocks
+			// so that one block does not eat a large share of the heap.
+			VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[type].heapIndex].size;
+			VkDeviceSize blockSize = preferredBlockSize;
+			while (blockSize > MIN_NODE_SIZE * 64 && blockSize > heapSize / 8) {
+				blockSize /= 2;
+			}
+			pools[type * 2].blockSize = pools[type * 2 + 1].blockSize = blockSize;
+		}
+	}
+
+	// Release every block.  All allocations must have been freed already.
+	void destroy() {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& pool : pools) {
+			for (auto& block : pool.blocks) {
+				vkFreeMemory(device, block->memory, nullptr);
+			}
+			pool.blocks.clear();
+		}
+		deviceAllocationCount = subAllocationCount = dedicatedCount = 0;
+		usedBytes = requestedBytes = dedicatedBytes = 0;
+	}
+
+	// Pick a memory type allowed by typeBits that has all of the required flags, favouring one that also has the
+	// preferred flags.
+	uint32_t findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred = 0) const {
+		for (VkMemoryPropertyFlags wanted : { required | preferred, required }) {
+			for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+				if ((typeBits & (1 << i)) && (memoryProperties.memoryTypes[i].propertyFlags & wanted) == wanted) {
+					return i;
+				}
+			}
+		}
+
+		throw std::runtime_error("failed to find suitable memory type!");
+	}
+
+	// Allocate memory with the given requirements.  dedicated asks for a vkAllocateMemory of its own, which the
+	// driver does not know belongs to any one resource: for memory that several resources share, say.  Memory for
+	// a single image or buffer should come from allocateImage or allocateBuffer instead.
+	GpuAllocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags required, GpuResourceKind kind,
+		bool dedicated = false, VkMemoryPropertyFlags preferred = 0) {
+		return allocateMemory(requirements, required, kind, dedicated, preferred, VK_NULL_HANDLE, VK_NULL_HANDLE);
+	}
+
+	// Allocate memory for image, which the caller then binds.  dedicated asks for a dedicated allocation, which is
+	// what large render targets want; the driver may ask for one regardless.
+	GpuAllocation allocateImage(VkImage image, VkMemoryPropertyFlags required, GpuResourceKind kind,
+		bool dedicated = false, VkMemoryPropertyFlags preferred = 0) {
+		VkImageMemoryRequirementsInfo2 info{};
+		info.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+		info.image = image;
+		VkMemoryDedicatedRequirements dedicatedRequirements{};
+		dedicatedRequirements.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+		VkMemoryRequirements2 requirements{};
+		requirements.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+		requirements.pNext = &dedicatedRequirements;
+		vkGetImageMemoryRequirements2(device, &info, &requirements);
+
+		dedicated = dedicated || dedicatedRequirements.prefersDedicatedAllocation || dedicatedRequirements.requiresDedicatedAllocation;
+		return allocateMemory(requirements.memoryRequirements, required, kind, dedicated, preferred, image, VK_NULL_HANDLE);
+	}
+
+	// Allocate memory for buffer, which the caller then binds.
+	GpuAllocation allocateBuffer(VkBuffer buffer, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred = 0) {
+		VkBufferMemoryRequirementsInfo2 info{};
+		info.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2;
+		info.buffer = buffer;
+		VkMemoryDedicatedRequirements dedicatedRequirements{};
+		dedicatedRequirements.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+		VkMemoryRequirements2 requirements{};
+		requirements.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+		requirements.pNext = &dedicatedRequirements;
+		vkGetBufferMemoryRequirements2(device, &info, &requirements);
+
+		bool dedicated = dedicatedRequirements.prefersDedicatedAllocation || dedicatedRequirements.requiresDedicatedAllocation;
+		return allocateMemory(requirements.memoryRequirements, required, GpuResourceKind::Linear, dedicated, preferred,
+			VK_NULL_HANDLE, buffer);
+	}
+
+	void free(GpuAllocation& allocation) {
+		if (allocation.memory == VK_NULL_HANDLE) {
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (allocation.block == nullptr) {
+			vkFreeMemory(device, allocation.memory, nullptr);
+			deviceAllocationCount--;
+			dedicatedCount--;
+			dedicatedBytes -= allocation.size;
+			allocation = GpuAllocation{};
+			return;
+		}
+
+		GpuMemoryBlock& block = *allocation.block;
+		VkDeviceSize offset = allocation.offset;
+		uint32_t order = allocation.order;
+		while (order + 1 < block.freeNodes.size()) {
+			VkDeviceSize buddy = offset ^ (MIN_NODE_SIZE << order);
+			auto it = block.freeNodes[order].find(buddy);
+			if (it == block.freeNodes[order].end()) {
+				break;
+			}
+			block.freeNodes[order].erase(it);
+			offset = std::min(offset, buddy);
+			order++;
+		}
+		block.freeNodes[order].insert(offset);
+		block.allocationCount--;
+		usedBytes -= MIN_NODE_SIZE << allocation.order;
+		requestedBytes -= allocation.size;
+		subAllocationCount--;
+
+		// Hand empty blocks back to the driver, but keep one per pool around so that creating and destroying a
+		// single resource over and over does not allocate a block every time.
+		Pool& pool = pools[allocation.memoryTypeIndex * 2 + static_cast<uint32_t>(allocation.kind)];
+		if (block.allocationCount == 0 && pool.blocks.size() > 1) {
+			vkFreeMemory(device, block.memory, nullptr);
+			deviceAllocationCount--;
+			pool.blocks.erase(std::find_if(pool.blocks.begin(), pool.blocks.end(),
+				[&](const std::unique_ptr<GpuMemoryBlock>& candidate) { return candidate.get() == &block; }));
+		}
+
+		allocation = GpuAllocation{};
+	}
+
+	GpuAllocatorStats stats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		GpuAllocatorStats result;
+		result.deviceAllocations = deviceAllocationCount;
+		result.allocations = subAllocationCount;
+		result.dedicatedAllocations = dedicatedCount;
+		result.usedBytes = usedBytes;
+		result.requestedBytes = requestedBytes;
+		result.dedicatedBytes = dedicatedBytes;
+		for (const auto& pool : pools) {
+			result.blocks += static_cast<uint32_t>(pool.blocks.size());
+			for (const auto& block : pool.blocks) {
+				result.blockBytes += block->size;
+			}
+		}
+		return result;
+	}
+
+	void printStats(std::ostream& out) {
+		GpuAllocatorStats s = stats();
+		const double mb = 1024.0 * 1024.0;
+		out << "gpu memory: " << s.deviceAllocations << " device allocations (limit " << maxDeviceAllocations << "), "
+			<< s.blocks << " blocks holding " << s.blockBytes / mb << " MB, "
+			<< s.allocations << " sub-allocations using " << s.usedBytes / mb << " MB (" << s.requestedBytes / mb << " MB requested), "
+			<< s.dedicatedAllocations << " dedicated using " << s.dedicatedBytes / mb << " MB\n";
+	}
+
+private:
+	struct Pool {
+		VkDeviceSize blockSize = DEFAULT_BLOCK_SIZE;
+		std::vector<std::unique_ptr<GpuMemoryBlock>> blocks;
+	};
+
+	VkDevice device = VK_NULL_HANDLE;
+	VkPhysicalDeviceMemoryProperties memoryProperties{};
+	VkDeviceSize nonCoherentAtomSize = 1;
+	uint32_t maxDeviceAllocations = 0;
+	std::vector<Pool> pools; // [memoryTypeIndex * 2 + GpuResourceKind]
+	std::mutex mutex;
+
+	uint32_t deviceAllocationCount = 0;
+	uint32_t subAllocationCount = 0;
+	uint32_t dedicatedCount = 0;
+	VkDeviceSize usedBytes = 0;
+	VkDeviceSize requestedBytes = 0;
+	VkDeviceSize dedicatedBytes = 0;
+
+	GpuAllocation allocateMemory(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags required, GpuResourceKind kind,
+		bool dedicated, VkMemoryPropertyFlags preferred, VkImage image, VkBuffer buffer) {
+		std::lock_guard<std::mutex> lock(mutex);
+
+		GpuAllocation allocation;
+		allocation.memoryTypeIndex = findMemoryType(requirements.memoryTypeBits, required, preferred);
+		allocation.size = requirements.size;
+		allocation.kind = kind;
+
+		VkMemoryPropertyFlags flags = memoryProperties.memoryTypes[allocation.memoryTypeIndex].propertyFlags;
+		VkDeviceSize alignment = requirements.alignment;
+		if ((flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && !(flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+			// Flushes and invalidates work in whole atoms, so keep neighbours from sharing one.
+			alignment = std::max(alignment, nonCoherentAtomSize);
+		}
+
+		Pool& pool = pools[allocation.memoryTypeIndex * 2 + static_cast<uint32_t>(kind)];
+		VkDeviceSize nodeSize = MIN_NODE_SIZE;
+		while (nodeSize < requirements.size || nodeSize < alignment) {
+			nodeSize *= 2;
+		}
+
+		// Too big to share a block: that is a dedicated allocation too, whether the caller asked for one or not.
+		if (dedicated || nodeSize > pool.blockSize / 2) {
+			VkMemoryDedicatedAllocateInfo dedicatedInfo{};
+			dedicatedInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+			dedicatedInfo.image = image;
+			dedicatedInfo.buffer = buffer;
+			bool forResource = image != VK_NULL_HANDLE || buffer != VK_NULL_HANDLE;
+			allocation.memory = allocateDeviceMemory(requirements.size, allocation.memoryTypeIndex, forResource ? &dedicatedInfo : nullptr);
+			allocation.mapped = mapIfHostVisible(allocation.memory, allocation.memoryTypeIndex);
+			dedicatedCount++;
+			dedicatedBytes += requirements.size;
+			return allocation;
+		}
+
+		while ((MIN_NODE_SIZE << allocation.order) < nodeSize) {
+			allocation.order++;
+		}
+
+		for (auto& block : pool.blocks) {
+			if (allocateNode(*block, allocation)) {
+				return allocation;
+			}
+		}
+
+		// Every block is full (or too fragmented), so grab another one from the driver.
+		auto block = std::make_unique<GpuMemoryBlock>();
+		block->size = pool.blockSize;
+		block->memory = allocateDeviceMemory(block->size, allocation.memoryTypeIndex, nullptr);
+		block->mapped = static_cast<uint8_t*>(mapIfHostVisible(block->memory, allocation.memoryTypeIndex));
+		uint32_t maxOrder = 0;
+		while ((MIN_NODE_SIZE << maxOrder) < block->size) {
+			maxOrder++;
+		}
+		block->freeNodes.resize(maxOrder + 1);
+		block->freeNodes[maxOrder].insert(0);
+
+		allocateNode(*block, allocation);
+		pool.blocks.push_back(std::move(block));
+		return allocation;
+	}
+
+	// Take a free node of allocation.order from block, splitting a larger one if needed.
+	bool allocateNode(GpuMemoryBlock& block, GpuAllocation& allocation) {
+		uint32_t order = allocation.order;
+		while (order < block.freeNodes.size() && block.freeNodes[order].empty()) {
+			order++;
+		}
+		if (order >= block.freeNodes.size()) {
+			return false;
+		}
+
+		VkDeviceSize offset = *block.freeNodes[order].begin();
+		block.freeNodes[order].erase(block.freeNodes[order].begin());
+		while (order > allocation.order) {
+			order--;
+			block.freeNodes[order].insert(offset + (MIN_NODE_SIZE << order)); // Keep the first half, free the second.
+		}
+
+		allocation.memory = block.memory;
+		allocation.offset = offset;
+		allocation.block = &block;
+		allocation.mapped = block.mapped ? block.mapped + offset : nullptr;
+		block.allocationCount++;
+		usedBytes += MIN_NODE_SIZE << allocation.order;
+		requestedBytes += allocation.size;
+		subAllocationCount++;
+		return true;
+	}
+
+	VkDeviceMemory allocateDeviceMemory(VkDeviceSize size, uint32_t memoryTypeIndex, const VkMemoryDedicatedAllocateInfo* dedicatedInfo) {
+		if (deviceAllocationCount >= maxDeviceAllocations) {
+			throw std::runtime_error("exceeded maxMemoryAllocationCount!");
+		}
+
+		VkMemoryAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocInfo.pNext = dedicatedInfo;
+		allocInfo.allocationSize = size;
+		allocInfo.memoryTypeIndex = memoryTypeIndex;
+
+		VkDeviceMemory memory;
+		if (vkAllocateMemory(device, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+			throw std::runtime_error("failed to allocate device memory!");
+		}
+		deviceAllocationCount++;
+		return memory;
+	}
+
+	void* mapIfHostVisible(VkDeviceMemory memory, uint32_t memoryTypeIndex) {
+		if (!(memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+			return nullptr;
+		}
+
+		// Memory that cannot be mapped is of no use to the caller, so it goes back right away.
+		void* data;
+		if (vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS) {
+			vkFreeMemory(device, memory, nullptr);
+			deviceAllocationCount--;
+			throw std::runtime_error("failed to map device memory!");
+		}
+		return data;
+	}
+};
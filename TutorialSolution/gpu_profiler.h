@@ -0,0 +1,205 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// GPU timestamp profiler.
+//
+// vkCmdWriteTimestamp stores the GPU clock into a query once all earlier commands have reached the given pipeline
+// stage.  Writing one timestamp at the start and one at the end of a region and subtracting the two gives the time
+// the GPU spent on it, in ticks of timestampPeriod nanoseconds.
+//
+// Results are only read back once the frame has finished on the GPU, so vkGetQueryPoolResults never has to wait.
+// To make that possible every frame in flight has its own query pool.  The pools are reset from the host
+// (hostQueryReset, core in Vulkan 1.2) right after reading, which keeps vkCmdResetQueryPool out of the command
+// buffers so that pre-recorded ones keep working.
+//
+// Every named region owns a fixed pair of queries and may be written at most once per frame.  The last
+// HISTORY_SIZE samples of every region are kept, and each reportInterval frames their min/avg/p99 are printed to
+// stdout or appended to a CSV file.
+class GpuProfiler {
+public:
+	static constexpr uint32_t NO_REGION = UINT32_MAX;
+	static constexpr size_t HISTORY_SIZE = 256;
+
+	GpuProfiler() = default;
+	GpuProfiler(const GpuProfiler&) = delete;
+	GpuProfiler& operator=(const GpuProfiler&) = delete;
+
+	// Returns false, and leaves the profiler disabled, if the device cannot do host query resets.
+	bool init(VkPhysicalDevice physicalDevice, VkDevice logicalDevice, bool hostQueryResetEnabled, uint32_t framesInFlight,
+		uint32_t maxRegions, uint32_t reportIntervalFrames, const std::string& csvPath) {
+		if (!hostQueryResetEnabled) {
+			return false;
+		}
+
+		device = logicalDevice;
+		regionCapacity = maxRegions;
+		reportInterval = std::max(reportIntervalFrames, 1u);
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		timestampPeriod = properties.limits.timestampPeriod;
+
+		VkQueryPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		poolInfo.queryCount = regionCapacity * 2;
+
+		queryPools.resize(framesInFlight);
+		for (auto& pool : queryPools) {
+			if (vkCreateQueryPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+				throw std::runtime_error("failed to create query pool!");
+			}
+			// Queries have to be reset once before their first use.
+			vkResetQueryPool(device, pool, 0, poolInfo.queryCount);
+		}
+
+		if (!csvPath.empty()) {
+			csv.open(csvPath, std::ios::trunc);
+			if (!csv.is_open()) {
+				std::cerr << "failed to open " << csvPath << ", printing gpu timings to stdout instead" << std::endl;
+			}
+			else {
+				csv << "frame,region,min_ms,avg_ms,p99_ms\n";
+			}
+		}
+
+		enabled = true;
+		return true;
+	}
+
+	void destroy() {
+		for (auto pool : queryPools) {
+			vkDestroyQueryPool(device, pool, nullptr);
+		}
+		queryPools.clear();
+		enabled = false;
+	}
+
+	// Register a region timed on queues with the given timestampValidBits (VkQueueFamilyProperties).  Returns
+	// NO_REGION when the profiler is disabled, the queue family has no timestamps or every slot is taken; begin
+	// and end simply ignore it.
+	uint32_t registerRegion(const std::string& name, uint32_t timestampValidBits) {
+		if (!enabled || timestampValidBits == 0 || regions.size() == regionCapacity) {
+			return NO_REGION;
+		}
+		Region region;
+		region.name = name;
+		region.mask = timestampValidBits >= 64 ? UINT64_MAX : (uint64_t(1) << timestampValidBits) - 1;
+		regions.push_back(region);
+		return static_cast<uint32_t>(regions.size() - 1);
+	}
+
+	void begin(VkCommandBuffer commandBuffer, uint32_t frame, uint32_t region) {
+		if (region != NO_REGION) {
+			vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPools[frame], region * 2);
+		}
+	}
+
+	void end(VkCommandBuffer commandBuffer, uint32_t frame, uint32_t region) {
+		if (region != NO_REGION) {
+			vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPools[frame], region * 2 + 1);
+		}
+	}
+
+	// Read the results of the last submit of frame and reset its queries for the next one.  Only call this once the
+	// frame has finished on the GPU.
+	void collect(uint32_t frame) {
+		if (!enabled || regions.empty()) {
+			return;
+		}
+
+		// Each query returns its value followed by an availability word.  Regions that were not written last time
+		// (or frames that were never submitted) simply come back unavailable, which is not an error.
+		const uint32_t queryCount = static_cast<uint32_t>(regions.size()) * 2;
+		std::vector<uint64_t> results(queryCount * 2);
+		VkResult result = vkGetQueryPoolResults(device, queryPools[frame], 0, queryCount, results.size() * sizeof(uint64_t),
+			results.data(), sizeof(uint64_t) * 2, VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+		if (result != VK_SUCCESS && result != VK_NOT_READY) {
+			throw std::runtime_error("failed to read timestamp queries!");
+		}
+		vkResetQueryPool(device, queryPools[frame], 0, queryCount);
+
+		bool anySample = false;
+		for (size_t i = 0; i < regions.size(); i++) {
+			const uint64_t* beginQuery = &results[i * 4];
+			const uint64_t* endQuery = &results[i * 4 + 2];
+			if (beginQuery[1] == 0 || endQuery[1] == 0) {
+				continue;
+			}
+			uint64_t ticks = (endQuery[0] - beginQuery[0]) & regions[i].mask;
+			regions[i].addSample(static_cast<double>(ticks) * timestampPeriod * 1e-6);
+			anySample = true;
+		}
+
+		if (anySample && ++collectedFrames % reportInterval == 0) {
+			report();
+		}
+	}
+
+private:
+	struct Region {
+		std::string name;
+		uint64_t mask = UINT64_MAX;
+		std::vector<double> history; // Milliseconds, used as a ring buffer once full.
+		size_t next = 0;
+
+		void addSample(double milliseconds) {
+			if (history.size() < HISTORY_SIZE) {
+				history.push_back(milliseconds);
+			}
+			else {
+				history[next] = milliseconds;
+				next = (next + 1) % HISTORY_SIZE;
+			}
+		}
+	};
+
+	bool enabled = false;
+	VkDevice device = VK_NULL_HANDLE;
+	float timestampPeriod = 1.0f;
+	uint32_t regionCapacity = 0;
+	uint32_t reportInterval = 1;
+	uint64_t collectedFrames = 0;
+	std::vector<VkQueryPool> queryPools; // One per frame in flight.
+	std::vector<Region> regions;
+	std::ofstream csv;
+
+	void report() {
+		for (const auto& region : regions) {
+			if (region.history.empty()) {
+				continue;
+			}
+			std::vector<double> sorted = region.history;
+			std::sort(sorted.begin(), sorted.end());
+			double sum = 0.0;
+			for (double sample : sorted) {
+				sum += sample;
+			}
+			double minimum = sorted.front();
+			double average = sum / sorted.size();
+			double p99 = sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)];
+
+			if (csv.is_open()) {
+				csv << collectedFrames << "," << region.name << "," << minimum << "," << average << "," << p99 << "\n";
+			}
+			else {
+				std::cout << std::fixed << std::setprecision(3) << "gpu " << region.name << ": min " << minimum
+					<< " ms, avg " << average << " ms, p99 " << p99 << " ms\n";
+				std::cout.unsetf(std::ios::floatfield);
+			}
+		}
+		if (csv.is_open()) {
+			csv.flush();
+		}
+	}
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Minimal fork/join job system.
+//
+// parallelFor hands out a batch of jobs to a fixed set of worker threads and blocks until all of them have run.
+// The calling thread works on the batch too instead of sleeping.  Jobs are pulled from a shared counter, so a
+// thread that finishes early simply takes the next one.
+//
+// Each participating thread has a stable index in [0, threadCount()).  The calling thread is always index 0 and
+// the workers are 1..threadCount()-1.  Callers use that index to keep per-thread state, such as a VkCommandPool,
+// that is never touched by two threads at the same time and therefore needs no locking.
+class JobSystem {
+public:
+	using Job = std::function<void(uint32_t jobIndex, uint32_t threadIndex)>;
+
+	// threadCount includes the calling thread, so JobSystem(1) runs everything inline.
+	explicit JobSystem(uint32_t threadCount) {
+		for (uint32_t i = 1; i < threadCount; i++) {
+			workers.emplace_back([this, i]() { workerLoop(i); });
+		}
+	}
+
+	~JobSystem() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeWorkers.notify_all();
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator=(const JobSystem&) = delete;
+
+	uint32_t threadCount() const {
+		return static_cast<uint32_t>(workers.size()) + 1;
+	}
+
+	// Run job(i, threadIndex) for every i in [0, jobCount).  If any job throws, the first exception is rethrown
+	// here once the whole batch has finished.
+	void parallelFor(uint32_t jobCount, const Job& job) {
+		if (jobCount == 0) {
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			currentJob = &job;
+			batchSize = jobCount;
+			remainingJobs = jobCount;
+			nextJob.store(0);
+			batchError = nullptr;
+			batchId++;
+		}
+		wakeWorkers.notify_all();
+
+		runJobs(job, jobCount, 0);
+
+		// Also wait for workers that joined the batch to leave it, so none of them is still holding a pointer to
+		// job when the next batch resets the counter.
+		std::unique_lock<std::mutex> lock(mutex);
+		batchDone.wait(lock, [this]() { return remainingJobs == 0 && activeWorkers == 0; });
+		currentJob = nullptr;
+		if (batchError) {
+			std::rethrow_exception(batchError);
+		}
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wakeWorkers; // Signaled when a new batch starts or on shutdown.
+	std::condition_variable batchDone;   // Signaled when the last job of a batch finishes.
+	const Job* currentJob = nullptr;
+	uint32_t batchSize = 0;
+	uint32_t remainingJobs = 0;
+	uint32_t activeWorkers = 0; // Workers currently pulling jobs from the batch.
+	uint64_t batchId = 0;
+	std::atomic<uint32_t> nextJob{ 0 };
+	std::exception_ptr batchError;
+	bool stopping = false;
+
+	void workerLoop(uint32_t threadIndex) {
+		uint64_t seenBatch = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			wakeWorkers.wait(lock, [&]() { return stopping || batchId != seenBatch; });
+			if (stopping) {
+				return;
+			}
+			seenBatch = batchId;
+			if (currentJob == nullptr) {
+				continue;  // Woke up after the batch was already finished.
+			}
+			const Job* job = currentJob;
+			uint32_t jobCount = batchSize;
+			activeWorkers++;
+			lock.unlock();
+
+			runJobs(*job, jobCount, threadIndex);
+
+			lock.lock();
+			activeWorkers--;
+			if (remainingJobs == 0 && activeWorkers == 0) {
+				batchDone.notify_one();
+			}
+		}
+	}
+
+	void runJobs(const Job& job, uint32_t jobCount, uint32_t threadIndex) {
+		uint32_t finished = 0;
+		for (uint32_t i = nextJob.fetch_add(1); i < jobCount; i = nextJob.fetch_add(1)) {
+			try {
+				job(i, threadIndex);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!batchError) {
+					batchError = std::current_exception();
+				}
+			}
+			finished++;
+		}
+
+		if (finished > 0) {
+			std::lock_guard<std::mutex> lock(mutex);
+			remainingJobs -= finished;
+			if (remainingJobs == 0 && activeWorkers == 0) {
+				batchDone.notify_one();
+			}
+		}
+	}
+};
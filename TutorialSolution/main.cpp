@@ -1,6 +1,8 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
+#include <glm/glm.hpp>
+
 #include <optional>
 #include <iostream>
 #include <stdexcept>
@@ -10,6 +12,31 @@
 #include <cstdint> // Necessary for UINT32_MAX
 #include <algorithm> // Necessary for std::min/std::max
 #include <fstream>
+#include <string>
+#include <cstring>
+#include <cctype>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+#include "asset_archive.h"
+#include "asset_streamer.h"
+#include "bindless_heap.h"
+#include "frame_arena.h"
+#include "frame_stats.h"
+#include "frustum_culler.h"
+#include "gpu_allocator.h"
+#include "gpu_profiler.h"
+#include "job_system.h"
+#include "mapped_file.h"
+#include "pipeline_states.h"
+#include "render_graph.h"
+#include "shader_manager.h"
+#include "vulkan_handle.h"
 
 // Fixed functions
 // 
@@ -63,6 +90,260 @@
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
 
+// Frames in flight
+//
+// With a single command buffer and fence the CPU has to wait for the GPU to finish the previous
+// frame before it can record the next one, so the two never work at the same time.  Giving each
+// frame its own command buffer, semaphores and fence lets the CPU record frame N+1 while the GPU
+// is still rendering frame N.  Two frames is the usual choice; three buys more slack when frame
+// times vary, at the cost of one more frame of latency.
+const uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2;
+const uint32_t MAX_FRAMES_IN_FLIGHT = 3;
+
+// Present policies
+// ----------------
+// The present mode decides what happens when a new image is ready before the display has shown the last one:
+// -- VK_PRESENT_MODE_IMMEDIATE_KHR: Shown right away, tearing included.  Highest frame rate, no waiting.
+// -- VK_PRESENT_MODE_MAILBOX_KHR: Replaces the image waiting for the next vertical blank.  No tearing, and the
+//    image shown is always the newest one, but the GPU keeps rendering frames that are never shown.
+// -- VK_PRESENT_MODE_FIFO_KHR: Queued and shown one per vertical blank.  The application blocks once the queue
+//    is full, so it never renders faster than the display.  The only mode every driver has to support.
+// -- VK_PRESENT_MODE_FIFO_RELAXED_KHR: Like FIFO, but a late image is shown right away (with tearing) instead
+//    of waiting a whole extra refresh.
+// The number of swap chain images matters just as much: every extra image is one more frame that can be queued
+// up between rendering and the display, which smooths out hitches at the cost of latency.
+enum class PresentPolicy {
+	Uncapped,   // IMMEDIATE: benchmarks and throughput.
+	LowLatency, // MAILBOX with the fewest images that keep it from blocking.
+	VSync,      // FIFO with the fewest images: the CPU and GPU idle between refreshes, which saves power.
+	Adaptive,   // FIFO_RELAXED: vsync that tears instead of stuttering when a frame is late.
+};
+
+inline const char* presentPolicyName(PresentPolicy policy) {
+	switch (policy) {
+	case PresentPolicy::Uncapped: return "uncapped";
+	case PresentPolicy::LowLatency: return "low-latency";
+	case PresentPolicy::VSync: return "vsync";
+	case PresentPolicy::Adaptive: return "adaptive";
+	}
+	return "unknown";
+}
+
+// Runtime options for the application.  The defaults reproduce the plain tutorial behavior.
+struct AppSettings {
+	uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;  // Clamped to [1, MAX_FRAMES_IN_FLIGHT].
+	std::string pipelineCachePath = "pipeline_cache.bin"; // Where compiled pipelines are kept between runs.  Empty disables the file.
+	bool staticScene = false; // Record one command buffer per swap chain image up front and reuse it every frame.
+	uint32_t recordThreads = 0; // Threads recording secondary command buffers.  0 records inline on the main thread.
+	uint32_t drawCount = 1; // Number of draws issued per frame.  Values above 1 repeat the triangle to load up the CPU side.
+	VkDeviceSize stagingBufferSize = 16 * 1024 * 1024; // Bytes of host visible memory used to feed uploads to device local buffers.
+	bool gpuProfile = false; // Time the render pass, draws and compute pass on the GPU with timestamp queries.
+	std::string gpuProfileCsvPath; // Where gpuProfile writes its timings.  Empty prints them to stdout.
+	uint32_t benchmarkFrames = 0; // Benchmark mode: stop after this many measured frames.  0 means no frame limit.
+	double benchmarkSeconds = 0.0; // Benchmark mode: stop after this much measured time.  0 means no time limit.
+	uint32_t benchmarkWarmupFrames = 30; // Frames drawn before measuring starts, so pipeline and driver warm-up is left out.
+	std::string benchmarkJsonPath; // Where the benchmark summary goes.  Empty prints it to stdout.
+	bool offscreen = false; // Render into device local images instead of a window.  Needs no display, surface or present queue.
+	std::string readbackPath; // Offscreen only: copy every frame back to the host and write the last one to this PPM file.  Empty skips readback.
+	PresentPolicy presentPolicy = PresentPolicy::LowLatency; // Present mode and swap chain image count.  Cycled at runtime with the P key.
+	uint32_t latencyLimitFrames = 0; // Frame limiter: before starting a frame, wait until the frame this many back has been presented.  0 disables it.
+	double targetFrameRate = 0.0; // Frame limiter: never start frames faster than this.  0 means no cap.
+	std::string gpu; // Part of the device name, or the device UUID in hex, of the GPU to use.  Empty picks the best scoring one (see GPU_ENV_VAR).
+	bool deviceGroup = false; // Spread frames over every GPU linked to the chosen one (alternate frame rendering).
+	bool shaderHotReload = false; // Watch the shader sources and SPIR-V, and rebuild pipelines whenever they change.
+	uint32_t msaaSamples = 1; // Samples per pixel for anti-aliasing: 1 (off), 2, 4 or 8.  Capped by what the GPU can do.
+	bool sampleShading = false; // With MSAA, shade every sample rather than once per pixel, which also smooths edges inside triangles.
+	bool dynamicRendering = false; // Render with vkCmdBeginRenderingKHR instead of a render pass and framebuffers, where the GPU supports it.
+	uint32_t markerCount = 0; // Instanced markers drawn on top of the scene with a single draw.  0 draws none.
+	bool gpuDriven = false; // Cull on the GPU and draw with one indirect draw per mesh instead of one draw call per object.
+	std::string assetArchivePath; // Archive (see --pack-assets) to take shaders and meshes from.  Empty, or anything it lacks, uses the loose files.
+
+	// Benchmark mode runs until benchmarkFrames or benchmarkSeconds is reached, whichever comes first.
+	bool benchmark() const {
+		return benchmarkFrames > 0 || benchmarkSeconds > 0.0;
+	}
+};
+
+// Environment variable consulted for the GPU to use when AppSettings::gpu is empty.  Same format as --gpu.
+const char* const GPU_ENV_VAR = "TUTORIAL_GPU";
+
+// How often, in frames, gpuProfile reports its rolling timings.
+const uint32_t GPU_PROFILE_REPORT_INTERVAL = 300;
+
+// How often shaderHotReload looks at the shader files.
+const std::chrono::milliseconds SHADER_POLL_INTERVAL{ 250 };
+
+// Bytes of the frame arena every frame in flight gets for its uniform and instance data, on top of what the
+// markers need.  And the initial size of the CPU scratch arena, which grows by itself if a frame needs more.
+const VkDeviceSize FRAME_ARENA_SIZE = 256 * 1024;
+const size_t FRAME_SCRATCH_SIZE = 64 * 1024;
+
+// Vertex input
+// ------------
+// Vertices now live in a vertex buffer instead of being hard-coded in the shader.  The binding description tells
+// Vulkan how far apart consecutive vertices are, and the attribute descriptions say where each shader input
+// (layout(location = N) in the vertex shader) sits inside one vertex.
+struct Vertex {
+	glm::vec2 pos;
+	glm::vec3 color;
+
+	static VkVertexInputBindingDescription getBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription{};
+		bindingDescription.binding = 0;
+		bindingDescription.stride = sizeof(Vertex);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX; // Move to the next entry after each vertex (not each instance).
+		return bindingDescription;
+	}
+
+	static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions() {
+		std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions{};
+
+		attributeDescriptions[0].binding = 0;
+		attributeDescriptions[0].location = 0;
+		attributeDescriptions[0].format = VK_FORMAT_R32G32_SFLOAT;  // vec2
+		attributeDescriptions[0].offset = offsetof(Vertex, pos);
+
+		attributeDescriptions[1].binding = 0;
+		attributeDescriptions[1].location = 1;
+		attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;  // vec3
+		attributeDescriptions[1].offset = offsetof(Vertex, color);
+
+		return attributeDescriptions;
+	}
+};
+
+// Per-instance data of the instanced markers (AppSettings::markerCount), stored as a structure of arrays: every
+// attribute is a tightly packed array of its own, bound as a vertex binding of its own that steps once per
+// instance.  The loops that update them every frame walk straight through memory and vectorize, and attributes
+// that do not change are never touched.
+struct MarkerInstances {
+	static constexpr uint32_t FIRST_BINDING = 1; // Binding 0 is the mesh.
+	static constexpr uint32_t ARRAY_COUNT = 4;
+
+	float* x;
+	float* y;
+	float* scale;
+	uint32_t* color; // RGBA, 8 bits each.
+
+	static std::array<VkVertexInputBindingDescription, ARRAY_COUNT> getBindingDescriptions() {
+		std::array<VkVertexInputBindingDescription, ARRAY_COUNT> bindingDescriptions{};
+		for (uint32_t i = 0; i < ARRAY_COUNT; i++) {
+			bindingDescriptions[i].binding = FIRST_BINDING + i;
+			bindingDescriptions[i].stride = 4; // Every array holds 4 byte elements.
+			bindingDescriptions[i].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE; // Move to the next entry after each instance.
+		}
+		return bindingDescriptions;
+	}
+
+	static std::array<VkVertexInputAttributeDescription, ARRAY_COUNT> getAttributeDescriptions() {
+		const VkFormat formats[ARRAY_COUNT] = { VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32_SFLOAT, VK_FORMAT_R8G8B8A8_UNORM };
+		std::array<VkVertexInputAttributeDescription, ARRAY_COUNT> attributeDescriptions{};
+		for (uint32_t i = 0; i < ARRAY_COUNT; i++) {
+			attributeDescriptions[i].binding = FIRST_BINDING + i;
+			attributeDescriptions[i].location = 2 + i; // After Vertex's.
+			attributeDescriptions[i].format = formats[i];
+			attributeDescriptions[i].offset = 0;
+		}
+		return attributeDescriptions;
+	}
+};
+
+// The markers circle around their grid position, this far.
+const float MARKER_MOTION_RADIUS = 0.01f;
+// The markers' grid covers [-MARKER_FIELD_EXTENT, MARKER_FIELD_EXTENT] in both directions, more than the view's
+// [-1, 1], and the whole grid pans around in a circle this big.
+const float MARKER_FIELD_EXTENT = 2.0f;
+const float MARKER_PAN_RADIUS = 1.0f;
+
+// The built-in scene: one triangle.  Also what --pack-assets writes to the archive as "triangle".
+const std::vector<Vertex> TRIANGLE_VERTICES = {
+	{{0.0f, -0.5f}, {1.0f, 0.0f, 0.0f}},
+	{{0.5f, 0.5f}, {0.0f, 1.0f, 0.0f}},
+	{{-0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}}
+};
+const std::vector<uint32_t> TRIANGLE_INDICES = { 0, 1, 2 };
+
+// Per-draw data produced by the draw layout compute shader.  The vertex shader reads it from the bindless heap
+// with gl_InstanceIndex, and each DrawCommand uses its index in the scene as firstInstance, so draw i picks up
+// offset i.
+struct InstanceOffset {
+	glm::vec2 offset;
+};
+
+// Push constants of draw_layout.comp.
+struct DrawLayoutParams {
+	float time;
+	uint32_t drawCount;
+	uint32_t instanceBuffer; // Bindless buffer the offsets are written to.
+};
+
+// Push constants of the graphics pipeline.  Indices into the bindless heap, so nothing has to be bound per draw.
+struct DrawConstants {
+	uint32_t instanceBuffer; // Bindless buffer holding this frame's InstanceOffsets.
+};
+
+// Array sizes of the bindless heap, before the device limits are applied.
+const uint32_t BINDLESS_MAX_BUFFERS = 16384;
+const uint32_t BINDLESS_MAX_TEXTURES = 16384;
+
+const uint32_t DRAW_LAYOUT_GROUP_SIZE = 64; // local_size_x in draw_layout.comp.
+
+// GPU-driven path (settings.gpuDriven).  One per DrawCommand, read by cull_draws.comp, which has the same struct.
+struct ObjectData {
+	uint32_t batch; // Index into drawBatches.
+	uint32_t firstCommand; // The batch's first slot in the indirect command buffer.
+	uint32_t indexCount;
+	uint32_t instanceCount;
+	uint32_t firstInstance;
+	float boundingRadius; // Of the mesh, around its origin.
+};
+
+// Push constants of cull_draws.comp.  Everything but objectCount is a bindless buffer index.
+struct CullParams {
+	uint32_t objectCount;
+	uint32_t objectBuffer;
+	uint32_t instanceBuffer;
+	uint32_t commandBuffer;
+	uint32_t countBuffer;
+};
+
+const uint32_t CULL_GROUP_SIZE = 64; // local_size_x in cull_draws.comp.
+
+// Geometry uploaded to device local memory.  Meshes with no more than 65536 vertices store 16-bit indices, which
+// halves the index bandwidth compared to 32-bit ones.
+struct Mesh {
+	VkBuffer vertexBuffer{};
+	GpuAllocation vertexBufferMemory;
+	VkBuffer indexBuffer{};
+	GpuAllocation indexBufferMemory;
+	uint32_t indexCount = 0;
+	VkIndexType indexType = VK_INDEX_TYPE_UINT16;
+	uint32_t pendingStreams = 0; // Buffers still being streamed in from the asset archive.  Not drawn until 0.
+	float boundingRadius = INFINITY; // Largest distance of a vertex from the origin.  Unknown means never culled.
+};
+
+// The draws of one mesh in the GPU-driven path.  Its commands live in [firstCommand, firstCommand + maxDraws) of
+// the indirect command buffer, and the cull pass writes how many of them are used.
+struct DrawBatch {
+	uint32_t meshIndex;
+	uint32_t firstCommand;
+	uint32_t maxDraws;
+};
+
+// A single indexed draw of one mesh.  The scene is simply a list of these, recorded in order.
+struct DrawCommand {
+	uint32_t meshIndex;
+	uint32_t instanceCount;
+	uint32_t firstInstance;
+};
+
+// SPIR-V somewhere in memory, usually a MappedFile.  Vulkan wants the code as 32-bit aligned words and its size in
+// bytes.
+struct SpirvCode {
+	const uint32_t* code;
+	size_t codeSize;
+};
+
 // List required extensions.  In this case, add the swap chain which is not
 // part of Vulkan API proper (hence extension).
 
@@ -70,6 +351,19 @@ const std::vector<const char*> deviceExtensions = {
 	VK_KHR_SWAPCHAIN_EXTENSION_NAME
 };
 
+// Extensions that are used when the GPU has them but are not required.  present_id tags every present with a
+// number and present_wait lets the CPU wait until a given number has reached the display; the frame limiter uses
+// them to pace itself against the display instead of against a timer.
+const std::vector<const char*> optionalDeviceExtensions = {
+	VK_KHR_PRESENT_ID_EXTENSION_NAME,
+	VK_KHR_PRESENT_WAIT_EXTENSION_NAME
+};
+
+// Needed for settings.dynamicRendering.  Core in Vulkan 1.3, but the device is created as 1.2.
+const std::vector<const char*> dynamicRenderingExtensions = {
+	VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME
+};
+
 // Adds validation layer.
 
 const std::vector<const char*> validationLayers = {
@@ -125,6 +419,8 @@ struct QueueFamilyIndices {
 	// to indicate if a value has been assigned to it.
 	std::optional<uint32_t> graphicsFamily;
 	std::optional<uint32_t> presentFamily;
+	std::optional<uint32_t> transferFamily; // Transfer-only family (a DMA engine), if the GPU has one.  Never required.
+	std::optional<uint32_t> computeFamily;  // Compute family without graphics (async compute), if the GPU has one.  Never required.
 
 	bool isComplete() {
 		return graphicsFamily.has_value() && presentFamily.has_value();
@@ -133,6 +429,10 @@ struct QueueFamilyIndices {
 
 class HelloTriangleApplication {
 public:
+	explicit HelloTriangleApplication(const AppSettings& appSettings = AppSettings{}) : settings(appSettings) {
+		settings.framesInFlight = std::clamp(settings.framesInFlight, 1u, MAX_FRAMES_IN_FLIGHT);
+	}
+
 	void run() {
 		initWindow();
 		initVulkan();
@@ -142,7 +442,9 @@ public:
 
 private:
 
-	GLFWwindow* window;                      // Window generated for Vulkan usage
+	AppSettings settings;
+
+	GLFWwindow* window = nullptr;            // Window generated for Vulkan usage (none in offscreen mode)
 	VkInstance instance{};                     // Vulkan handle to instance
 	VkDebugUtilsMessengerEXT debugMessenger{}; // Handle to the debug messenger callback (even this needs a handle, like all things in Vulkan)
 	VkSurfaceKHR surface{};                    // Abstraction of presentation surface used to draw images.  Basically, this is a way to communicate
@@ -151,34 +453,282 @@ private:
 	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE; // Holds the handle to the graphics card we're using.  Instance destruction automatically 
 	// releases this handle.  No explicit destroy call is needed.
 	VkDevice device{};  // Handle to the logical device.
+	GpuAllocator allocator; // Every buffer and image gets its memory from here instead of its own vkAllocateMemory.
 	VkQueue graphicsQueue{}; // Handle to the queue created with the logical device above.  It is created automatically when the logical device is
 	// is created.  It must be retrieved via VkGetDeviceQueue(...);
 	VkQueue presentQueue{}; // Handle to the presentation queue.
-	VkSwapchainKHR swapChain{}; // Handle to the swap chain.
+	VkQueue transferQueue = VK_NULL_HANDLE; // Queue of deviceQueueFamilies.transferFamily; VK_NULL_HANDLE uploads through graphicsQueue.
+	VkQueue computeQueue{}; // Queue of deviceQueueFamilies.computeFamily, or graphicsQueue when the GPU has no separate compute family.
+	QueueFamilyIndices deviceQueueFamilies; // Families the logical device was created with.
+	bool hostQueryResetEnabled = false; // Vulkan 1.2 hostQueryReset was available and switched on.
+	bool presentWaitEnabled = false; // VK_KHR_present_id and VK_KHR_present_wait are both enabled.
+	VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT; // settings.msaaSamples as far as the GPU supports it.
+	bool sampleShadingEnabled = false; // settings.sampleShading, with MSAA on and sampleRateShading supported.
+	PFN_vkWaitForPresentKHR pfnWaitForPresent = nullptr; // Extension functions are not exported by the loader and have to be looked up.
+	bool dynamicRenderingEnabled = false; // settings.dynamicRendering, with VK_KHR_dynamic_rendering enabled.  renderPass and swapChainFramebuffers then stay empty.
+	PFN_vkCmdBeginRenderingKHR pfnCmdBeginRendering = nullptr;
+	PFN_vkCmdEndRenderingKHR pfnCmdEndRendering = nullptr;
+
+	// Device groups (settings.deviceGroup).  GPUs linked by the driver (SLI, CrossFire, ...) show up as one group,
+	// and a logical device created on the whole group sends each submit to the GPUs in its device mask.  Frames
+	// alternate between the GPUs: frame N renders on device N % afrDeviceCount, so while one GPU draws a frame
+	// the next one can already start on the other.
+	std::vector<VkPhysicalDevice> groupDevices; // Physical devices the logical device spans.  Empty without a group.
+	uint32_t groupDeviceCount = 1; // Number of physical devices behind `device`.
+	uint32_t afrDeviceCount = 1; // Devices frames alternate between.  Only devices whose images can be presented take part.
+	VkDeviceGroupPresentCapabilitiesKHR groupPresentCapabilities{}; // Which device can present images from which.
+	VkDeviceGroupPresentModeFlagsKHR groupPresentModeSupport = 0; // Present modes of groupPresentCapabilities that this surface supports too.
+	std::vector<VkDeviceGroupPresentModeFlagBitsKHR> groupPresentModes; // Per rendering device: how its frames are presented.
+	VkSwapchainKHR swapChain{}; // Handle to the swap chain.  Stays VK_NULL_HANDLE in offscreen mode.
 	std::vector<VkImage> swapChainImages; // These are the images that the graphics will be written to.  Kinda wonder if I can write to them directly.
 	// The images are created when the swap chain is created and therefore are deleted when the swap chain is deleted.
 	VkFormat swapChainImageFormat{}; // Store image formats for future use.
 	VkExtent2D swapChainExtent{};    // Store dimensions of swap chain for future use.
-	std::vector<VkImageView> swapChainImageViews;
-	VkRenderPass renderPass{};
-	VkPipelineLayout pipelineLayout{};
-	std::vector<VkFramebuffer> swapChainFramebuffers;  // Attachments created during render pass are bound to VkFramebuffer.  One VkFramebuffer
+	std::vector<UniqueImageView> swapChainImageViews;
+
+	// Offscreen mode.  swapChainImages then holds a ring of device local images we own, one per frame in flight,
+	// and everything downstream (image views, framebuffers, render pass, recording) uses them just like swap chain
+	// images.  With settings.readbackPath each frame also copies its image into that frame's host visible buffer.
+	std::vector<GpuAllocation> offscreenImageMemory;
+	std::vector<VkBuffer> readbackBuffers; // Per frame in flight, empty without readback.
+	std::vector<GpuAllocation> readbackBufferMemory;
+	UniqueRenderPass renderPass;
+	UniquePipelineLayout pipelineLayout;
+	std::vector<UniqueFramebuffer> swapChainFramebuffers;  // Attachments created during render pass are bound to VkFramebuffer.  One VkFramebuffer
 	// must exist per image in swap chain.  Hence a vector is used to track each one.
+	// The frame's passes and the barriers between them (see createFrameGraph).  Rebuilt with the swap chain.
+	std::unique_ptr<RenderGraph> frameGraph;
+	RenderGraph::ResourceId backbufferResource = 0;
+	RenderGraph::ResourceId readbackResource = 0;
+	RenderGraph::ResourceId msaaColorResource = 0; // Transient multisampled color image, with MSAA only.
+	bool frameGraphReported = false;
+	// What the frame graph's passes record, set by recordCommandBuffer right before it executes the graph.
+	struct GraphFrame {
+		uint32_t imageIndex;
+		uint32_t frame;
+		const std::pmr::vector<VkCommandBuffer>* secondaryBuffers;
+	};
+	GraphFrame graphFrame{};
 	VkCommandPool commandPool{}; // Commands are constructed on CPU side and sent as a complete set.  This allows GPU to optimize since it is 
 	// directed with the complete sequence of commands.  Several may be used especially in a threaded environment.
-	VkCommandBuffer commandBuffer{}; // Actual single buffer use to issue commands.  Added to commandPool.
-	VkPipeline graphicsPipeline{}; // Full-blown pipeline is here.
-	VkSemaphore imageAvailableSemaphore;
-	VkSemaphore renderFinishedSemaphore;
-	VkFence inFlightFence;
+	std::vector<VkCommandBuffer> commandBuffers; // One command buffer per frame in flight, all allocated from commandPool.
+	std::vector<VkCommandBuffer> staticCommandBuffers; // settings.staticScene only: pre-recorded, [frame in flight * image count + image].
+	bool staticCommandBuffersDirty = true; // Set whenever something baked into staticCommandBuffers changes (swap chain, pipeline).
+	std::vector<Mesh> meshes; // Referenced by DrawCommand::meshIndex.
+	std::vector<DrawCommand> drawCommands; // Everything drawn in the render pass each frame.
+
+	// Staging ring buffer.  Device local memory is usually not visible to the CPU, so data is first written into
+	// one persistently mapped host visible buffer and then copied over on the GPU.  Space is handed out front to
+	// back and wraps around to the start; it is given back once the frame whose upload commands read it has
+	// completed.  Every copy recorded during a frame goes out in a single upload command buffer submitted just
+	// ahead of that frame's rendering.
+	struct PendingUpload {
+		VkBuffer dstBuffer;
+		VkBufferCopy region;
+	};
+	struct StagingRegion {
+		uint64_t frame; // Frame whose upload commands read this region.
+		VkDeviceSize size; // Bytes of the ring consumed, including alignment padding and the skipped end when wrapping.
+	};
+	VkBuffer stagingBuffer{};
+	GpuAllocation stagingBufferMemory;
+	uint8_t* stagingMapped = nullptr;
+	VkDeviceSize stagingHead = 0; // Offset of the next allocation.
+	VkDeviceSize stagingUsed = 0; // Bytes between the oldest in-flight region and stagingHead.
+	VkDeviceSize stagingBatchSize = 0; // Bytes consumed by uploads that have not been submitted yet.
+	std::deque<StagingRegion> stagingRegions; // Submitted regions, oldest first.
+	std::vector<PendingUpload> pendingUploads; // Copies waiting for the next upload submit.
+	// An archive entry being decompressed into the staging ring.  Its copy joins pendingUploads once it is done.
+	struct PendingStream {
+		uint64_t id; // From assetStreamer.
+		PendingUpload upload;
+		StagingRegion* stagingRegion; // Pinned until the copy is queued.  Deque elements stay put when the ends change.
+		uint32_t meshIndex;
+	};
+	std::unique_ptr<AssetStreamer> assetStreamer; // Created by the first streamed asset.
+	std::deque<PendingStream> pendingStreams; // In request order, which is the order they complete in.
+	std::vector<VkCommandBuffer> uploadCommandBuffers; // One per frame in flight, from transferCommandPool when there is a transfer queue.
+	std::vector<VkCommandBuffer> acquireCommandBuffers; // Per frame in flight: ownership acquire on the graphics queue (VK_NULL_HANDLE without a transfer queue).
+	VkCommandPool transferCommandPool = VK_NULL_HANDLE; // Transfer queue only.
+	VkSemaphore transferTimeline = VK_NULL_HANDLE; // Transfer queue only: counts finished upload submits.
+	uint64_t transferSubmits = 0; // Uploads submitted to the transfer queue; the value its last submit signals.
+
+	// The graphics side of an upload submit.  submitInfo points into the other members, so keep this where it is
+	// (no copies) until it has been submitted.
+	struct UploadSubmit {
+		VkSubmitInfo submitInfo;
+		VkTimelineSemaphoreSubmitInfo timelineInfo;
+		uint64_t waitValue;
+	};
+
+	// Which devices of a device group run a batch, and which device waits on and signals each of its semaphores.
+	// Like UploadSubmit it is pointed to from the VkSubmitInfo, so it has to stay put until submitted.
+	struct DeviceGroupSubmit {
+		explicit DeviceGroupSubmit(std::pmr::memory_resource* memory)
+			: waitDeviceIndices(memory), commandBufferMasks(memory), signalDeviceIndices(memory) {}
+
+		VkDeviceGroupSubmitInfo info{};
+		std::pmr::vector<uint32_t> waitDeviceIndices;
+		std::pmr::vector<uint32_t> commandBufferMasks;
+		std::pmr::vector<uint32_t> signalDeviceIndices;
+	};
+
+	// Multithreaded recording state.  Command pools are externally synchronized, so each recording thread gets its
+	// own pool per frame in flight.  Resetting a whole pool at the start of a frame is cheaper than resetting its
+	// command buffers one by one, and is safe because graphicsTimelines say the GPU is done with them.
+	struct ThreadRecordingContext {
+		VkCommandPool commandPool{};
+		std::vector<VkCommandBuffer> secondaryBuffers; // Grown on demand, reused every time this frame comes around.
+		size_t usedBuffers = 0; // Buffers handed out since the last pool reset.
+	};
+	std::unique_ptr<JobSystem> jobSystem; // Only created when settings.recordThreads > 0.
+	std::vector<std::vector<ThreadRecordingContext>> threadContexts; // [frame in flight][thread]
+	PipelineStateCache pipelineStates; // Every graphics pipeline permutation, looked up by its description.
+	PipelineStateDesc sceneState; // Full-blown pipeline is here, or rather its key.
+	VkPipelineCache pipelineCache{}; // Driver-compiled pipeline state, loaded from and saved to settings.pipelineCachePath.
+	BindlessHeap bindlessHeap; // The one descriptor set every pipeline uses.
+	ShaderManager shaderManager; // settings.shaderHotReload only: rebuilds the pipelines below when their shaders change.
+	AssetArchive assets; // settings.assetArchivePath, when given.  Stays mapped so entries can be used in place.
+	// What a shaderManager program rebuilds.  Compute programs replace their pipeline.  Graphics programs point
+	// every state drawn with their shaders at the new ones, and the rebuilt pipelines replace the old ones in
+	// pipelineStates.
+	struct ReloadTarget {
+		UniquePipeline* pipeline; // Compute programs only.
+		std::vector<PipelineStateDesc*> states; // Graphics programs only.  Bound by staticCommandBuffers, which then have to be recorded again.
+		std::vector<PipelineStateDesc> buildStates; // What the shader manager's thread builds from: states as of the last time builds were paused.
+	};
+	std::vector<ReloadTarget> reloadTargets; // Indexed by shaderManager program.
+	// A graphics program's rebuilt pipelines, from the shader manager's thread to swapReloadedPipelines.
+	struct ReloadedStates {
+		VkPipeline handedOver; // The one the shader manager hands over, which tells the entries apart.
+		PipelineStateCache::Shader vertexShader; // Registered until pipelineStates holds the new pipelines.
+		PipelineStateCache::Shader fragmentShader;
+		std::vector<std::pair<PipelineStateDesc, VkPipeline>> built; // One per state of the program, in order.  The first is handedOver.
+	};
+	std::mutex reloadedStatesMutex;
+	std::vector<ReloadedStates> reloadedStates;
+
+	// Per-frame linear allocation.  frameArena hands out pieces of frameArenaBuffer for data the GPU reads during
+	// one frame; frameScratch backs the CPU's temporary containers while a frame is built.  Both are rewound at the
+	// start of drawFrame, once the frame that last used this slot has completed.
+	VkBuffer frameArenaBuffer = VK_NULL_HANDLE;
+	GpuAllocation frameArenaMemory;
+	FrameArena frameArena;
+	ScratchArena frameScratch{ FRAME_SCRATCH_SIZE };
+
+	// Async compute.  Every frame a small compute pass lays out the draws for that frame.  On GPUs with a compute
+	// family that cannot do graphics it runs on its own queue, next to the previous frame's rendering.  The
+	// graphics submit waits for it through computeTimelines, timeline semaphores (one per rendering device) whose
+	// value is the number of the last frame whose compute pass has finished.
+	VkCommandPool computeCommandPool{};
+	std::vector<VkCommandBuffer> computeCommandBuffers; // One per frame in flight.
+	UniquePipelineLayout computePipelineLayout;
+	UniquePipeline computePipeline;
+	std::vector<VkBuffer> instanceOffsetBuffers; // Per frame in flight: written by the compute pass, read by the draws.
+	std::vector<GpuAllocation> instanceOffsetBufferMemory;
+	std::vector<uint32_t> instanceOffsetBufferIndices; // Per frame in flight: bindless index of instanceOffsetBuffers.
+
+	// Instanced markers (settings.markerCount).  The per-instance arrays live in one persistently mapped buffer
+	// with a slot per frame in flight, so the CPU rewrites a slot while the GPU still reads the others.
+	PipelineStateDesc markerState;
+	PipelineStateDesc additiveMarkerState; // Same, blended additively.  Prewarmed, so the B key never waits for a compile.
+	bool additiveMarkers = false;
+	bool markersEnabled = false;
+	std::vector<float> markerBaseX; // Grid position every marker moves around.
+	std::vector<float> markerBaseY;
+	std::vector<float> markerScale;
+	std::vector<uint32_t> markerColor;
+	std::vector<float> markerX; // Where every marker is this frame, visible or not.
+	std::vector<float> markerY;
+	std::vector<float> markerZ;
+	std::vector<float> markerRadius;
+	std::vector<uint32_t> markerVisible; // Indices of the markers that passed the cull, packed.
+	std::vector<uint32_t> markerVisibleCounts; // Per frame in flight: how many instances were written.
+	std::vector<std::array<VkDeviceSize, MarkerInstances::ARRAY_COUNT>> markerArrayOffsets; // Per frame in flight: where in frameArenaBuffer.
+	FrustumCuller frustumCuller; // Picks its SIMD kernels from what the CPU supports.
+	FrustumCuller::Frustum markerFrustum{};
+
+	// GPU-driven rendering (settings.gpuDriven).  The compute pass also culls every object and writes the surviving
+	// draws as indirect commands, grouped into one batch per mesh.  The draws read those through the same
+	// timeline semaphore wait as the offsets.
+	bool gpuDrivenEnabled = false; // settings.gpuDriven, and the device can do indirect count draws.
+	UniquePipeline cullPipeline;
+	std::vector<DrawBatch> drawBatches;
+	VkBuffer objectBuffer = VK_NULL_HANDLE; // ObjectData of every DrawCommand, written once by the CPU.
+	GpuAllocation objectBufferMemory;
+	uint32_t objectBufferIndex = 0; // Bindless index of objectBuffer.
+	std::vector<VkBuffer> indirectCommandBuffers; // Per frame in flight: VkDrawIndexedIndirectCommands, batch after batch.
+	std::vector<GpuAllocation> indirectCommandBufferMemory;
+	std::vector<uint32_t> indirectCommandBufferIndices;
+	std::vector<VkBuffer> drawCountBuffers; // Per frame in flight: one draw count per batch.
+	std::vector<GpuAllocation> drawCountBufferMemory;
+	std::vector<uint32_t> drawCountBufferIndices;
+	std::vector<VkSemaphore> computeTimelines; // One per device in afrDeviceCount.
+
+	// GPU timings (settings.gpuProfile).  Regions the profiler could not give queries to stay at NO_REGION, which
+	// makes the begin/end calls no-ops.
+	GpuProfiler gpuProfiler;
+	uint32_t frameRegion = GpuProfiler::NO_REGION;      // The whole primary command buffer.
+	uint32_t renderPassRegion = GpuProfiler::NO_REGION; // vkCmdBeginRenderPass to vkCmdEndRenderPass.
+	uint32_t drawsRegion = GpuProfiler::NO_REGION;      // Inline draws only; see recordCommandBuffer.
+	uint32_t computeRegion = GpuProfiler::NO_REGION;    // The draw layout dispatch.
+	uint32_t cullRegion = GpuProfiler::NO_REGION;       // recordCullPass, gpuDrivenEnabled only.
+	std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now(); // Animation clock.
+	FrameStats frameStats; // CPU time per drawFrame phase.  Only recorded in benchmark mode.
+	std::vector<VkSemaphore> imageAvailableSemaphores; // Per frame in flight: swap chain image is ready to be rendered to.
+	std::vector<VkSemaphore> renderFinishedSemaphores; // Per frame in flight: rendering is done and the image can be presented.
+	std::vector<VkSemaphore> graphicsTimelines; // One per device in afrDeviceCount: the graphics submit of frame N signals N on its render device's one.
+	std::vector<uint64_t> imageFrames; // Per swap chain image: frame that last rendered to it (0 if none).
+	uint32_t currentFrame = 0; // Index of the frame in flight being recorded, cycles through [0, settings.framesInFlight).
+	uint64_t submittedFrames = 0; // Number of frames handed to the GPU so far.  Frame N (1-based) is the Nth submit.
+	uint64_t completedFrames = 0; // Highest frame number the CPU has seen finish on the GPU.
+	std::vector<uint64_t> frameNumbers; // Per frame in flight: number of the frame last submitted from that slot.
+	bool framebufferResized = false; // Set by GLFW when the window size changes so the swap chain gets recreated.
+	bool presentPolicyChanged = false; // Set when settings.presentPolicy changes at runtime; also recreates the swap chain.
+	uint64_t firstPresentIdOfSwapChain = 1; // Present ids below this went to an earlier swap chain and cannot be waited on.
+	std::chrono::steady_clock::time_point lastFrameStart; // Frame limiter: when the previous frame was allowed to start.
+
+	// Objects that may still be referenced by work in flight.  Each entry remembers the last frame submitted when it
+	// was replaced, and is destroyed once that frame has completed.  This is what lets the swap chain be rebuilt
+	// without a vkDeviceWaitIdle.
+	DeletionQueue deletionQueue;
 
 	void initWindow() {
+		if (settings.offscreen) {
+			return;
+		}
 		glfwInit();
 
 		glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);  // Prevent generation of OpenGL context
-		glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);    // No window resize for now...
 
 		window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);  // 4th parameter picks monitor... interesting
+
+		// GLFW callbacks are plain functions, so stash a pointer to the application with the window and
+		// fetch it back inside the callback.
+		glfwSetWindowUserPointer(window, this);
+		glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+		glfwSetKeyCallback(window, keyCallback);
+	}
+
+	// P cycles through the present policies.  The present mode is fixed at swap chain creation, so switching it
+	// means recreating the swap chain, which happens after the next present.  B toggles additive blending of the
+	// markers.
+	static void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+		auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+		if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+			PresentPolicy& policy = app->settings.presentPolicy;
+			policy = static_cast<PresentPolicy>((static_cast<int>(policy) + 1) % (static_cast<int>(PresentPolicy::Adaptive) + 1));
+			app->presentPolicyChanged = true;
+		}
+		if (key == GLFW_KEY_B && action == GLFW_PRESS) {
+			app->additiveMarkers = !app->additiveMarkers;
+		}
+	}
+
+	// Drivers are not guaranteed to report VK_ERROR_OUT_OF_DATE_KHR after a resize, so remember it explicitly.
+	static void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
+		auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+		app->framebufferResized = true;
 	}
 
 	void initVulkan() {
@@ -187,37 +737,357 @@ private:
 		createSurface();
 		pickPhysicalDevice();
 		createLogicalDevice();
-		createSwapChain();
+		createAllocator();
+		createGpuProfiler();
+		createPipelineCache();  // Must exist before any pipeline is created.
+		openAssetArchive();  // Before anything is loaded from it.
+		if (settings.offscreen) {
+			createOffscreenTargets();
+		}
+		else {
+			createSwapChain();
+		}
 		createImageViews();
-		createRenderPass();
+		if (!dynamicRenderingEnabled) {
+			createRenderPass();
+		}
+		createBindlessHeap();
+		createPipelineLayout();
+		createRecordingThreads();  // Before the pipelines, which are prewarmed on its threads.
 		createGraphicsPipeline();
-		createFrameBuffers();
+		createComputePipeline();
+		createShaderManager();
+		createFrameGraph();  // Before the framebuffers, which use its transient images.
+		if (!dynamicRenderingEnabled) {
+			createFrameBuffers();
+		}
 		createCommandPool();
-		createCommandBuffer();  // Allocate the command buffer.
+		createCommandBuffers();  // Allocate one command buffer per frame in flight.
 		createSyncObjects();
+		createStagingBuffer();
+		createFrameArena();
+		createScene();
+		createComputeResources();
+		createGpuDrivenResources();
+		createMarkers();
 	}
 
-	// Swap chain GPU synchronization and fence to for image frame to finish.
+	// The triangle comes from the asset archive when it has one, and is drawn once it has streamed in.
+	void createScene() {
+		if (!streamMesh("triangle")) {
+			meshes.push_back(createMesh(TRIANGLE_VERTICES, TRIANGLE_INDICES));
+		}
+		for (uint32_t i = 0; i < std::max(settings.drawCount, 1u); i++) {
+			drawCommands.push_back(DrawCommand{ 0, 1, i });
+		}
+	}
+
+	// Synchronization objects
+	// -----------------------
+	// Timeline semaphores carry a 64-bit counter instead of a signaled flag.  A submit signals a value, and both
+	// other submits and the CPU (vkWaitSemaphores) wait for "value >= N".  One per queue (and rendering device) is enough:
+	// -- graphicsTimelines: frame N's render submit signals N.  The CPU waits on it instead of on per-frame fences,
+	//    so nothing ever has to be reset, and it can always ask exactly how far the GPU has got.
+	// -- computeTimelines: frame N's compute pass signals N, and frame N's render submit waits for it.
+	// -- transferTimeline: every upload submit signals the next value, and the render submit using it waits for it.
+	// The swap chain only works with binary semaphores, so acquire and present keep one pair per frame in flight.
+	// With a device group each rendering device gets its own graphics and compute timeline.  Frames on different
+	// GPUs finish in any order, and a single shared timeline would then have to go down again.
 	void createSyncObjects() {
+		imageAvailableSemaphores.resize(settings.framesInFlight);
+		renderFinishedSemaphores.resize(settings.framesInFlight);
+		frameNumbers.assign(settings.framesInFlight, 0);
+		// No frame has touched any swap chain image yet.
+		imageFrames.assign(swapChainImages.size(), 0);
+
 		VkSemaphoreCreateInfo semaphoreInfo{};
 		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-		VkFenceCreateInfo fenceInfo{};
-		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-		// Fences wait for a frame to be drawn.  However, on the first frame there are no previous frames.
-		// Therefore the wait fence will wait indefinitely.  To fix this issue, a fence can be created with
-		// the signal already set.  That's what the 'flags' field does above.
+		for (uint32_t i = 0; i < settings.framesInFlight; i++) {
+			if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
+				vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS) {
+				throw std::runtime_error("failed to create semaphores!");
+			}
+		}
+
+		// Frame 0 never exists, so a value of 0 means "nothing finished yet" and waiting for it returns at once.
+		graphicsTimelines.resize(afrDeviceCount);
+		computeTimelines.resize(afrDeviceCount);
+		for (uint32_t i = 0; i < afrDeviceCount; i++) {
+			graphicsTimelines[i] = createTimelineSemaphore();
+			computeTimelines[i] = createTimelineSemaphore();
+		}
+		if (transferQueue != VK_NULL_HANDLE) {
+			transferTimeline = createTimelineSemaphore();
+		}
+	}
+
+	VkSemaphore createTimelineSemaphore() {
+		VkSemaphoreTypeCreateInfo timelineInfo{};
+		timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+		timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+		timelineInfo.initialValue = 0;
 
-		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphore) != VK_SUCCESS ||
-			vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphore) != VK_SUCCESS ||
-			vkCreateFence(device, &fenceInfo, nullptr, &inFlightFence) != VK_SUCCESS) {
+		VkSemaphoreCreateInfo semaphoreInfo{};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		semaphoreInfo.pNext = &timelineInfo;
+
+		VkSemaphore semaphore;
+		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &semaphore) != VK_SUCCESS) {
 			throw std::runtime_error("failed to create semaphores!");
 		}
+		return semaphore;
 	}
 
-	// This will be called to write commands to the commandBuffer.
-	void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+	// Device that renders frame.  Fixed per frame number, so every device's timeline only ever goes up.
+	uint32_t renderDeviceOf(uint64_t frame) const {
+		return static_cast<uint32_t>(frame % afrDeviceCount);
+	}
+
+	// Mask of every device that renders frames.  Uploads have to reach all of them.
+	uint32_t renderDevicesMask() const {
+		return (1u << afrDeviceCount) - 1;
+	}
+
+	// Run the command buffers of submitInfo on the devices in deviceMask, and wait on and signal all of its
+	// semaphores on deviceIndex.  Does nothing without a device group, where everything runs on the one GPU.
+	void chainDeviceGroupSubmit(VkSubmitInfo& submitInfo, DeviceGroupSubmit& group, uint32_t deviceMask, uint32_t deviceIndex) {
+		if (groupDeviceCount == 1) {
+			return;
+		}
+		group.waitDeviceIndices.assign(submitInfo.waitSemaphoreCount, deviceIndex);
+		group.commandBufferMasks.assign(submitInfo.commandBufferCount, deviceMask);
+		group.signalDeviceIndices.assign(submitInfo.signalSemaphoreCount, deviceIndex);
+
+		group.info = {};
+		group.info.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_SUBMIT_INFO;
+		group.info.pNext = submitInfo.pNext;
+		group.info.waitSemaphoreCount = submitInfo.waitSemaphoreCount;
+		group.info.pWaitSemaphoreDeviceIndices = group.waitDeviceIndices.data();
+		group.info.commandBufferCount = submitInfo.commandBufferCount;
+		group.info.pCommandBufferDeviceMasks = group.commandBufferMasks.data();
+		group.info.signalSemaphoreCount = submitInfo.signalSemaphoreCount;
+		group.info.pSignalSemaphoreDeviceIndices = group.signalDeviceIndices.data();
+		submitInfo.pNext = &group.info;
+	}
+
+	// Block until frame has finished on the GPU, then refresh completedFrames from the counters.  They may well be
+	// ahead of what was asked for, which lets deferred work be released as early as possible.
+	void waitForFrame(uint64_t frame) {
+		if (frame > completedFrames) {
+			VkSemaphoreWaitInfo waitInfo{};
+			waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+			waitInfo.semaphoreCount = 1;
+			waitInfo.pSemaphores = &graphicsTimelines[renderDeviceOf(frame)];
+			waitInfo.pValues = &frame;
+			if (vkWaitSemaphores(device, &waitInfo, UINT64_MAX) != VK_SUCCESS) {
+				throw std::runtime_error("failed to wait for frame!");
+			}
+		}
+
+		// completedFrames promises that every frame up to it is done.  Each device finishes its own frames in
+		// order, so the first frame a device may still be working on is the one after its counter, and everything
+		// before the earliest of those is done on every device.
+		uint64_t completed = submittedFrames;
+		for (uint32_t i = 0; i < afrDeviceCount; i++) {
+			uint64_t value = 0;
+			if (vkGetSemaphoreCounterValue(device, graphicsTimelines[i], &value) != VK_SUCCESS) {
+				throw std::runtime_error("failed to read timeline semaphore!");
+			}
+			uint64_t firstPending = value > 0 ? value + afrDeviceCount : (i > 0 ? i : afrDeviceCount);
+			completed = std::min(completed, firstPending - 1);
+		}
+		completedFrames = std::max(completedFrames, completed);
+	}
+
+	// Multithreaded command recording
+	// ------------------------------
+	// Recording thousands of draws on one thread quickly becomes the CPU bottleneck.  Vulkan allows any number of
+	// threads to record at once as long as no two of them use the same command pool.  The draws are split into
+	// chunks and each chunk is recorded into a secondary command buffer on a worker thread.  The primary command
+	// buffer then begins the render pass with VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS and stitches the chunks
+	// together in their original order with vkCmdExecuteCommands.
+	// The GPU-driven path records one call per mesh, which is nothing worth spreading over threads.
+	void createRecordingThreads() {
+		if (settings.recordThreads == 0 || gpuDrivenEnabled) {
+			return;
+		}
+
+		jobSystem = std::make_unique<JobSystem>(settings.recordThreads);
+		QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+
+		VkCommandPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT; // Re-recorded every frame and reset as a whole.
+		poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+
+		threadContexts.resize(settings.framesInFlight);
+		for (auto& frameContexts : threadContexts) {
+			frameContexts.resize(jobSystem->threadCount());
+			for (auto& context : frameContexts) {
+				if (vkCreateCommandPool(device, &poolInfo, nullptr, &context.commandPool) != VK_SUCCESS) {
+					throw std::runtime_error("failed to create command pool!");
+				}
+			}
+		}
+	}
+
+	// Record this frame's draws across the job system.  Returns the secondary command buffers in draw order.
+	std::pmr::vector<VkCommandBuffer> recordSecondaryCommandBuffers(uint32_t imageIndex) {
+		std::vector<ThreadRecordingContext>& frameContexts = threadContexts[currentFrame];
+		for (auto& context : frameContexts) {
+			vkResetCommandPool(device, context.commandPool, 0);
+			context.usedBuffers = 0;
+		}
+
+		// A few chunks per thread keeps everybody busy even when some chunks take longer than others.  The draws are
+		// split evenly, so with no more chunks than draws none of them is empty.
+		const uint32_t drawTotal = static_cast<uint32_t>(drawCommands.size());
+		const uint32_t chunkCount = std::min(drawTotal, jobSystem->threadCount() * 4);
+		std::pmr::vector<VkCommandBuffer> secondaryBuffers(chunkCount, &frameScratch);
+
+		VkCommandBufferInheritanceInfo inheritanceInfo{};
+		inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+		inheritanceInfo.renderPass = renderPass;
+		inheritanceInfo.subpass = 0;
+
+		// With dynamic rendering there is no render pass to inherit, so the secondaries are told the attachment
+		// formats and sample count instead.
+		VkCommandBufferInheritanceRenderingInfoKHR renderingInheritance{};
+		renderingInheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO_KHR;
+		renderingInheritance.colorAttachmentCount = 1;
+		renderingInheritance.pColorAttachmentFormats = &swapChainImageFormat;
+		renderingInheritance.rasterizationSamples = msaaSamples;
+		if (dynamicRenderingEnabled) {
+			inheritanceInfo.pNext = &renderingInheritance;
+		}
+		else {
+			inheritanceInfo.framebuffer = swapChainFramebuffers[imageIndex]; // Optional, but may let the driver optimize.
+		}
+
+		jobSystem->parallelFor(chunkCount, [&](uint32_t chunk, uint32_t threadIndex) {
+			ThreadRecordingContext& context = frameContexts[threadIndex];
+			if (context.usedBuffers == context.secondaryBuffers.size()) {
+				VkCommandBufferAllocateInfo allocInfo{};
+				allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+				allocInfo.commandPool = context.commandPool;
+				allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+				allocInfo.commandBufferCount = 1;
+
+				VkCommandBuffer newBuffer;
+				if (vkAllocateCommandBuffers(device, &allocInfo, &newBuffer) != VK_SUCCESS) {
+					throw std::runtime_error("failed to allocate command buffers!");
+				}
+				context.secondaryBuffers.push_back(newBuffer);
+			}
+			VkCommandBuffer secondary = context.secondaryBuffers[context.usedBuffers++];
+
+			VkCommandBufferBeginInfo beginInfo{};
+			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+			// RENDER_PASS_CONTINUE: the whole buffer executes inside the render pass described by pInheritanceInfo.
+			beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+			beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+			if (vkBeginCommandBuffer(secondary, &beginInfo) != VK_SUCCESS) {
+				throw std::runtime_error("failed to begin recording command buffer!");
+			}
+
+			uint32_t firstDraw = static_cast<uint32_t>(uint64_t(chunk) * drawTotal / chunkCount);
+			uint32_t endDraw = static_cast<uint32_t>(uint64_t(chunk + 1) * drawTotal / chunkCount);
+			recordDraws(secondary, currentFrame, firstDraw, endDraw - firstDraw);
+			if (chunk == chunkCount - 1) {
+				recordMarkers(secondary, currentFrame);  // On top of the scene, so after its last draw.
+			}
+
+			if (vkEndCommandBuffer(secondary) != VK_SUCCESS) {
+				throw std::runtime_error("failed to record command buffer!");
+			}
+			secondaryBuffers[chunk] = secondary;
+		});
+
+		return secondaryBuffers;
+	}
+
+	// Record drawCommands[firstDraw, firstDraw + count) into a command buffer that is inside the render pass.
+	// Secondary command buffers inherit nothing but the render pass, so the pipeline and dynamic state are set here
+	// for every buffer.  frame selects the frame in flight whose compute pass output the draws read.
+	void recordDraws(VkCommandBuffer commandBuffer, uint32_t frame, uint32_t firstDraw, uint32_t count) {
+		bindDrawState(commandBuffer, frame);
+
+		// Consecutive draws of the same mesh skip rebinding its buffers.
+		const Mesh* boundMesh = nullptr;
+		for (uint32_t i = firstDraw; i < firstDraw + count; i++) {
+			const DrawCommand& draw = drawCommands[i];
+			const Mesh& mesh = meshes[draw.meshIndex];
+			if (mesh.pendingStreams > 0) {
+				continue;
+			}
+			if (&mesh != boundMesh) {
+				bindMesh(commandBuffer, mesh);
+				boundMesh = &mesh;
+			}
+			vkCmdDrawIndexed(commandBuffer, mesh.indexCount, draw.instanceCount, 0, 0, draw.firstInstance); // (index_count, instance_count, first_index, vertex_offset, first_instance)
+		}
+	}
+
+	// GPU-driven counterpart of recordDraws: one indirect draw per batch, however many objects there are.  The
+	// commands and their count come from this frame's cull pass.
+	void recordIndirectDraws(VkCommandBuffer commandBuffer, uint32_t frame) {
+		bindDrawState(commandBuffer, frame);
+
+		for (uint32_t i = 0; i < drawBatches.size(); i++) {
+			const DrawBatch& batch = drawBatches[i];
+			const Mesh& mesh = meshes[batch.meshIndex];
+			if (mesh.pendingStreams > 0) {
+				continue;
+			}
+			bindMesh(commandBuffer, mesh);
+			vkCmdDrawIndexedIndirectCount(commandBuffer, indirectCommandBuffers[frame], sizeof(VkDrawIndexedIndirectCommand) * batch.firstCommand,
+				drawCountBuffers[frame], sizeof(uint32_t) * i, batch.maxDraws, sizeof(VkDrawIndexedIndirectCommand));
+		}
+	}
+
+	void bindMesh(VkCommandBuffer commandBuffer, const Mesh& mesh) {
+		VkDeviceSize offset = 0;
+		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &mesh.vertexBuffer, &offset);
+		vkCmdBindIndexBuffer(commandBuffer, mesh.indexBuffer, 0, mesh.indexType);
+	}
+
+	// Everything draws need besides their meshes.  Also recorded into every secondary command buffer, which
+	// inherit nothing.
+	void bindDrawState(VkCommandBuffer commandBuffer, uint32_t frame) {
+		// Bind to the graphics pipeline.
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineStates.get(sceneState));
+		
+		// As noted in the fixed functions chapter, we did specify viewport and scissor state for this pipeline to be dynamic.
+		// So we need to set them in the command buffer before issuing our draw command :
+
+		VkViewport viewport{};
+		viewport.x = 0.0f;
+		viewport.y = 0.0f;
+		viewport.width = static_cast<float>(swapChainExtent.width);
+		viewport.height = static_cast<float>(swapChainExtent.height);
+		viewport.minDepth = 0.0f;
+		viewport.maxDepth = 1.0f;
+		vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+		VkRect2D scissor{};
+		scissor.offset = { 0,0 };
+		scissor.extent = swapChainExtent;
+		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+		// The heap is the only descriptor set, and it stays bound for the whole command buffer.
+		VkDescriptorSet bindlessSet = bindlessHeap.set();
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &bindlessSet, 0, nullptr);
+		DrawConstants constants{};
+		constants.instanceBuffer = instanceOffsetBufferIndices[frame];
+		vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+			sizeof(constants), &constants);
+	}
+
+	// This will be called to write commands to the commandBuffer.  When secondaryBuffers is not empty the draws were
+	// already recorded on worker threads and only need to be executed inside the render pass.
+	void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t frame, const std::pmr::vector<VkCommandBuffer>& secondaryBuffers = {}) {
 		VkCommandBufferBeginInfo beginInfo{};
 		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 		beginInfo.flags = 0; // Optional
@@ -230,7 +1100,64 @@ private:
 		if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
 			throw std::runtime_error("failed to begin recording command buffer!");
 		}
+		gpuProfiler.begin(commandBuffer, frame, frameRegion);
+
+		// The passes, and the barriers and layout transitions between them, come from the frame graph.  All it
+		// needs to know is which swap chain image and readback buffer are this frame's.
+		graphFrame = { imageIndex, frame, &secondaryBuffers };
+		frameGraph->setImportedImage(backbufferResource, swapChainImages[imageIndex]);
+		if (!readbackBuffers.empty()) {
+			frameGraph->setImportedBuffer(readbackResource, readbackBuffers[frame]);
+		}
+		frameGraph->execute(commandBuffer);
+		gpuProfiler.end(commandBuffer, frame, frameRegion);
+
+		if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
+		}
+	}
+
+	// The frame graph's scene pass: the render pass with every draw of the frame.
+	void recordScenePass(VkCommandBuffer commandBuffer) {
+		const uint32_t imageIndex = graphFrame.imageIndex;
+		const uint32_t frame = graphFrame.frame;
+		const std::pmr::vector<VkCommandBuffer>& secondaryBuffers = *graphFrame.secondaryBuffers;
+
+		gpuProfiler.begin(commandBuffer, frame, renderPassRegion);
+		if (dynamicRenderingEnabled) {
+			beginDynamicRendering(commandBuffer, imageIndex, !secondaryBuffers.empty());
+		}
+		else {
+			beginRenderPass(commandBuffer, imageIndex, !secondaryBuffers.empty());
+		}
+
+		// A render pass that executes secondary command buffers allows nothing else in the primary, timestamps
+		// included, so the draws are only timed on their own when they are recorded inline.
+		if (secondaryBuffers.empty()) {
+			gpuProfiler.begin(commandBuffer, frame, drawsRegion);
+			if (gpuDrivenEnabled) {
+				recordIndirectDraws(commandBuffer, frame);
+			}
+			else {
+				recordDraws(commandBuffer, frame, 0, static_cast<uint32_t>(drawCommands.size()));
+			}
+			recordMarkers(commandBuffer, frame);
+			gpuProfiler.end(commandBuffer, frame, drawsRegion);
+		}
+		else {
+			vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(secondaryBuffers.size()), secondaryBuffers.data());
+		}
+
+		if (dynamicRenderingEnabled) {
+			pfnCmdEndRendering(commandBuffer);
+		}
+		else {
+			vkCmdEndRenderPass(commandBuffer);
+		}
+		gpuProfiler.end(commandBuffer, frame, renderPassRegion);
+	}
 
+	void beginRenderPass(VkCommandBuffer commandBuffer, uint32_t imageIndex, bool secondaryContents) {
 		// Start the render pass.
 		VkRenderPassBeginInfo renderPassInfo{};
 		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
@@ -243,43 +1170,94 @@ private:
 		renderPassInfo.clearValueCount = 1;
 		renderPassInfo.pClearValues = &clearColor; // Clear colors for VK_ATTACHMENT_LOAD_OP_CLEAR.
 
-		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+		VkSubpassContents contents = secondaryContents ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE;
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, contents);
 		// vkCmd prefix are all record commands.  All return void with errors only when finished recording.
 		// The final parameter controls how the drawing commands within the render pass will be provided. It can have one of two values:
 		// -- VK_SUBPASS_CONTENTS_INLINE: The render pass commands will be embedded in the primary command buffer itself and no secondary command 
 		//    buffers will be executed.
 		// -- VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : The render pass commands will be executed from secondary command buffers.
+	}
 
-		// Bind to the graphics pipeline.
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-		
-		// As noted in the fixed functions chapter, we did specify viewport and scissor state for this pipeline to be dynamic.
-		// So we need to set them in the command buffer before issuing our draw command :
+	// Dynamic rendering
+	// -----------------
+	// VK_KHR_dynamic_rendering names the attachments when rendering begins instead of baking them into a
+	// VkRenderPass and a VkFramebuffer per swap chain image.  Pipelines only need to know the attachment formats
+	// (see buildGraphicsPipeline), so a resize no longer creates any framebuffers, and the frame graph already
+	// places every barrier and layout transition around the pass that the render pass would otherwise have done.
+	// The load and store ops and the MSAA resolve match createRenderPass.
+	void beginDynamicRendering(VkCommandBuffer commandBuffer, uint32_t imageIndex, bool secondaryContents) {
+		VkRenderingAttachmentInfoKHR colorAttachment{};
+		colorAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+		colorAttachment.imageView = swapChainImageViews[imageIndex];
+		colorAttachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+		colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		colorAttachment.clearValue = { {{0.0f, 0.0f, 0.0f, 1.0f}} };
+		if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+			// Render into the multisampled image and average it into the swap chain image at the end.
+			colorAttachment.imageView = frameGraph->imageView(msaaColorResource);
+			colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+			colorAttachment.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+			colorAttachment.resolveImageView = swapChainImageViews[imageIndex];
+			colorAttachment.resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		}
 
-		VkViewport viewport{};
-		viewport.x = 0.0f;
-		viewport.y = 0.0f;
-		viewport.width = static_cast<float>(swapChainExtent.width);
-		viewport.height = static_cast<float>(swapChainExtent.height);
-		viewport.minDepth = 0.0f;
-		viewport.maxDepth = 1.0f;
-		vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+		VkRenderingInfoKHR renderingInfo{};
+		renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR;
+		renderingInfo.flags = secondaryContents ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT_KHR : 0;
+		renderingInfo.renderArea.offset = { 0, 0 };
+		renderingInfo.renderArea.extent = swapChainExtent;
+		renderingInfo.layerCount = 1;
+		renderingInfo.colorAttachmentCount = 1;
+		renderingInfo.pColorAttachments = &colorAttachment;
+		pfnCmdBeginRendering(commandBuffer, &renderingInfo);
+	}
 
-		VkRect2D scissor{};
-		scissor.offset = { 0,0 };
-		scissor.extent = swapChainExtent;
-		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+	// Static scene mode
+	// -----------------
+	// Nothing recorded by recordCommandBuffer changes from one frame to the next unless the swap chain or the
+	// pipeline is rebuilt.  Rather than paying for recording every frame, record one command buffer per
+	// framebuffer and frame in flight (the draws read that frame's compute output) once and submit the matching
+	// one each frame.
+	//
+	// A buffer is only resubmitted by its own frame in flight, after graphicsTimelines say the previous submit
+	// has finished, so the buffers never need VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT.  When the buffers go
+	// stale they can still be pending on the GPU, so the old set is freed through the deferred destroy queue and a
+	// fresh set is allocated.
+	void recordStaticCommandBuffers() {
+		if (!staticCommandBuffers.empty()) {
+			std::vector<VkCommandBuffer> oldCommandBuffers = std::move(staticCommandBuffers);
+			deferDestroy([this, oldCommandBuffers]() {
+				vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(oldCommandBuffers.size()), oldCommandBuffers.data());
+			});
+		}
+
+		staticCommandBuffers.resize(settings.framesInFlight * swapChainImages.size());
 
-		vkCmdDraw(commandBuffer, 3, 1, 0, 0); // (vertex_count, instance_count, first_vertex, first_instance)
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = commandPool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = static_cast<uint32_t>(staticCommandBuffers.size());
 
-		vkCmdEndRenderPass(commandBuffer);
+		if (vkAllocateCommandBuffers(device, &allocInfo, staticCommandBuffers.data()) != VK_SUCCESS) {
+			throw std::runtime_error("failed to allocate command buffers!");
+		}
 
-		if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
-			throw std::runtime_error("failed to record command buffer!");
+		const uint32_t imageCount = static_cast<uint32_t>(swapChainImages.size());
+		for (uint32_t frame = 0; frame < settings.framesInFlight; frame++) {
+			for (uint32_t image = 0; image < imageCount; image++) {
+				recordCommandBuffer(staticCommandBuffers[frame * imageCount + image], image, frame);
+			}
 		}
+
+		staticCommandBuffersDirty = false;
 	}
 
-	void createCommandBuffer() {
+	void createCommandBuffers() {
+		commandBuffers.resize(settings.framesInFlight);
+
 		VkCommandBufferAllocateInfo allocInfo{};
 		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 		allocInfo.commandPool = commandPool;
@@ -287,51 +1265,573 @@ private:
 		// The level parameter specifies if the allocated command buffers are primary or secondary command buffers.
 		// -- VK_COMMAND_BUFFER_LEVEL_PRIMARY: Can be submitted to a queue for execution, but cannot be called from other command buffers.
 		// -- VK_COMMAND_BUFFER_LEVEL_SECONDARY : Cannot be submitted directly, but can be called from primary command buffers.
-		allocInfo.commandBufferCount = 1;
+		allocInfo.commandBufferCount = static_cast<uint32_t>(commandBuffers.size());
+
+		if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
+			throw std::runtime_error("failed to allocate command buffers!");
+		}
 
-		if (vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer) != VK_SUCCESS) {
+		uploadCommandBuffers.resize(settings.framesInFlight);
+		allocInfo.commandBufferCount = static_cast<uint32_t>(uploadCommandBuffers.size());
+		allocInfo.commandPool = transferQueue != VK_NULL_HANDLE ? transferCommandPool : commandPool;
+		if (vkAllocateCommandBuffers(device, &allocInfo, uploadCommandBuffers.data()) != VK_SUCCESS) {
 			throw std::runtime_error("failed to allocate command buffers!");
 		}
-	}
-
-	void createCommandPool() {
-		QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
 
-		VkCommandPoolCreateInfo poolInfo{};
-		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-		poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-		// There are two possible flags for command pools :
-		// -- VK_COMMAND_POOL_CREATE_TRANSIENT_BIT: Hint that command buffers are rerecorded with new commands 
-		//    very often(may change memory allocation behavior)
-		// -- VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT : Allow command buffers to be rerecorded individually, 
-		//    without this flag they all have to be reset together
-		poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+		computeCommandBuffers.resize(settings.framesInFlight);
+		allocInfo.commandBufferCount = static_cast<uint32_t>(computeCommandBuffers.size());
+		allocInfo.commandPool = computeCommandPool;
+		if (vkAllocateCommandBuffers(device, &allocInfo, computeCommandBuffers.data()) != VK_SUCCESS) {
+			throw std::runtime_error("failed to allocate command buffers!");
+		}
+
+		acquireCommandBuffers.assign(settings.framesInFlight, VK_NULL_HANDLE);
+		if (transferQueue != VK_NULL_HANDLE) {
+			allocInfo.commandBufferCount = static_cast<uint32_t>(acquireCommandBuffers.size());
+			allocInfo.commandPool = commandPool;
+			if (vkAllocateCommandBuffers(device, &allocInfo, acquireCommandBuffers.data()) != VK_SUCCESS) {
+				throw std::runtime_error("failed to allocate command buffers!");
+			}
+		}
+	}
+
+	void createCommandPool() {
+		QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+
+		VkCommandPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+		// There are two possible flags for command pools :
+		// -- VK_COMMAND_POOL_CREATE_TRANSIENT_BIT: Hint that command buffers are rerecorded with new commands 
+		//    very often(may change memory allocation behavior)
+		// -- VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT : Allow command buffers to be rerecorded individually, 
+		//    without this flag they all have to be reset together
+		poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+
+		if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create command pool!");
+		}
+
+		// Command buffers can only be submitted to queues of the pool's family, so the transfer queue needs its own.
+		if (transferQueue != VK_NULL_HANDLE) {
+			poolInfo.queueFamilyIndex = deviceQueueFamilies.transferFamily.value();
+			if (vkCreateCommandPool(device, &poolInfo, nullptr, &transferCommandPool) != VK_SUCCESS) {
+				throw std::runtime_error("failed to create command pool!");
+			}
+		}
+
+		// Same for the compute queue, which may be the graphics queue itself.
+		poolInfo.queueFamilyIndex = deviceQueueFamilies.computeFamily.value_or(deviceQueueFamilies.graphicsFamily.value());
+		if (vkCreateCommandPool(device, &poolInfo, nullptr, &computeCommandPool) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create command pool!");
+		}
+	}
+
+	// Buffers
+	// -------
+	// Graphics cards offer different types of memory with different allowed operations and performance.  The
+	// allocator picks a memory type that suits the buffer and hands out a piece of one of its large blocks, which
+	// is bound at the allocation's offset.
+	//
+	// Buffers are EXCLUSIVE to one queue family unless sharingFamilies names more than one distinct family, in
+	// which case they are CONCURRENT and can be used from all of them without ownership transfers.
+	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, GpuAllocation& bufferMemory,
+		const std::vector<uint32_t>& sharingFamilies = {}) {
+		std::set<uint32_t> uniqueFamilies(sharingFamilies.begin(), sharingFamilies.end());
+		std::vector<uint32_t> concurrentFamilies(uniqueFamilies.begin(), uniqueFamilies.end());
+
+		VkBufferCreateInfo bufferInfo{};
+		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+		bufferInfo.size = size;
+		bufferInfo.usage = usage;
+		if (concurrentFamilies.size() > 1) {
+			bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+			bufferInfo.queueFamilyIndexCount = static_cast<uint32_t>(concurrentFamilies.size());
+			bufferInfo.pQueueFamilyIndices = concurrentFamilies.data();
+		}
+		else {
+			bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;  // Uploads through a transfer queue hand ownership over explicitly.
+		}
+
+		if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create buffer!");
+		}
+
+		bufferMemory = allocator.allocateBuffer(buffer, properties);
+		vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
+	}
+
+	void destroyBuffer(VkBuffer buffer, GpuAllocation& bufferMemory) {
+		vkDestroyBuffer(device, buffer, nullptr);
+		allocator.free(bufferMemory);
+	}
+
+	// The allocator keeps host visible memory mapped for the lifetime of the application.  HOST_COHERENT means
+	// writes through the pointer are seen by the GPU without vkFlushMappedMemoryRanges.
+	void createStagingBuffer() {
+		createBuffer(settings.stagingBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+		stagingMapped = static_cast<uint8_t*>(stagingBufferMemory.mapped);
+	}
+
+	// Unlike the staging ring, which feeds copies into device local memory, the frame arena is read by the GPU in
+	// place: uniforms, storage buffers and vertex data that change every frame are not worth a copy.  Offsets are
+	// aligned for any of those uses.
+	void createFrameArena() {
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		VkDeviceSize alignment = std::max({ properties.limits.minUniformBufferOffsetAlignment,
+			properties.limits.minStorageBufferOffsetAlignment, static_cast<VkDeviceSize>(16) });
+
+		VkDeviceSize regionSize = FRAME_ARENA_SIZE + (sizeof(float) * settings.markerCount + alignment) * MarkerInstances::ARRAY_COUNT;
+		regionSize = (regionSize + alignment - 1) / alignment * alignment;
+		createBuffer(regionSize * settings.framesInFlight,
+			VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, frameArenaBuffer, frameArenaMemory);
+		frameArena.init(frameArenaMemory.mapped, regionSize, alignment);
+		frameArena.begin(currentFrame);
+	}
+
+	// Reserve size bytes of the staging ring and return their offset.  When the ring is full the uploads queued so
+	// far are pushed out immediately and the GPU is drained, which only happens if a single frame uploads more than
+	// the ring holds.
+	// consumedBytes, if given, receives the bytes of the ring taken up, padding included.
+	VkDeviceSize allocateStaging(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize* consumedBytes = nullptr) {
+		if (size > settings.stagingBufferSize) {
+			throw std::runtime_error("upload is larger than the staging buffer!");
+		}
+
+		for (;;) {
+			VkDeviceSize offset = (stagingHead + alignment - 1) / alignment * alignment;
+			VkDeviceSize consumed = offset + size - stagingHead;
+			if (offset + size > settings.stagingBufferSize) {
+				// Not enough room before the end of the buffer, skip the rest of it and start over at 0.
+				offset = 0;
+				consumed = settings.stagingBufferSize - stagingHead + size;
+			}
+
+			if (stagingUsed + consumed <= settings.stagingBufferSize) {
+				stagingHead = offset + size;
+				stagingUsed += consumed;
+				stagingBatchSize += consumed;
+				if (consumedBytes != nullptr) {
+					*consumedBytes = consumed;
+				}
+				return offset;
+			}
+
+			flushUploads();
+		}
+	}
+
+	// Copy data into dstBuffer at dstOffset.  The copy is only queued here; it runs on the GPU ahead of the next
+	// frame's rendering.
+	void uploadBuffer(VkBuffer dstBuffer, const void* data, VkDeviceSize size, VkDeviceSize dstOffset = 0) {
+		// Buffer to buffer copies have no alignment rules, but 16 bytes keeps every copy friendly to the DMA engine.
+		VkDeviceSize srcOffset = allocateStaging(size, 16);
+		std::memcpy(stagingMapped + srcOffset, data, static_cast<size_t>(size));
+
+		VkBufferCopy region{};
+		region.srcOffset = srcOffset;
+		region.dstOffset = dstOffset;
+		region.size = size;
+		pendingUploads.push_back({ dstBuffer, region });
+	}
+
+	// Create DEVICE_LOCAL vertex and index buffers for a mesh and queue their contents for upload.
+	Mesh createMesh(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices) {
+		Mesh mesh;
+		mesh.indexCount = static_cast<uint32_t>(indices.size());
+		mesh.boundingRadius = boundingRadius(vertices.data(), vertices.size());
+
+		VkDeviceSize vertexBufferSize = sizeof(vertices[0]) * vertices.size();
+		createBuffer(vertexBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.vertexBuffer, mesh.vertexBufferMemory);
+		uploadBuffer(mesh.vertexBuffer, vertices.data(), vertexBufferSize);
+
+		if (vertices.size() <= 65536) {
+			mesh.indexType = VK_INDEX_TYPE_UINT16;
+			std::vector<uint16_t> shortIndices(indices.begin(), indices.end());
+			VkDeviceSize indexBufferSize = sizeof(uint16_t) * shortIndices.size();
+			createBuffer(indexBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.indexBuffer, mesh.indexBufferMemory);
+			uploadBuffer(mesh.indexBuffer, shortIndices.data(), indexBufferSize);
+		}
+		else {
+			mesh.indexType = VK_INDEX_TYPE_UINT32;
+			VkDeviceSize indexBufferSize = sizeof(uint32_t) * indices.size();
+			createBuffer(indexBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.indexBuffer, mesh.indexBufferMemory);
+			uploadBuffer(mesh.indexBuffer, indices.data(), indexBufferSize);
+		}
+
+		return mesh;
+	}
+
+	// Asset streaming
+	// ---------------
+	// Archive entries are decompressed by assetStreamer straight into the staging ring, so a mesh never passes
+	// through any other buffer on its way to the GPU.  The space is reserved up front, but unlike other staging
+	// space it cannot go out with the next upload submit: the copy only joins pendingUploads once the worker is
+	// done.  So it gets a region of its own that stays pinned (holding up everything behind it, since the ring is
+	// given back in order) until collectStreamedUploads queues the copy.
+	static constexpr uint64_t STAGING_PINNED = UINT64_MAX; // StagingRegion::frame of space still being streamed into.
+
+	// Frame after which staging space read by frame's upload submit is free again (see Upload submission).
+	uint64_t stagingReleaseFrame(uint64_t frame) const {
+		return frame + afrDeviceCount - 1;
+	}
+
+	void openAssetArchive() {
+		if (!settings.assetArchivePath.empty()) {
+			assets = AssetArchive(settings.assetArchivePath);
+			std::cout << "using " << assets.entries().size() << " assets from " << settings.assetArchivePath << std::endl;
+		}
+	}
+
+	// Stream entry into dstBuffer for meshes[meshIndex], whose pendingStreams counts it.
+	void streamToBuffer(const ArchiveEntry& entry, VkBuffer dstBuffer, uint32_t meshIndex) {
+		if (!assetStreamer) {
+			assetStreamer = std::make_unique<AssetStreamer>();
+		}
+
+		VkDeviceSize consumed = 0;
+		VkDeviceSize srcOffset = allocateStaging(entry.size, 16, &consumed);
+		// Split the batch: what came before still goes out with the next upload submit, this space stays pinned.
+		VkDeviceSize unpinned = stagingBatchSize - consumed;
+		if (unpinned > 0) {
+			stagingRegions.push_back({ stagingReleaseFrame(submittedFrames + 1), unpinned });
+		}
+		stagingRegions.push_back({ STAGING_PINNED, consumed });
+		stagingBatchSize = 0;
+
+		PendingStream stream{};
+		stream.id = assetStreamer->request(assets, entry, stagingMapped + srcOffset);
+		stream.upload.dstBuffer = dstBuffer;
+		stream.upload.region.srcOffset = srcOffset;
+		stream.upload.region.size = entry.size;
+		stream.stagingRegion = &stagingRegions.back();
+		stream.meshIndex = meshIndex;
+		pendingStreams.push_back(stream);
+	}
+
+	// Queue the copies of every stream that has finished.  The staging space is then given back like that of any
+	// other upload in the next submit.
+	void collectStreamedUploads() {
+		if (!assetStreamer) {
+			return;
+		}
+		for (const auto& completion : assetStreamer->takeCompleted()) {
+			PendingStream stream = pendingStreams.front();
+			pendingStreams.pop_front();
+			if (!completion.error.empty()) {
+				throw std::runtime_error("failed to stream asset: " + completion.error);
+			}
+
+			pendingUploads.push_back(stream.upload);
+			stream.stagingRegion->frame = stagingReleaseFrame(submittedFrames + 1);
+			if (--meshes[stream.meshIndex].pendingStreams == 0) {
+				staticCommandBuffersDirty = true;  // Pre-recorded buffers left the mesh out.
+			}
+		}
+	}
+
+	// Stream the mesh name from the asset archive: NAME.vertices holds Vertex data, NAME.indices 32-bit indices.
+	// The optional NAME.bounds is the bounding radius as a float, without it the mesh is never culled.  Returns
+	// false if the archive does not have the mesh.
+	bool streamMesh(const std::string& name) {
+		const ArchiveEntry* vertices = assets.isOpen() ? assets.find(name + ".vertices") : nullptr;
+		const ArchiveEntry* indices = assets.isOpen() ? assets.find(name + ".indices") : nullptr;
+		if (vertices == nullptr || indices == nullptr) {
+			return false;
+		}
+		if (vertices->size == 0 || indices->size == 0 || vertices->size % sizeof(Vertex) != 0 || indices->size % sizeof(uint32_t) != 0) {
+			throw std::runtime_error("asset archive has an invalid mesh " + name + "!");
+		}
+
+		Mesh mesh;
+		mesh.indexCount = static_cast<uint32_t>(indices->size / sizeof(uint32_t));
+		mesh.indexType = VK_INDEX_TYPE_UINT32;
+		mesh.pendingStreams = 2;
+		const ArchiveEntry* bounds = assets.find(name + ".bounds");
+		if (bounds != nullptr && bounds->size == sizeof(float)) {
+			assets.read(*bounds, &mesh.boundingRadius);
+		}
+		createBuffer(vertices->size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.vertexBuffer, mesh.vertexBufferMemory);
+		createBuffer(indices->size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.indexBuffer, mesh.indexBufferMemory);
+		meshes.push_back(mesh);
+
+		uint32_t meshIndex = static_cast<uint32_t>(meshes.size() - 1);
+		streamToBuffer(*vertices, mesh.vertexBuffer, meshIndex);
+		streamToBuffer(*indices, mesh.indexBuffer, meshIndex);
+		return true;
+	}
+
+	static float boundingRadius(const Vertex* vertices, size_t count) {
+		float radius = 0.0f;
+		for (size_t i = 0; i < count; i++) {
+			radius = std::max(radius, glm::length(vertices[i].pos));
+		}
+		return radius;
+	}
+
+	void destroyMesh(Mesh& mesh) {
+		destroyBuffer(mesh.indexBuffer, mesh.indexBufferMemory);
+		destroyBuffer(mesh.vertexBuffer, mesh.vertexBufferMemory);
+	}
+
+	// Upload submission
+	// -----------------
+	// With a dedicated transfer queue (see findQueueFamilies) the copies run on the GPU's DMA engine while the
+	// graphics queue keeps rendering.  Buffers are created with VK_SHARING_MODE_EXCLUSIVE, so every written range
+	// has to be handed over from the transfer family to the graphics family.  The transfer queue records a release
+	// barrier after the copies and the graphics queue records the matching acquire barrier before the data is
+	// used, with a semaphore ordering the two.
+	//
+	// Without a transfer queue the copies run on the graphics queue instead, followed by a memory barrier.  A
+	// pipeline barrier covers all commands later in submission order on the queue, so it also protects draws in
+	// command buffers submitted after it.
+	//
+	// Either way the graphics queue waits for the uploads before rendering, so graphicsTimelines reaching the frame covers them too.
+	// The consumed staging space is tagged with frame and given back once that frame has completed.  With a device
+	// group the copies run on every rendering device, but only one of them renders frame; the others are only known
+	// to be done with the staging space once their next frame has finished, afrDeviceCount - 1 frames later at most.
+
+	static constexpr VkPipelineStageFlags uploadWaitStage = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT; // First stage reading uploaded data.
+
+	// Record pendingUploads and submit the transfer side.  Returns false if there was nothing to upload.
+	// Otherwise graphicsSubmit is filled in with the batch the graphics queue has to run before anything reads
+	// the new data.  It points at the arguments, so they have to stay alive until it has been submitted.
+	bool submitUploads(const VkCommandBuffer& uploadCommandBuffer, const VkCommandBuffer& acquireCommandBuffer,
+		uint64_t frame, UploadSubmit& graphicsSubmit) {
+		if (pendingUploads.empty()) {
+			return false;
+		}
+		const bool dedicatedTransfer = transferQueue != VK_NULL_HANDLE;
+
+		// Both pools allow resetting individual buffers, so vkBeginCommandBuffer resets the previous recording.
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+		if (vkBeginCommandBuffer(uploadCommandBuffer, &beginInfo) != VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording command buffer!");
+		}
+
+		std::pmr::vector<VkBufferMemoryBarrier> ownershipBarriers(&frameScratch);
+		for (const auto& upload : pendingUploads) {
+			vkCmdCopyBuffer(uploadCommandBuffer, stagingBuffer, upload.dstBuffer, 1, &upload.region);
+
+			VkBufferMemoryBarrier barrier{};
+			barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask = 0; // Ignored by the release, the acquire on the graphics queue sets its own.
+			barrier.srcQueueFamilyIndex = deviceQueueFamilies.transferFamily.value_or(VK_QUEUE_FAMILY_IGNORED);
+			barrier.dstQueueFamilyIndex = deviceQueueFamilies.graphicsFamily.value();
+			barrier.buffer = upload.dstBuffer;
+			barrier.offset = upload.region.dstOffset;
+			barrier.size = upload.region.size;
+			ownershipBarriers.push_back(barrier);
+		}
+
+		if (dedicatedTransfer) {
+			vkCmdPipelineBarrier(uploadCommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+				0, nullptr, static_cast<uint32_t>(ownershipBarriers.size()), ownershipBarriers.data(), 0, nullptr);
+		}
+		else {
+			VkMemoryBarrier barrier{};
+			barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+			vkCmdPipelineBarrier(uploadCommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, uploadWaitStage, 0,
+				1, &barrier, 0, nullptr, 0, nullptr);
+		}
+
+		if (vkEndCommandBuffer(uploadCommandBuffer) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
+		}
+
+		stagingRegions.push_back({ stagingReleaseFrame(frame), stagingBatchSize });
+		stagingBatchSize = 0;
+		pendingUploads.clear();
+
+		graphicsSubmit.submitInfo = {};
+		graphicsSubmit.submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		if (!dedicatedTransfer) {
+			graphicsSubmit.submitInfo.commandBufferCount = 1;
+			graphicsSubmit.submitInfo.pCommandBuffers = &uploadCommandBuffer;
+			return true;
+		}
+
+		graphicsSubmit.waitValue = ++transferSubmits;
+
+		VkTimelineSemaphoreSubmitInfo transferTimelineInfo{};
+		transferTimelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+		transferTimelineInfo.signalSemaphoreValueCount = 1;
+		transferTimelineInfo.pSignalSemaphoreValues = &graphicsSubmit.waitValue;
+
+		VkSubmitInfo transferSubmit{};
+		transferSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		transferSubmit.pNext = &transferTimelineInfo;
+		transferSubmit.commandBufferCount = 1;
+		transferSubmit.pCommandBuffers = &uploadCommandBuffer;
+		transferSubmit.signalSemaphoreCount = 1;
+		transferSubmit.pSignalSemaphores = &transferTimeline;
+		if (vkQueueSubmit(transferQueue, 1, &transferSubmit, VK_NULL_HANDLE) != VK_SUCCESS) {
+			throw std::runtime_error("failed to submit upload command buffer!");
+		}
+
+		// The acquire half of the ownership transfer.  Its source stage matches the semaphore wait so the two
+		// form one dependency chain.
+		if (vkBeginCommandBuffer(acquireCommandBuffer, &beginInfo) != VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording command buffer!");
+		}
+		for (auto& barrier : ownershipBarriers) {
+			barrier.srcAccessMask = 0;
+			barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+		}
+		vkCmdPipelineBarrier(acquireCommandBuffer, uploadWaitStage, uploadWaitStage, 0,
+			0, nullptr, static_cast<uint32_t>(ownershipBarriers.size()), ownershipBarriers.data(), 0, nullptr);
+		if (vkEndCommandBuffer(acquireCommandBuffer) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
+		}
+
+		graphicsSubmit.timelineInfo = {};
+		graphicsSubmit.timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+		graphicsSubmit.timelineInfo.waitSemaphoreValueCount = 1;
+		graphicsSubmit.timelineInfo.pWaitSemaphoreValues = &graphicsSubmit.waitValue;
+
+		graphicsSubmit.submitInfo.pNext = &graphicsSubmit.timelineInfo;
+		graphicsSubmit.submitInfo.waitSemaphoreCount = 1;
+		graphicsSubmit.submitInfo.pWaitSemaphores = &transferTimeline;
+		graphicsSubmit.submitInfo.pWaitDstStageMask = &uploadWaitStage;
+		graphicsSubmit.submitInfo.commandBufferCount = 1;
+		graphicsSubmit.submitInfo.pCommandBuffers = &acquireCommandBuffer;
+		return true;
+	}
+
+	// Give back staging space whose frames have finished.
+	void releaseStagingRegions() {
+		while (!stagingRegions.empty() && stagingRegions.front().frame <= completedFrames) {
+			stagingUsed -= stagingRegions.front().size;
+			stagingRegions.pop_front();
+		}
+		if (stagingUsed == 0) {
+			stagingHead = 0;  // Nothing in use, so the next allocation may as well start at the front.
+		}
+	}
+
+	// Slow path for a full staging ring: submit what is pending on its own and wait for the GPU to drain, after
+	// which the whole ring is free again.
+	void flushUploads() {
+		// Streamed assets still hold pinned staging space, so they have to land before the ring can be emptied.
+		if (assetStreamer) {
+			assetStreamer->waitIdle();
+			collectStreamedUploads();
+		}
+		if (!pendingUploads.empty()) {
+			VkCommandBufferAllocateInfo allocInfo{};
+			allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+			allocInfo.commandPool = transferQueue != VK_NULL_HANDLE ? transferCommandPool : commandPool;
+			allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+			allocInfo.commandBufferCount = 1;
+
+			VkCommandBuffer uploadCommandBuffer;
+			VkCommandBuffer acquireCommandBuffer = VK_NULL_HANDLE;
+			if (vkAllocateCommandBuffers(device, &allocInfo, &uploadCommandBuffer) != VK_SUCCESS) {
+				throw std::runtime_error("failed to allocate command buffers!");
+			}
+			if (transferQueue != VK_NULL_HANDLE) {
+				allocInfo.commandPool = commandPool;
+				if (vkAllocateCommandBuffers(device, &allocInfo, &acquireCommandBuffer) != VK_SUCCESS) {
+					throw std::runtime_error("failed to allocate command buffers!");
+				}
+			}
+
+			UploadSubmit graphicsSubmit;
+			DeviceGroupSubmit groupSubmit(&frameScratch);
+			submitUploads(uploadCommandBuffer, acquireCommandBuffer, submittedFrames, graphicsSubmit);
+			chainDeviceGroupSubmit(graphicsSubmit.submitInfo, groupSubmit, renderDevicesMask(), 0);
+			if (vkQueueSubmit(graphicsQueue, 1, &graphicsSubmit.submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+				throw std::runtime_error("failed to submit upload command buffer!");
+			}
+			vkQueueWaitIdle(graphicsQueue); // The graphics batch waited for the transfer one, so both are done.
+
+			if (transferQueue != VK_NULL_HANDLE) {
+				vkFreeCommandBuffers(device, transferCommandPool, 1, &uploadCommandBuffer);
+				vkFreeCommandBuffers(device, commandPool, 1, &acquireCommandBuffer);
+			}
+			else {
+				vkFreeCommandBuffers(device, commandPool, 1, &uploadCommandBuffer);
+			}
+		}
+		else {
+			vkQueueWaitIdle(graphicsQueue);
+		}
+
+		// Idle queue means every submitted frame is done, and so is every upload, whatever frame it was tagged with.
+		completedFrames = submittedFrames;
+		stagingRegions.clear();
+		stagingUsed = 0;
+		releaseStagingRegions();
+		runDeferredDestroys();
+	}
 
-		if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
-			throw std::runtime_error("failed to create command pool!");
+	// Multisampling
+	// -------------
+	// MSAA renders into an image with several samples per pixel, which the render pass resolves (averages) into the
+	// swap chain image at the end of the subpass.  Nothing ever reads the multisampled image afterwards, so it is
+	// stored with STORE_OP_DONT_CARE and allocated by the frame graph as a transient attachment: on tile-based GPUs
+	// the samples then live in tile memory only and just the resolved pixels are written out.
+	void chooseSampleCount() {
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		VkSampleCountFlags supported = properties.limits.framebufferColorSampleCounts;
+
+		msaaSamples = VK_SAMPLE_COUNT_1_BIT;
+		for (VkSampleCountFlagBits count : { VK_SAMPLE_COUNT_8_BIT, VK_SAMPLE_COUNT_4_BIT, VK_SAMPLE_COUNT_2_BIT }) {
+			if (count <= settings.msaaSamples && (supported & count)) {
+				msaaSamples = count;
+				break;
+			}
+		}
+		if (msaaSamples != settings.msaaSamples) {
+			std::cout << "using " << msaaSamples << "x MSAA, the most this GPU supports up to " << settings.msaaSamples << "x" << std::endl;
 		}
 
+		VkPhysicalDeviceFeatures supportedFeatures;
+		vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+		sampleShadingEnabled = settings.sampleShading && msaaSamples != VK_SAMPLE_COUNT_1_BIT && supportedFeatures.sampleRateShading;
+		if (settings.sampleShading && !sampleShadingEnabled) {
+			std::cerr << "sample shading needs MSAA and sampleRateShading, shading once per pixel" << std::endl;
+		}
 	}
 
 	void createFrameBuffers() {
 		swapChainFramebuffers.resize(swapChainImageViews.size());
 		for (size_t i = 0; i < swapChainImageViews.size(); i++) {
-			VkImageView attachments[] = {
-				swapChainImageViews[i]
-			};
+			// With MSAA every framebuffer renders into the one multisampled image and resolves into its own.
+			std::vector<VkImageView> attachments = { swapChainImageViews[i].get() };
+			if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+				attachments.insert(attachments.begin(), frameGraph->imageView(msaaColorResource));
+			}
 
 			VkFramebufferCreateInfo framebufferInfo{};
 			framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
 			framebufferInfo.renderPass = renderPass;
-			framebufferInfo.attachmentCount = 1;
-			framebufferInfo.pAttachments = attachments;
+			framebufferInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+			framebufferInfo.pAttachments = attachments.data();
 			framebufferInfo.width = swapChainExtent.width;
 			framebufferInfo.height = swapChainExtent.height;
 			framebufferInfo.layers = 1;
 
-			if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &swapChainFramebuffers[i]) != VK_SUCCESS) {
+			VkFramebuffer framebuffer;
+			if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &framebuffer) != VK_SUCCESS) {
 				throw std::runtime_error("failed to create framebuffer!");
 			}
+			swapChainFramebuffers[i] = UniqueFramebuffer(device, framebuffer);
 		}
 	}
 
@@ -340,9 +1840,12 @@ private:
 		// the swap chain.
 		VkAttachmentDescription colorAttachment{};
 		colorAttachment.format = swapChainImageFormat;
-		colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+		colorAttachment.samples = msaaSamples;
 		colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
 		colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+			colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;  // Only the resolved image is kept.
+		}
 		// The above applies to depth data.
 		// The loadOp and storeOp determine what to do with the data in the attachment before rendering and after rendering.
 		// We have the following choices for loadOp:
@@ -356,8 +1859,10 @@ private:
 		colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 		colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE; 
 		// These apply to stencil data.
-		colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-		colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		// The frame graph moves the image into COLOR_ATTACHMENT_OPTIMAL before the render pass and on to wherever it
+		// goes next (presenting, the readback) after it, so the render pass itself leaves the layout alone.
+		colorAttachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 		// Textures and framebuffers in Vulkan are represented by VkImage objects with a certain pixel format, however the 
 		// layout of the pixels in memory can change based on what you're trying to do with an image.
 		// Some of the most common layouts are :
@@ -370,11 +1875,24 @@ private:
 		colorAttachmentRef.attachment = 0;  // Index to an array of VkAttachmentDescription.
 		colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
+		// With MSAA the swap chain image is attachment 1, the subpass's resolve attachment.  Its old contents are
+		// overwritten by the resolve, so there is nothing to load.
+		VkAttachmentDescription resolveAttachment = colorAttachment;
+		resolveAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+		resolveAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		resolveAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		VkAttachmentReference resolveAttachmentRef{};
+		resolveAttachmentRef.attachment = 1;
+		resolveAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		VkAttachmentDescription attachments[] = { colorAttachment, resolveAttachment };
+		const uint32_t attachmentCount = msaaSamples != VK_SAMPLE_COUNT_1_BIT ? 2 : 1;
+
 		// Define subpasses.
 		VkSubpassDescription subpass{};
 		subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
 		subpass.colorAttachmentCount = 1;
 		subpass.pColorAttachments= &colorAttachmentRef; 
+		subpass.pResolveAttachments = attachmentCount == 2 ? &resolveAttachmentRef : nullptr;
 		// The index of the attachment in this array is directly referenced from the fragment shader with the 
 		// layout(location = 0) out vec4 outColor directive!
 		// The following other types of attachments can be referenced by a subpass :
@@ -385,52 +1903,327 @@ private:
 
 		// Subpass dependencies
 		// --------------------
-		// Remember that the subpasses in a render pass automatically take care of image layout transitions. These 
-		// transitions are controlled by subpass dependencies, which specify memory and execution dependencies between 
-		// subpasses.We have only a single subpass right now, but the operations right before and right after this 
-		// subpass also count as implicit "subpasses".
-		//
-		// There are two built - in dependencies that take care of the transition at the start of the render pass and 
-		// at the end of the render pass, but the former does not occur at the right time. It assumes that the 
-		// transition occurs at the start of the pipeline, but we haven't acquired the image yet at that point! There 
-		// are two ways to deal with this problem. We could change the waitStages for the imageAvailableSemaphore to 
-		// VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT to ensure that the render passes don't begin until the image is 
-		// available, or we can make the render pass wait for the VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT stage.
-		// I've decided to go with the second option here, because it's a good excuse to have a look at subpass 
-		// dependencies and how they work.
-
-		VkSubpassDependency dependency{};
-		dependency.srcSubpass = VK_SUBPASS_EXTERNAL;  // Refers to implicit subpass before or after rendering pass.
-		dependency.dstSubpass = 0;  // Refers to actual subpass.
-		dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-		dependency.srcAccessMask = 0;
-		dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-		dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		// Subpasses can take care of image layout transitions themselves, controlled by subpass dependencies, and the
+		// operations right before and right after the render pass count as implicit "subpasses" (VK_SUBPASS_EXTERNAL).
+		// Here the frame graph places those barriers instead (see createFrameGraph): it knows what comes before and
+		// after the render pass, such as the acquire or the readback copy, which the render pass cannot.  With no
+		// layout changes left inside the render pass, the implicit external dependencies are all it needs.
 
 		// Finally create the render pass.
 		VkRenderPassCreateInfo renderPassInfo{};
 		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-		renderPassInfo.attachmentCount = 1;
-		renderPassInfo.pAttachments = &colorAttachment;
+		renderPassInfo.attachmentCount = attachmentCount;
+		renderPassInfo.pAttachments = attachments;
 		renderPassInfo.subpassCount = 1;
 		renderPassInfo.pSubpasses = &subpass;
-		renderPassInfo.dependencyCount = 1;
-		renderPassInfo.pDependencies = &dependency;
+		renderPassInfo.dependencyCount = 0;
+		renderPassInfo.pDependencies = nullptr;
 
-		if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) != VK_SUCCESS) {
+		VkRenderPass newRenderPass;
+		if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &newRenderPass) != VK_SUCCESS) {
 			throw std::runtime_error("failed to create render pass!");
 		}
+		renderPass = UniqueRenderPass(device, newRenderPass);
+
+	}
+
+	// Frame graph
+	// -----------
+	// Every pass of the frame and what it reads and writes.  RenderGraph turns that into the barriers and layout
+	// transitions between the passes, which used to be spelled out by hand in the render pass's subpass
+	// dependencies.  The graph itself only changes with the swap chain; every frame just tells it which image and
+	// readback buffer to use.
+	void createFrameGraph() {
+		frameGraph = std::make_unique<RenderGraph>();
+		RenderGraph& graph = *frameGraph;
+
+		// The old contents of the image are never needed.  The submit waits on the acquire at the color attachment
+		// output stage, so that is what the first transition has to wait for.  Offscreen nothing presents the
+		// image; it stays in whatever layout the last pass left it in.
+		RenderGraph::ResourceState acquired{ VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0 };
+		RenderGraph::ResourceState presented{ VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0 };
+		if (settings.offscreen) {
+			presented = { readbackBuffers.empty() ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 0, 0 };
+		}
+		backbufferResource = graph.importImage("backbuffer", VK_IMAGE_ASPECT_COLOR_BIT, acquired, presented);
+
+		// With MSAA the scene renders into a transient multisampled image and resolves into the swap chain image.
+		if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+			msaaColorResource = graph.createImage("msaa color", { swapChainImageFormat, swapChainExtent, msaaSamples });
+		}
+		graph.addPass("scene", [this](RenderGraph::PassBuilder& pass) {
+			if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+				pass.colorAttachment(msaaColorResource);
+				pass.resolveAttachment(backbufferResource);
+			}
+			else {
+				pass.colorAttachment(backbufferResource);
+			}
+		}, [this](VkCommandBuffer commandBuffer) {
+			recordScenePass(commandBuffer);
+		});
+
+		if (!readbackBuffers.empty()) {
+			// The host reads the buffer once the frame has completed.
+			readbackResource = graph.importBuffer("readback", { VK_IMAGE_LAYOUT_UNDEFINED, 0, 0 },
+				{ VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT });
+			graph.addPass("readback", [this](RenderGraph::PassBuilder& pass) {
+				pass.copySource(backbufferResource);
+				pass.copyDestination(readbackResource);
+			}, [this](VkCommandBuffer commandBuffer) {
+				recordReadback(commandBuffer, graphFrame.imageIndex, graphFrame.frame);
+			});
+		}
+
+		graph.compile(device, allocator);
+		if (!frameGraphReported) {
+			graph.printStats(std::cout);
+			frameGraphReported = true;
+		}
+	}
+
+	// Pipeline cache
+	// --------------
+	// Turning SPIR-V into GPU machine code happens inside vkCreate*Pipelines and is by far the slowest part of
+	// pipeline creation.  A VkPipelineCache lets the driver skip that work for pipelines it has already compiled.
+	// The cache contents can be pulled out with vkGetPipelineCacheData, written to disk and handed back on the
+	// next launch through VkPipelineCacheCreateInfo::pInitialData, so only the very first run pays the full cost.
+	//
+	// The blob is only meaningful to the exact driver and GPU that produced it.  Every blob starts with a
+	// VkPipelineCacheHeaderVersionOne holding the vendor ID, device ID and pipelineCacheUUID, which we compare
+	// against VkPhysicalDeviceProperties.  Drivers are required to reject incompatible data themselves, but
+	// checking up front lets us log why the cache was dropped and avoids handing garbage to a buggy driver.
+
+	bool isPipelineCacheCompatible(const MappedFile& data) {
+		VkPipelineCacheHeaderVersionOne header{};
+		if (data.size() < sizeof(header)) {
+			return false;
+		}
+		std::memcpy(&header, data.data(), sizeof(header));
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+		return header.headerSize >= sizeof(header) &&
+			header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+			header.vendorID == properties.vendorID &&
+			header.deviceID == properties.deviceID &&
+			std::memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+	}
+
+	void createPipelineCache() {
+		// The driver copies the initial data, so the mapping only has to outlive vkCreatePipelineCache.  A missing
+		// file just means there is no cache yet.
+		MappedFile cacheData;
+		if (!settings.pipelineCachePath.empty()) {
+			try {
+				cacheData = MappedFile(settings.pipelineCachePath);
+			}
+			catch (const std::exception&) {
+			}
+		}
+
+		if (!cacheData.empty() && !isPipelineCacheCompatible(cacheData)) {
+			std::cout << "pipeline cache " << settings.pipelineCachePath << " was written by another driver or GPU, ignoring it\n";
+			cacheData = MappedFile();
+		}
+
+		VkPipelineCacheCreateInfo cacheInfo{};
+		cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+		cacheInfo.initialDataSize = cacheData.size();
+		cacheInfo.pInitialData = cacheData.empty() ? nullptr : cacheData.data();
+
+		if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+			// The header looked fine but the driver still refused the contents.  Start over with an empty cache.
+			cacheInfo.initialDataSize = 0;
+			cacheInfo.pInitialData = nullptr;
+			if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+				throw std::runtime_error("failed to create pipeline cache!");
+			}
+		}
+	}
+
+	// Write the cache back to disk so the next launch can reuse everything compiled during this one.
+	// Failing to save is not fatal; the next run simply compiles from scratch again.
+	void savePipelineCache() {
+		if (settings.pipelineCachePath.empty()) {
+			return;
+		}
+
+		size_t dataSize = 0;
+		if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0) {
+			return;
+		}
+		std::vector<char> cacheData(dataSize);
+		if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, cacheData.data()) != VK_SUCCESS) {
+			return;
+		}
+
+		std::ofstream file(settings.pipelineCachePath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			std::cerr << "failed to write pipeline cache " << settings.pipelineCachePath << std::endl;
+			return;
+		}
+		file.write(cacheData.data(), dataSize);
+	}
+
+	// Bindless resources
+	// ------------------
+	// Every buffer and texture a shader reads lives in bindlessHeap, a single descriptor set that is bound once per
+	// command buffer.  Draws pass indices into it as push constants instead of binding descriptor sets of their
+	// own, so the layouts never change and the draw loop does no descriptor work at all.
+	void createBindlessHeap() {
+		bindlessHeap.init(physicalDevice, device, BINDLESS_MAX_BUFFERS, BINDLESS_MAX_TEXTURES,
+			VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT);
+	}
+
+	void createPipelineLayout() {
+		// Set 0 is the bindless heap, the push constants say what in it a draw uses.
+		VkDescriptorSetLayout setLayout = bindlessHeap.layout();
+
+		VkPushConstantRange pushConstantRange{};
+		pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+		pushConstantRange.offset = 0;
+		pushConstantRange.size = sizeof(DrawConstants);
+
+		VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+		pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		pipelineLayoutInfo.setLayoutCount = 1;
+		pipelineLayoutInfo.pSetLayouts = &setLayout;
+		pipelineLayoutInfo.pushConstantRangeCount = 1;
+		pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+		VkPipelineLayout layout;
+		if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &layout) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create pipeline layout!");
+		}
+		pipelineLayout = UniquePipelineLayout(device, layout);
+	}
+
+	// SPIR-V for a pipeline, from the asset archive if it has the file and from the loose file otherwise.  Stored
+	// archive entries and loose files are used straight from their mapping; only compressed entries are copied out.
+	// code points into the other members (and moving keeps it valid).
+	struct ShaderSource {
+		MappedFile file;
+		std::vector<uint32_t> words;
+		SpirvCode code{};
+	};
+
+	ShaderSource loadShader(const std::string& name) {
+		ShaderSource shader;
+		const ArchiveEntry* entry = assets.isOpen() ? assets.find(name) : nullptr;
+		if (entry != nullptr && entry->codec == AssetCodec::Stored) {
+			shader.code = { reinterpret_cast<const uint32_t*>(assets.view(*entry)), entry->size };
+		}
+		else if (entry != nullptr) {
+			shader.words.resize((entry->size + 3) / 4);
+			assets.read(*entry, shader.words.data());
+			shader.code = { shader.words.data(), entry->size };
+		}
+		else {
+			shader.file = MappedFile(name);
+			shader.code = { shader.file.words(), shader.file.size() };
+		}
+		return shader;
+	}
+
+	// Vertex buffer bindings and attributes of a graphics pipeline.  PipelineStateDesc::vertexLayout says which.
+	enum class VertexLayout : uint32_t {
+		Mesh,
+		Marker
+	};
+
+	struct VertexInputLayout {
+		std::vector<VkVertexInputBindingDescription> bindings;
+		std::vector<VkVertexInputAttributeDescription> attributes;
+	};
+
+	// The scene's draws only read the mesh from vertex buffers.
+	static VertexInputLayout meshInputLayout() {
+		auto attributes = Vertex::getAttributeDescriptions();
+		return { { Vertex::getBindingDescription() }, { attributes.begin(), attributes.end() } };
+	}
+
+	// The markers add their per-instance arrays.
+	static VertexInputLayout markerInputLayout() {
+		VertexInputLayout layout = meshInputLayout();
+		auto bindings = MarkerInstances::getBindingDescriptions();
+		auto attributes = MarkerInstances::getAttributeDescriptions();
+		layout.bindings.insert(layout.bindings.end(), bindings.begin(), bindings.end());
+		layout.attributes.insert(layout.attributes.end(), attributes.begin(), attributes.end());
+		return layout;
+	}
 
+	static VertexInputLayout vertexInputLayout(uint32_t layout) {
+		return static_cast<VertexLayout>(layout) == VertexLayout::Marker ? markerInputLayout() : meshInputLayout();
 	}
 
+	// Graphics pipelines
+	// ------------------
+	// Draw code never holds on to a VkPipeline.  It asks pipelineStates for the pipeline of a PipelineStateDesc,
+	// which compiles it the first time.  Every state the frame can use is known here, so all of them are compiled
+	// now (on the recording threads, when there are any) and drawing only ever looks them up.  Called again when
+	// the swap chain format changes, which makes every pipeline so far incompatible.
+	//
+	// See loadShader for where the SPIR-V comes from.  The markers share the fragment shader.
 	void createGraphicsPipeline() {
-		auto vertShaderCode = readFile("vert.spv");
-		auto fragShaderCode = readFile("frag.spv");
+		pipelineStates.init(device, [this](const PipelineStateDesc& state) {
+			return buildGraphicsPipeline(state);
+		});
+
+		// Everything the render target decides.
+		PipelineStateDesc target;
+		target.renderPass = renderPass;
+		target.samples = msaaSamples;
+		target.sampleShading = sampleShadingEnabled ? VK_TRUE : VK_FALSE;
+		target.colorFormat = swapChainImageFormat;
+
+		// The cache only holds on to shaders its pipelines use, so these have to last until the prewarm.
+		ShaderSource vertShader = loadShader("vert.spv");
+		ShaderSource fragShader = loadShader("frag.spv");
+		PipelineStateCache::Shader vertex = pipelineStates.addShader(vertShader.code.code, vertShader.code.codeSize);
+		PipelineStateCache::Shader fragment = pipelineStates.addShader(fragShader.code.code, fragShader.code.codeSize);
+		PipelineStateCache::Shader markerVertex;
+		sceneState = target;
+		sceneState.vertexShader = vertex.hash;
+		sceneState.fragmentShader = fragment.hash;
+		sceneState.vertexLayout = static_cast<uint32_t>(VertexLayout::Mesh);
+		std::vector<PipelineStateDesc> states = { sceneState };
+
+		if (settings.markerCount > 0) {
+			ShaderSource markerShader = loadShader("marker_vert.spv");
+			markerVertex = pipelineStates.addShader(markerShader.code.code, markerShader.code.codeSize);
+			markerState = sceneState;
+			markerState.vertexShader = markerVertex.hash;
+			markerState.vertexLayout = static_cast<uint32_t>(VertexLayout::Marker);
+			additiveMarkerState = markerState;
+			additiveMarkerState.blendEnable = VK_TRUE;
+			additiveMarkerState.srcBlendFactor = VK_BLEND_FACTOR_ONE;
+			additiveMarkerState.dstBlendFactor = VK_BLEND_FACTOR_ONE;
+			states.push_back(markerState);
+			states.push_back(additiveMarkerState);
+		}
+		pipelineStates.prewarm(states, jobSystem.get());
+
+		// Hot reload builds from these (see createShaderManager).
+		for (ReloadTarget& reloadTarget : reloadTargets) {
+			for (size_t i = 0; i < reloadTarget.states.size(); i++) {
+				reloadTarget.buildStates[i] = *reloadTarget.states[i];
+			}
+		}
+	}
 
+	// pipelineStates compiles every permutation through here, on whichever thread first needs it, and so does the
+	// shader manager on its own thread.  The state read here only changes while builds are paused (see
+	// recreateSwapChain), and the pipeline cache is internally synchronized.
+	VkPipeline buildGraphicsPipeline(const PipelineStateDesc& state) {
 		// The modules are just a thin wrapper around the bytecode.
 
-		VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
-		VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+		std::shared_ptr<const std::vector<uint32_t>> vertShaderCode = pipelineStates.shader(state.vertexShader);
+		std::shared_ptr<const std::vector<uint32_t>> fragShaderCode = pipelineStates.shader(state.fragmentShader);
+		UniqueShaderModule vertShaderModule = createShaderModule({ vertShaderCode->data(), vertShaderCode->size() * sizeof(uint32_t) });
+		UniqueShaderModule fragShaderModule = createShaderModule({ fragShaderCode->data(), fragShaderCode->size() * sizeof(uint32_t) });
+		const VertexInputLayout inputLayout = vertexInputLayout(state.vertexLayout);
 
 		// Create shader stages for these modules.
 
@@ -474,9 +2267,9 @@ private:
 
 		// Vertex Input Fixed Stage
 
-		// In this tutorial, the vertices were hard-coded in the vertex shader.  
-		// Therefore, no vertex buffer is needed.  Nevertheless, it must be specified
-		// that we're not using it.
+		// Originally the vertices were hard-coded in the vertex shader, so no vertex
+		// buffer was needed and both arrays below were empty.  Now they describe the
+		// layout of Vertex.
 
 		// -- Bindings: spacing between data and whether the data is per-vertex or
 		//    per-instance (see instancing)
@@ -488,12 +2281,14 @@ private:
 		// vertex data. Add this structure to the createGraphicsPipeline function right 
 		// after the shaderStages array.
 
+		// Binding 0 steps per vertex through the mesh.  The scene's per-draw offsets come from the bindless heap
+		// instead; the markers add per-instance bindings (see markerInputLayout).
 		VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
 		vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-		vertexInputInfo.vertexBindingDescriptionCount = 0;
-		vertexInputInfo.pVertexBindingDescriptions = nullptr; // Optional
-		vertexInputInfo.vertexAttributeDescriptionCount = 0;
-		vertexInputInfo.pVertexAttributeDescriptions = nullptr; // Optional
+		vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(inputLayout.bindings.size());
+		vertexInputInfo.pVertexBindingDescriptions = inputLayout.bindings.data();
+		vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(inputLayout.attributes.size());
+		vertexInputInfo.pVertexAttributeDescriptions = inputLayout.attributes.data();
 
 		// Input Assembly Fixed Stage
 
@@ -520,7 +2315,7 @@ private:
 
 		VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
 		inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-		inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+		inputAssembly.topology = state.topology;
 		inputAssembly.primitiveRestartEnable = VK_FALSE;
 
 		// Viewports and Scissors
@@ -574,7 +2369,7 @@ private:
 		// some special cases like shadow maps.  Need to enable GPU feature for it.
 		rasterizer.rasterizerDiscardEnable = VK_FALSE;  // IF set to true, no output
 		// is sent to this state, effectively disabling image production.
-		rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+		rasterizer.polygonMode = state.polygonMode;
 		// polygonMode determines how fragments are generated for geometry:
 		//
 		// -- VK_POLYGON_MODE_FILL: fill the area of the polygon with fragments
@@ -584,8 +2379,8 @@ private:
 		// Any mode other than FILL requires GPU feature to be enabled.
 		rasterizer.lineWidth = 1.0f;  // determines thickness of lines in units of
 		// fragments.  Any thicker than 1.0f requires wideLines GPU feature enabled.
-		rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-		rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
+		rasterizer.cullMode = state.cullMode;
+		rasterizer.frontFace = state.frontFace;
 		// Face culling:  none, front, back, or both.
 		// Front face:  Vertex order of face in "front"  (clockwise or counterclockwise).
 		rasterizer.depthBiasEnable = VK_FALSE;
@@ -594,11 +2389,12 @@ private:
 		rasterizer.depthBiasSlopeFactor = 0.0f; // Optional
 		// Depth bias is used for shadow mapping.  Not used here, hence VK_FALSE.
 
-		// Keep multisampling disabled for now, it will be revisited in later chapters.
+		// Must match the render pass's color attachment (see chooseSampleCount).  Sample shading runs the fragment
+		// shader for at least minSampleShading of the samples of every pixel, here all of them.
 		VkPipelineMultisampleStateCreateInfo multisampling{};
 		multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-		multisampling.sampleShadingEnable = VK_FALSE; // Disable for now.
-		multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT; // # of samples per bit
+		multisampling.sampleShadingEnable = state.sampleShading;
+		multisampling.rasterizationSamples = state.samples; // # of samples per pixel
 		multisampling.minSampleShading = 1.0f; // Optional
 		multisampling.pSampleMask = nullptr; // Optional
 		multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
@@ -609,12 +2405,12 @@ private:
 
 		VkPipelineColorBlendAttachmentState colorBlendAttachment{};
 		colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-		colorBlendAttachment.blendEnable = VK_FALSE;
-		colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-		colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
+		colorBlendAttachment.blendEnable = state.blendEnable;
+		colorBlendAttachment.srcColorBlendFactor = state.srcBlendFactor; // Optional
+		colorBlendAttachment.dstColorBlendFactor = state.dstBlendFactor; // Optional
 		colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD; // Optional
-		colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-		colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
+		colorBlendAttachment.srcAlphaBlendFactor = state.srcBlendFactor; // Optional
+		colorBlendAttachment.dstAlphaBlendFactor = state.dstBlendFactor; // Optional
 		colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD; // Optional
 
 		// For an alpha blend attachment use this instead:
@@ -637,19 +2433,15 @@ private:
 		colorBlending.blendConstants[1] = 0.0f; // Optional
 		colorBlending.blendConstants[2] = 0.0f; // Optional
 		colorBlending.blendConstants[3] = 0.0f; // Optional
- 
 
-		// Need to create default empty pipeline layout even if using nothing.
-		VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-		pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-		pipelineLayoutInfo.setLayoutCount = 0; // Optional
-		pipelineLayoutInfo.pSetLayouts = nullptr; // Optional
-		pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-		pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+		// Only used when the render pass has a depth attachment (state.depthFormat).
+		VkPipelineDepthStencilStateCreateInfo depthStencil{};
+		depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+		depthStencil.depthTestEnable = state.depthTest;
+		depthStencil.depthWriteEnable = state.depthWrite;
+		depthStencil.depthCompareOp = state.depthCompare;
 
-		if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
-			throw std::runtime_error("failed to create pipeline layout!");
-		}
+		// The pipeline layout is created once up front (createPipelineLayout); it does not depend on the shaders.
 
 		// We can now combine all of the structures and objects from the previous chapters to create the graphics pipeline!
 		// Here's the types of objects we have now, as a quick recap:
@@ -674,7 +2466,7 @@ private:
 		pipelineInfo.pViewportState = &viewportState;
 		pipelineInfo.pRasterizationState = &rasterizer;
 		pipelineInfo.pMultisampleState = &multisampling;
-		pipelineInfo.pDepthStencilState = nullptr; // Optional
+		pipelineInfo.pDepthStencilState = state.depthFormat != VK_FORMAT_UNDEFINED ? &depthStencil : nullptr;
 		pipelineInfo.pColorBlendState = &colorBlending;
 		pipelineInfo.pDynamicState = &dynamicState;
 
@@ -687,40 +2479,496 @@ private:
 		// have to be compatible with renderPass.The requirements for compatibility are described here, but we won't be using 
 		// that feature in this tutorial.
 
-		pipelineInfo.renderPass = renderPass;
-		pipelineInfo.subpass = 0;
+		pipelineInfo.renderPass = state.renderPass;
+		pipelineInfo.subpass = state.subpass;
+
+		// With dynamic rendering renderPass is VK_NULL_HANDLE and the pipeline is only told the attachment formats.
+		// The pipeline then does not depend on any other object, which also keeps permutations cheap to create.
+		VkPipelineRenderingCreateInfoKHR renderingInfo{};
+		renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR;
+		renderingInfo.colorAttachmentCount = 1;
+		renderingInfo.pColorAttachmentFormats = &state.colorFormat;
+		renderingInfo.depthAttachmentFormat = state.depthFormat;
+		if (state.renderPass == VK_NULL_HANDLE) {
+			pipelineInfo.pNext = &renderingInfo;
+		}
 
 		pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 		pipelineInfo.basePipelineIndex = -1; // Optional
 
-		// Create the pipeline..... finally!
-		if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS) {
-			throw std::runtime_error("failed to create graphics pipeline!");
-		}
+		// Create the pipeline..... finally!  Pass the pipeline cache so a previous run's compile can be reused.
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		VkResult result = vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline);
 
 		// Compilation and linking of GPU machine code  until graphics pipeline is
 		// created.  Since we already created it, the modules are no longer needed
-		// and can be destroyed.
+		// and are destroyed on the way out.  (Also when creation failed, since a hot reload carries on afterwards.)
+
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("failed to create graphics pipeline!");
+		}
+		return pipeline;
+	}
+
+	// Compute pipeline
+	// ----------------
+	// Compute pipelines only have a single programmable stage, so they are a lot simpler to create than graphics
+	// pipelines.  The draw layout shader writes one offset per draw into a storage buffer, which the vertex shader
+	// then reads back for its instance.  Both find the buffer in the bindless heap.  Push constants carry the
+	// handful of values that change every frame.
+	void createComputePipeline() {
+		VkDescriptorSetLayout setLayout = bindlessHeap.layout();
+
+		// The cull pipeline shares the layout, so the range covers the push constants of both.
+		VkPushConstantRange pushConstantRange{};
+		pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		pushConstantRange.offset = 0;
+		pushConstantRange.size = static_cast<uint32_t>(std::max(sizeof(DrawLayoutParams), sizeof(CullParams)));
+
+		VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+		pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		pipelineLayoutInfo.setLayoutCount = 1;
+		pipelineLayoutInfo.pSetLayouts = &setLayout;
+		pipelineLayoutInfo.pushConstantRangeCount = 1;
+		pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+		VkPipelineLayout layout;
+		if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &layout) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create pipeline layout!");
+		}
+		computePipelineLayout = UniquePipelineLayout(device, layout);
+
+		ShaderSource compShader = loadShader("draw_layout.spv");
+		computePipeline = UniquePipeline(device, buildComputePipeline(compShader.code));
+		if (gpuDrivenEnabled) {
+			ShaderSource cullShader = loadShader("cull_draws.spv");
+			cullPipeline = UniquePipeline(device, buildComputePipeline(cullShader.code));
+		}
+	}
+
+	// Like buildGraphicsPipeline, also called from the shader manager's thread.
+	VkPipeline buildComputePipeline(SpirvCode compShaderCode) {
+		UniqueShaderModule compShaderModule = createShaderModule(compShaderCode);
+
+		VkComputePipelineCreateInfo pipelineInfo{};
+		pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+		pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+		pipelineInfo.stage.module = compShaderModule;
+		pipelineInfo.stage.pName = "main";
+		pipelineInfo.layout = computePipelineLayout;
+
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		VkResult result = vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline);
+		if (result != VK_SUCCESS) {
+			throw std::runtime_error("failed to create compute pipeline!");
+		}
+		return pipeline;
+	}
+
+	// Shader hot reload
+	// -----------------
+	// Edit a shader while the application runs and the shader manager compiles it, builds a new pipeline on its own
+	// thread (through the pipeline cache, so unchanged stages come back quickly) and hands it over at the next frame
+	// boundary.  The pipeline layouts stay as they are, so a reloaded shader has to keep the same interface.
+	void createShaderManager() {
+		if (!settings.shaderHotReload) {
+			return;
+		}
+		// A graphics program rebuilds every one of its states with the new shaders swapped in.  The shader manager
+		// only hands over one pipeline, so all of them travel to swapReloadedPipelines through reloadedStates.
+		auto addGraphicsProgram = [this](const std::string& name, const std::string& vertSource, const std::string& vertSpirv,
+			std::vector<PipelineStateDesc*> states) {
+			const uint32_t program = static_cast<uint32_t>(reloadTargets.size());
+			shaderManager.addProgram(name, { { vertSource, vertSpirv }, { "tutorial_fragment_shader.frag", "frag.spv" } },
+				[this, program](const std::vector<std::vector<uint32_t>>& spirv) {
+					ReloadedStates reloaded{};
+					reloaded.vertexShader = pipelineStates.addShader(spirv[0].data(), spirv[0].size() * sizeof(uint32_t));
+					reloaded.fragmentShader = pipelineStates.addShader(spirv[1].data(), spirv[1].size() * sizeof(uint32_t));
+					std::vector<UniquePipeline> pipelines; // Destroys the ones built so far if a later one fails.
+					for (PipelineStateDesc state : reloadTargets[program].buildStates) {
+						state.vertexShader = reloaded.vertexShader.hash;
+						state.fragmentShader = reloaded.fragmentShader.hash;
+						pipelines.emplace_back(device, buildGraphicsPipeline(state));
+						reloaded.built.push_back({ state, pipelines.back() });
+					}
+					for (UniquePipeline& pipeline : pipelines) {
+						pipeline.release();
+					}
+					reloaded.handedOver = reloaded.built.front().second;
+					std::lock_guard<std::mutex> lock(reloadedStatesMutex);
+					reloadedStates.push_back(std::move(reloaded));
+					return reloadedStates.back().handedOver;
+				});
+			std::vector<PipelineStateDesc> buildStates;
+			for (PipelineStateDesc* state : states) {
+				buildStates.push_back(*state);
+			}
+			reloadTargets.push_back({ nullptr, std::move(states), std::move(buildStates) });
+		};
+		auto addComputeProgram = [this](const std::string& name, const std::string& source, const std::string& spirvPath,
+			UniquePipeline* pipeline) {
+			shaderManager.addProgram(name, { { source, spirvPath } },
+				[this](const std::vector<std::vector<uint32_t>>& spirv) {
+					return buildComputePipeline({ spirv[0].data(), spirv[0].size() * sizeof(uint32_t) });
+				});
+			reloadTargets.push_back({ pipeline, {}, {} });
+		};
+
+		addGraphicsProgram("graphics", "tutorial_vertex_shader.vert", "vert.spv", { &sceneState });
+		if (settings.markerCount > 0) {
+			addGraphicsProgram("markers", "marker_vertex_shader.vert", "marker_vert.spv", { &markerState, &additiveMarkerState });
+		}
+		addComputeProgram("compute", "draw_layout.comp", "draw_layout.spv", &computePipeline);
+		if (gpuDrivenEnabled) {
+			addComputeProgram("cull", "cull_draws.comp", "cull_draws.spv", &cullPipeline);
+		}
+
+		std::string compiler = ShaderManager::defaultCompiler();
+		shaderManager.start(compiler, SHADER_POLL_INTERVAL);
+		std::cout << "watching shaders, compiling with " << compiler << std::endl;
+	}
+
+	// Put pipelines the shader manager has finished in use.  Only called between frames, so nothing recorded so far
+	// refers to the new ones.  The old ones may still be in flight and are destroyed once their frames are done.
+	void swapReloadedPipelines() {
+		shaderManager.takeReady([this](uint32_t program, VkPipeline pipeline) {
+			const ReloadTarget& target = reloadTargets[program];
+			if (target.pipeline != nullptr) {
+				retire(std::move(*target.pipeline));
+				*target.pipeline = UniquePipeline(device, pipeline);
+				return;
+			}
+
+			ReloadedStates reloaded;
+			{
+				std::lock_guard<std::mutex> lock(reloadedStatesMutex);
+				auto found = std::find_if(reloadedStates.begin(), reloadedStates.end(),
+					[pipeline](const ReloadedStates& entry) { return entry.handedOver == pipeline; });
+				if (found == reloadedStates.end()) {
+					throw std::runtime_error("failed to find states of reloaded pipeline!");
+				}
+				reloaded = std::move(*found);
+				reloadedStates.erase(found);
+			}
+
+			// The pipelines under the old states go once the frames using them are done, and with the last of them
+			// the old shaders.  An unchanged state (the shader was only saved again) keeps its pipeline.
+			for (size_t i = 0; i < reloaded.built.size(); i++) {
+				const PipelineStateDesc& state = reloaded.built[i].first;
+				UniquePipeline rebuilt(device, reloaded.built[i].second);
+				if (state == *target.states[i]) {
+					continue;
+				}
+				retire(pipelineStates.remove(*target.states[i]));
+				pipelineStates.insert(state, std::move(rebuilt));
+				*target.states[i] = state;
+			}
+			staticCommandBuffersDirty = true;  // The pre-recorded buffers bind the old pipelines.
+		});
+	}
+
+	// Per frame in flight buffers the compute pass writes and the draws read, each with a slot in the bindless heap.
+	// They are shared CONCURRENTly between the compute and graphics families, so no ownership transfer is
+	// needed each frame; the timeline semaphore provides the memory dependency.
+	void createComputeResources() {
+		VkDeviceSize bufferSize = sizeof(InstanceOffset) * drawCommands.size();
+		std::vector<uint32_t> sharingFamilies = { deviceQueueFamilies.graphicsFamily.value(),
+			deviceQueueFamilies.computeFamily.value_or(deviceQueueFamilies.graphicsFamily.value()) };
+
+		instanceOffsetBuffers.resize(settings.framesInFlight);
+		instanceOffsetBufferMemory.resize(settings.framesInFlight);
+		for (uint32_t i = 0; i < settings.framesInFlight; i++) {
+			createBuffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, instanceOffsetBuffers[i], instanceOffsetBufferMemory[i], sharingFamilies);
+			instanceOffsetBufferIndices.push_back(bindlessHeap.addStorageBuffer(instanceOffsetBuffers[i]));
+		}
+	}
+
+	// Instanced markers
+	// -----------------
+	// However many markers there are, they all go out in one vkCmdDrawIndexed with instanceCount set to the
+	// number that are on screen.  Per-instance data reaches the vertex shader through vertex bindings with
+	// VK_VERTEX_INPUT_RATE_INSTANCE, one per MarkerInstances array, all pointing into this frame's part of the
+	// frame arena.  That is host visible and written in place by the CPU, so there is no upload: the part is
+	// simply not touched again until graphicsTimelines say the frame that read it has finished.
+	//
+	// The markers cover a field larger than the view, which pans around, so many of them are off screen at any
+	// time.  Every frame the CPU moves all of them, culls them against the view with frustumCuller, and copies
+	// just the visible ones into the arena, packed together.  Since that changes every frame, markers need the
+	// command buffers recorded every frame too.
+	void createMarkers() {
+		if (settings.markerCount == 0) {
+			return;
+		}
+		if (settings.staticScene) {
+			std::cout << "markers are culled every frame, which pre-recorded command buffers cannot follow, drawing none" << std::endl;
+			return;
+		}
+		markersEnabled = true;
+		const uint32_t count = settings.markerCount;
+		markerVisibleCounts.assign(settings.framesInFlight, 0);
+		markerArrayOffsets.resize(settings.framesInFlight);
+
+		// A square grid over the whole field, each marker a fraction of its cell.
+		const uint32_t columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(count))));
+		const float cell = 2.0f * MARKER_FIELD_EXTENT / columns;
+		markerBaseX.resize(count);
+		markerBaseY.resize(count);
+		markerScale.resize(count);
+		markerColor.resize(count);
+		for (uint32_t i = 0; i < count; i++) {
+			markerBaseX[i] = -MARKER_FIELD_EXTENT + cell * (i % columns + 0.5f);
+			markerBaseY[i] = -MARKER_FIELD_EXTENT + cell * (i / columns + 0.5f);
+			markerScale[i] = cell * 0.5f;
+			uint32_t red = 255 * (i % columns) / columns;
+			uint32_t green = 255 * (i / columns) / columns;
+			markerColor[i] = red | green << 8 | 255u << 16 | 255u << 24;
+		}
+		markerX.resize(count);
+		markerY.resize(count);
+		markerZ.assign(count, 0.0f);  // The scene is flat.
+		markerRadius.resize(count);
+		markerVisible.resize(count);
+
+		// The scene is drawn straight in clip space, so the view projection is the identity.
+		const glm::mat4 viewProjection(1.0f);
+		markerFrustum = FrustumCuller::frustumFromMatrix(&viewProjection[0][0]);
+		std::cout << "culling markers with " << FrustumCuller::name(frustumCuller.activeInstructionSet()) << std::endl;
+	}
+
+	// Move, cull and pack this frame's markers.  Moving them is a few flat loops over plain float arrays, which the
+	// compiler turns into SIMD code.  The copy into the arena writes the mapped memory front to back (it is often
+	// write-combined) and reads the CPU-side arrays in increasing order.
+	void updateMarkers() {
+		if (!markersEnabled) {
+			return;
+		}
+		const float time = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+		const float panX = MARKER_PAN_RADIUS * std::cos(time * 0.25f);
+		const float panY = MARKER_PAN_RADIUS * std::sin(time * 0.25f);
+		const float meshRadius = meshes[0].boundingRadius;
+		const float* baseX = markerBaseX.data();
+		const float* baseY = markerBaseY.data();
+		const float* scale = markerScale.data();
+		float* x = markerX.data();
+		float* y = markerY.data();
+		float* radius = markerRadius.data();
+		const uint32_t count = settings.markerCount;
+		for (uint32_t i = 0; i < count; i++) {
+			x[i] = baseX[i] + panX + MARKER_MOTION_RADIUS * std::cos(time * 2.0f + baseY[i] * 8.0f);
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			y[i] = baseY[i] + panY + MARKER_MOTION_RADIUS * std::sin(time * 2.0f + baseX[i] * 8.0f);
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			radius[i] = scale[i] * meshRadius;  // INFINITY until the mesh's bounds are known, which keeps them all.
+		}
+
+		FrustumCuller::Spheres spheres{ x, y, markerZ.data(), radius };
+		uint32_t visibleCount = frustumCuller.cullSpheres(markerFrustum, spheres, count, markerVisible.data());
+
+		std::array<VkDeviceSize, MarkerInstances::ARRAY_COUNT>& offsets = markerArrayOffsets[currentFrame];
+		MarkerInstances instances;
+		instances.x = frameArena.allocateArray<float>(visibleCount, &offsets[0]);
+		instances.y = frameArena.allocateArray<float>(visibleCount, &offsets[1]);
+		instances.scale = frameArena.allocateArray<float>(visibleCount, &offsets[2]);
+		instances.color = frameArena.allocateArray<uint32_t>(visibleCount, &offsets[3]);
+		const uint32_t* visible = markerVisible.data();
+		const uint32_t* color = markerColor.data();
+		for (uint32_t i = 0; i < visibleCount; i++) {
+			instances.x[i] = x[visible[i]];
+		}
+		for (uint32_t i = 0; i < visibleCount; i++) {
+			instances.y[i] = y[visible[i]];
+		}
+		for (uint32_t i = 0; i < visibleCount; i++) {
+			instances.scale[i] = scale[visible[i]];
+		}
+		for (uint32_t i = 0; i < visibleCount; i++) {
+			instances.color[i] = color[visible[i]];
+		}
+		markerVisibleCounts[currentFrame] = visibleCount;
+	}
+
+	// Record the markers' single draw.  Goes after the scene's draws in the same command buffer, whose viewport,
+	// scissor and bindless heap it keeps using; the marker pipeline shares pipelineLayout.
+	void recordMarkers(VkCommandBuffer commandBuffer, uint32_t frame) {
+		const Mesh& mesh = meshes[0];
+		if (!markersEnabled || mesh.pendingStreams > 0 || markerVisibleCounts[frame] == 0) {
+			return;
+		}
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineStates.get(additiveMarkers ? additiveMarkerState : markerState));
+		bindMesh(commandBuffer, mesh);
+
+		VkBuffer buffers[MarkerInstances::ARRAY_COUNT];
+		std::fill(std::begin(buffers), std::end(buffers), frameArenaBuffer);
+		vkCmdBindVertexBuffers(commandBuffer, MarkerInstances::FIRST_BINDING, MarkerInstances::ARRAY_COUNT, buffers,
+			markerArrayOffsets[frame].data());
+		vkCmdDrawIndexed(commandBuffer, mesh.indexCount, markerVisibleCounts[frame], 0, 0, 0);
+	}
+
+	// GPU-driven rendering
+	// --------------------
+	// Recording a draw call per object costs CPU time for every object, visible or not.  Here the CPU only ever
+	// records one vkCmdDrawIndexedIndirectCount per mesh.  Every frame the cull pass (cull_draws.comp) runs right
+	// after the draw layout in the same compute submit, tests each object against the view and appends the ones
+	// that survive to their mesh's batch of VkDrawIndexedIndirectCommands, counting them as it goes.  The draw
+	// then reads both the commands and the count from the GPU.
+	//
+	// The object data never changes, so it is written once straight into host visible memory; the compute queue
+	// needs no upload or ownership transfer to read it.  The command and count buffers are per frame in flight and
+	// shared CONCURRENTly, like the offsets.
+	void createGpuDrivenResources() {
+		if (!gpuDrivenEnabled) {
+			return;
+		}
+
+		// One batch per mesh, with room for every object that uses the mesh.
+		std::vector<uint32_t> batchOfMesh(meshes.size(), UINT32_MAX);
+		for (const auto& draw : drawCommands) {
+			if (batchOfMesh[draw.meshIndex] == UINT32_MAX) {
+				batchOfMesh[draw.meshIndex] = static_cast<uint32_t>(drawBatches.size());
+				drawBatches.push_back({ draw.meshIndex, 0, 0 });
+			}
+			drawBatches[batchOfMesh[draw.meshIndex]].maxDraws++;
+		}
+		uint32_t commandCount = 0;
+		for (auto& batch : drawBatches) {
+			batch.firstCommand = commandCount;
+			commandCount += batch.maxDraws;
+		}
+
+		std::vector<uint32_t> sharingFamilies = { deviceQueueFamilies.graphicsFamily.value(),
+			deviceQueueFamilies.computeFamily.value_or(deviceQueueFamilies.graphicsFamily.value()) };
+
+		VkDeviceSize objectBufferSize = sizeof(ObjectData) * drawCommands.size();
+		createBuffer(objectBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, objectBuffer, objectBufferMemory, sharingFamilies);
+		ObjectData* objects = static_cast<ObjectData*>(objectBufferMemory.mapped);
+		for (const auto& draw : drawCommands) {
+			const Mesh& mesh = meshes[draw.meshIndex];
+			const DrawBatch& batch = drawBatches[batchOfMesh[draw.meshIndex]];
+			*objects++ = { batchOfMesh[draw.meshIndex], batch.firstCommand, mesh.indexCount, draw.instanceCount,
+				draw.firstInstance, mesh.boundingRadius };
+		}
+		objectBufferIndex = bindlessHeap.addStorageBuffer(objectBuffer);
+
+		indirectCommandBuffers.resize(settings.framesInFlight);
+		indirectCommandBufferMemory.resize(settings.framesInFlight);
+		drawCountBuffers.resize(settings.framesInFlight);
+		drawCountBufferMemory.resize(settings.framesInFlight);
+		for (uint32_t i = 0; i < settings.framesInFlight; i++) {
+			createBuffer(sizeof(VkDrawIndexedIndirectCommand) * commandCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indirectCommandBuffers[i], indirectCommandBufferMemory[i], sharingFamilies);
+			createBuffer(sizeof(uint32_t) * drawBatches.size(),
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, drawCountBuffers[i], drawCountBufferMemory[i], sharingFamilies);
+			indirectCommandBufferIndices.push_back(bindlessHeap.addStorageBuffer(indirectCommandBuffers[i]));
+			drawCountBufferIndices.push_back(bindlessHeap.addStorageBuffer(drawCountBuffers[i]));
+		}
+	}
+
+	// Record the cull pass after the draw layout, whose offsets it reads.  The counts start at zero every frame.
+	void recordCullPass(VkCommandBuffer commandBuffer) {
+		vkCmdFillBuffer(commandBuffer, drawCountBuffers[currentFrame], 0, VK_WHOLE_SIZE, 0);
+
+		// Both the offsets and the cleared counts have to land before the cull shader reads them.
+		VkMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+		CullParams params{};
+		params.objectCount = static_cast<uint32_t>(drawCommands.size());
+		params.objectBuffer = objectBufferIndex;
+		params.instanceBuffer = instanceOffsetBufferIndices[currentFrame];
+		params.commandBuffer = indirectCommandBufferIndices[currentFrame];
+		params.countBuffer = drawCountBufferIndices[currentFrame];
+
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+		vkCmdPushConstants(commandBuffer, computePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+		vkCmdDispatch(commandBuffer, (params.objectCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+	}
+
+	// Record and submit this frame's compute pass.  It runs on the frame's render device and signals that device's
+	// computeTimelines with frameNumber, which the graphics submit of the same frame waits for before reading the offsets.
+	void submitComputePass(uint64_t frameNumber) {
+		VkCommandBuffer commandBuffer = computeCommandBuffers[currentFrame];
+
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+		if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording command buffer!");
+		}
+
+		DrawLayoutParams params{};
+		params.time = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+		params.drawCount = static_cast<uint32_t>(drawCommands.size());
+		params.instanceBuffer = instanceOffsetBufferIndices[currentFrame];
+
+		gpuProfiler.begin(commandBuffer, currentFrame, computeRegion);
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
+		VkDescriptorSet bindlessSet = bindlessHeap.set();
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipelineLayout, 0, 1, &bindlessSet, 0, nullptr);
+		vkCmdPushConstants(commandBuffer, computePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+		vkCmdDispatch(commandBuffer, (params.drawCount + DRAW_LAYOUT_GROUP_SIZE - 1) / DRAW_LAYOUT_GROUP_SIZE, 1, 1);
+		gpuProfiler.end(commandBuffer, currentFrame, computeRegion);
+		if (gpuDrivenEnabled) {
+			gpuProfiler.begin(commandBuffer, currentFrame, cullRegion);
+			recordCullPass(commandBuffer);  // Same layout, so the heap stays bound.
+			gpuProfiler.end(commandBuffer, currentFrame, cullRegion);
+		}
+
+		if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
+		}
+
+		VkTimelineSemaphoreSubmitInfo timelineInfo{};
+		timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+		timelineInfo.signalSemaphoreValueCount = 1;
+		timelineInfo.pSignalSemaphoreValues = &frameNumber;
+
+		VkSubmitInfo submitInfo{};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.pNext = &timelineInfo;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &commandBuffer;
+		const uint32_t renderDevice = renderDeviceOf(frameNumber);
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &computeTimelines[renderDevice];
 
-		vkDestroyShaderModule(device, fragShaderModule, nullptr);
-		vkDestroyShaderModule(device, vertShaderModule, nullptr);
+		DeviceGroupSubmit groupSubmit(&frameScratch);
+		chainDeviceGroupSubmit(submitInfo, groupSubmit, 1u << renderDevice, renderDevice);
 
+		if (vkQueueSubmit(computeQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+			throw std::runtime_error("failed to submit compute command buffer!");
+		}
 	}
 
 	// Wrap byte-code into a shader module to be used in the pipeline.
 
-	VkShaderModule createShaderModule(const std::vector<char>& code) {
+	UniqueShaderModule createShaderModule(SpirvCode code) {
+		// SPIR-V is a stream of 32-bit words, so anything else cannot be a shader.
+		if (code.codeSize == 0 || code.codeSize % sizeof(uint32_t) != 0) {
+			throw std::runtime_error("failed to create shader module: not SPIR-V!");
+		}
+
 		VkShaderModuleCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-		createInfo.codeSize = code.size();
-		createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+		createInfo.codeSize = code.codeSize;
+		createInfo.pCode = code.code;
 
 		VkShaderModule shaderModule;
 		if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS) {
 			throw std::runtime_error("failed to create shader module!");
 		}
 
-		return shaderModule;
+		return UniqueShaderModule(device, shaderModule);
 	}
 
 	void createImageViews() {
@@ -748,13 +2996,16 @@ private:
 			createInfo.subresourceRange.baseArrayLayer = 0;
 			createInfo.subresourceRange.layerCount = 1;  // This might be different for stereoscopic 3D images.
 
-			if (vkCreateImageView(device, &createInfo, nullptr, &swapChainImageViews[i]) != VK_SUCCESS) {
+			VkImageView imageView;
+			if (vkCreateImageView(device, &createInfo, nullptr, &imageView) != VK_SUCCESS) {
 				throw std::runtime_error("failed to create image views!");
 			}
+			swapChainImageViews[i] = UniqueImageView(device, imageView);
 		}
 	}
 
-	void createSwapChain() {
+	// oldSwapChain is the chain being replaced when recreating, or VK_NULL_HANDLE the first time.
+	void createSwapChain(VkSwapchainKHR oldSwapChain = VK_NULL_HANDLE) {
 		SwapChainSupportDetails swapChainSupport = querySwapChainSupport(physicalDevice);
 
 		VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
@@ -762,11 +3013,9 @@ private:
 		VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
 
 		// Number of images in the swap chain...
-		uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;  // attempt 1 more than minimum for good performance
-		// Make sure not to exceed maximum....
-		if (swapChainSupport.capabilities.maxImageCount > 0 && imageCount > swapChainSupport.capabilities.maxImageCount) {
-			imageCount = swapChainSupport.capabilities.maxImageCount;
-		}
+		uint32_t imageCount = chooseSwapImageCount(presentMode, swapChainSupport.capabilities);
+		std::cout << "present policy " << presentPolicyName(settings.presentPolicy) << ": " << presentModeName(presentMode)
+			<< " with " << imageCount << " images" << std::endl;
 
 		// Fill in the structure to send all of this information to Vulkan and get our magic 
 		// handles.
@@ -806,8 +3055,17 @@ private:
 		createInfo.presentMode = presentMode;
 		createInfo.clipped = VK_TRUE;  // Don't care about color of pixels that are obscured by another window, for example.
 
-		createInfo.oldSwapchain = VK_NULL_HANDLE;  // If Window resizes, a new swap chain must be created from scratch.  However, the NULL HANDLE
-		// says to simply give up if a resize happens.
+		createInfo.oldSwapchain = oldSwapChain;  // When the window resizes a new swap chain must be created.  Passing the old one lets the
+		// driver hand its resources over to the new chain, and frames already in flight may still present from the old one.
+		// The old chain is retired by this call:  no more images can be acquired from it, but it still has to be destroyed.
+
+		// A device group swap chain has to know which present modes drawFrame will use.
+		VkDeviceGroupSwapchainCreateInfoKHR groupInfo{};
+		groupInfo.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_SWAPCHAIN_CREATE_INFO_KHR;
+		groupInfo.modes = groupPresentModeSupport & (VK_DEVICE_GROUP_PRESENT_MODE_LOCAL_BIT_KHR | VK_DEVICE_GROUP_PRESENT_MODE_REMOTE_BIT_KHR);
+		if (groupDeviceCount > 1) {
+			createInfo.pNext = &groupInfo;
+		}
 
 		if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain) != VK_SUCCESS) {
 			throw std::runtime_error("failed to create the swap chain!");
@@ -821,7 +3079,218 @@ private:
 		swapChainExtent = extent;
 	}
 
+	// Offscreen rendering
+	// -------------------
+	// Without a surface there is no swap chain to hand out images, so create our own: one device local color image
+	// per frame in flight, in the format the swap chain would most likely have picked.  A frame always renders into
+	// its own image, so the same wait that frees the command buffer also frees the image.
+	void createOffscreenTargets() {
+		swapChainImageFormat = VK_FORMAT_B8G8R8A8_SRGB;
+		swapChainExtent = { WIDTH, HEIGHT };
+
+		VkFormatProperties formatProperties;
+		vkGetPhysicalDeviceFormatProperties(physicalDevice, swapChainImageFormat, &formatProperties);
+		if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT)) {
+			throw std::runtime_error("failed to find a color attachment format for offscreen rendering!");
+		}
+
+		VkImageCreateInfo imageInfo{};
+		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		imageInfo.imageType = VK_IMAGE_TYPE_2D;
+		imageInfo.format = swapChainImageFormat;
+		imageInfo.extent = { swapChainExtent.width, swapChainExtent.height, 1 };
+		imageInfo.mipLevels = 1;
+		imageInfo.arrayLayers = 1;
+		imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+		imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+		if (!settings.readbackPath.empty()) {
+			imageInfo.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+		}
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+		swapChainImages.resize(settings.framesInFlight);
+		offscreenImageMemory.resize(settings.framesInFlight);
+		for (uint32_t i = 0; i < settings.framesInFlight; i++) {
+			if (vkCreateImage(device, &imageInfo, nullptr, &swapChainImages[i]) != VK_SUCCESS) {
+				throw std::runtime_error("failed to create offscreen image!");
+			}
+			// Full-screen render targets: dedicated, like the swap chain's own images.
+			offscreenImageMemory[i] = allocator.allocateImage(swapChainImages[i], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+				GpuResourceKind::Optimal, true);
+			vkBindImageMemory(device, swapChainImages[i], offscreenImageMemory[i].memory, offscreenImageMemory[i].offset);
+		}
+
+		// Readback goes through host visible buffers that stay mapped.  They are only read once the frame has
+		// finished, so copying the image out never stalls the frame that rendered it.
+		if (!settings.readbackPath.empty()) {
+			VkDeviceSize readbackSize = VkDeviceSize(swapChainExtent.width) * swapChainExtent.height * 4;
+			readbackBuffers.resize(settings.framesInFlight);
+			readbackBufferMemory.resize(settings.framesInFlight);
+			for (uint32_t i = 0; i < settings.framesInFlight; i++) {
+				createBuffer(readbackSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					readbackBuffers[i], readbackBufferMemory[i]);
+			}
+		}
+	}
+
+	// Copy the rendered image into frame's readback buffer.  Records no barriers: the frame graph's "readback" pass
+	// moves the image to TRANSFER_SRC_OPTIMAL before it, and the graph's final barrier to HOST_READ makes the copy
+	// visible to the host once the frame has finished.
+	void recordReadback(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t frame) {
+		VkBufferImageCopy region{};
+		region.bufferOffset = 0;
+		region.bufferRowLength = 0; // Tightly packed.
+		region.bufferImageHeight = 0;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = 0;
+		region.imageSubresource.baseArrayLayer = 0;
+		region.imageSubresource.layerCount = 1;
+		region.imageOffset = { 0, 0, 0 };
+		region.imageExtent = { swapChainExtent.width, swapChainExtent.height, 1 };
+		vkCmdCopyImageToBuffer(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffers[frame], 1, &region);
+	}
+
+	// Write the newest finished readback as a binary PPM.  Only called once the device is idle.
+	void writeReadbackImage() {
+		uint32_t newest = 0;
+		for (uint32_t i = 1; i < settings.framesInFlight; i++) {
+			if (frameNumbers[i] > frameNumbers[newest]) {
+				newest = i;
+			}
+		}
+		if (frameNumbers[newest] == 0) {
+			return;  // Nothing was ever rendered.
+		}
+
+		std::ofstream file(settings.readbackPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			throw std::runtime_error("failed to open readback output file!");
+		}
+		file << "P6\n" << swapChainExtent.width << " " << swapChainExtent.height << "\n255\n";
+
+		// The image is BGRA; PPM wants RGB.
+		const uint8_t* pixels = static_cast<const uint8_t*>(readbackBufferMemory[newest].mapped);
+		std::vector<char> row(swapChainExtent.width * 3);
+		for (uint32_t y = 0; y < swapChainExtent.height; y++) {
+			const uint8_t* source = pixels + size_t(y) * swapChainExtent.width * 4;
+			for (uint32_t x = 0; x < swapChainExtent.width; x++) {
+				row[x * 3 + 0] = static_cast<char>(source[x * 4 + 2]);
+				row[x * 3 + 1] = static_cast<char>(source[x * 4 + 1]);
+				row[x * 3 + 2] = static_cast<char>(source[x * 4 + 0]);
+			}
+			file.write(row.data(), row.size());
+		}
+	}
+
+	// Swap chain recreation
+	// --------------------
+	// The swap chain is tied to the size and properties of the surface.  When the window is resized (or moved to
+	// a display with a different mode) vkAcquireNextImageKHR and vkQueuePresentKHR report VK_ERROR_OUT_OF_DATE_KHR
+	// or VK_SUBOPTIMAL_KHR, and a new swap chain has to be built.
+	//
+	// The simple approach is vkDeviceWaitIdle followed by destroying everything, which stalls the CPU until the GPU
+	// has drained every frame in flight.  Instead the old swap chain, image views and framebuffers are handed to
+	// the deferred destroy queue and released once the frames that used them have finished.
+	void recreateSwapChain() {
+		// A minimized window has a zero sized framebuffer.  There is nothing to render to, so wait it out.
+		int width = 0, height = 0;
+		glfwGetFramebufferSize(window, &width, &height);
+		while ((width == 0 || height == 0) && !glfwWindowShouldClose(window)) {
+			glfwWaitEvents();
+			glfwGetFramebufferSize(window, &width, &height);
+		}
+		if (width == 0 || height == 0) {
+			return;  // Closed while minimized.
+		}
+
+		// Pipeline rebuilds read the swap chain extent and render pass, so hold them off until both are replaced.
+		auto pausedBuilds = shaderManager.pauseBuilds();
+
+		VkSwapchainKHR oldSwapChain = swapChain;
+		firstPresentIdOfSwapChain = submittedFrames + 1;  // Presents to the old chain can no longer be waited on.
+		// Everything on the old chain's images may still be in use by frames in flight.  The framebuffers go first,
+		// then the views they use; the chain itself follows below.
+		retire(std::move(swapChainFramebuffers));
+		retire(std::move(swapChainImageViews));
+		VkFormat oldFormat = swapChainImageFormat;
+
+		createSwapChain(oldSwapChain);
+		createImageViews();
+
+		// The render pass and pipeline only depend on the image format.  It normally stays the same, but a
+		// display mode change (e.g. to HDR) can pick a different one.
+		if (swapChainImageFormat != oldFormat) {
+			// Reloaded pipelines not yet taken were built for the old render pass.  Put them in use now, so they
+			// are retired together with it.
+			swapReloadedPipelines();
+			retire(pipelineStates.release());
+			retire(std::move(renderPass));
+			if (!dynamicRenderingEnabled) {
+				createRenderPass();
+			}
+			createGraphicsPipeline();
+		}
+
+		// Transient images of the old graph may still be in use by frames in flight.
+		retire(std::move(frameGraph));
+		createFrameGraph();
+		if (!dynamicRenderingEnabled) {
+			createFrameBuffers();  // Dynamic rendering names the image views when rendering begins instead.
+		}
+
+		retire(UniqueSwapchain(device, oldSwapChain));
+
+		// The new chain may have a different number of images, none of which are in use yet.
+		imageFrames.assign(swapChainImages.size(), 0);
+
+		// Pre-recorded command buffers refer to the old framebuffers (and possibly the old pipeline).
+		staticCommandBuffersDirty = true;
+	}
+
+	void cleanupSwapChain() {
+		frameGraph.reset();
+		swapChainFramebuffers.clear();
+
+		// Clean up the image views that were created for us.
+		swapChainImageViews.clear();
+
+		if (settings.offscreen) {
+			// Offscreen images are ours rather than the swap chain's.
+			for (size_t i = 0; i < swapChainImages.size(); i++) {
+				vkDestroyImage(device, swapChainImages[i], nullptr);
+				allocator.free(offscreenImageMemory[i]);
+			}
+			for (size_t i = 0; i < readbackBuffers.size(); i++) {
+				destroyBuffer(readbackBuffers[i], readbackBufferMemory[i]);
+			}
+			return;
+		}
+
+		vkDestroySwapchainKHR(device, swapChain, nullptr);
+	}
+
+	// Queue an object for destruction once every frame submitted so far has completed on the GPU.
+	void deferDestroy(std::function<void()> destroy) {
+		deletionQueue.push(submittedFrames, std::move(destroy));
+	}
+
+	// Same for an owner (a Unique* handle, a vector of them, a unique_ptr, ...), which is left empty.
+	template <typename Owner>
+	void retire(Owner&& owner) {
+		deletionQueue.retire(submittedFrames, std::forward<Owner>(owner));
+	}
+
+	// Destroy queued objects whose frames have finished.
+	void runDeferredDestroys() {
+		deletionQueue.collect(completedFrames);
+	}
+
 	void createSurface() {
+		if (settings.offscreen) {
+			return;  // No window to present to.
+		}
 		// Super easy call to create surface.  No structures needed.
 		// Parameters are VkInstance created earlier, the window pointer created earlier by GLFW, 
 		// custom allocators, and pointer to assigned surface handle.
@@ -833,10 +3302,22 @@ private:
 	void createLogicalDevice() {
 		QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
 
+		// An upload has to reach every device of a group, but a semaphore is only ever signaled by one of them, so
+		// the transfer queue could not tell the graphics queue when all copies are done.  Upload on graphics instead.
+		if (groupDevices.size() > 1) {
+			indices.transferFamily.reset();
+		}
+
 		// Since we need more than one queue, use a set to store multiple queues.
 
 		std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 		std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(), indices.presentFamily.value() };
+		if (indices.transferFamily.has_value()) {
+			uniqueQueueFamilies.insert(indices.transferFamily.value());
+		}
+		if (indices.computeFamily.has_value()) {
+			uniqueQueueFamilies.insert(indices.computeFamily.value());
+		}
 
 		// Can specify a priority to queues from 0.0 to 1.0.  Setting a priority, even if only one queue, is required.
 		float queuePriority = 1.0f;
@@ -849,8 +3330,12 @@ private:
 			queueCreateInfos.push_back(queueCreateInfo);
 		}
 
-		// Specify device features we want.  Currently, we want nothing but will be updating in later sections.
+		// Specify device features we want.  The bindless heap, the GPU-driven path and sample shading ask for some (see below).
 		VkPhysicalDeviceFeatures deviceFeatures{};
+		chooseSampleCount();
+		if (sampleShadingEnabled) {
+			deviceFeatures.sampleRateShading = VK_TRUE;
+		}
 
 		// Fill in main logical device structure with information supplied so far.
 		VkDeviceCreateInfo createInfo{};
@@ -859,8 +3344,96 @@ private:
 		createInfo.pQueueCreateInfos = queueCreateInfos.data();
 
 		createInfo.pEnabledFeatures = &deviceFeatures;
-		createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());  // Enable extensions here.
-		createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+
+		// Features added after Vulkan 1.0 are switched on through structures chained to pNext.
+		VkPhysicalDeviceVulkan12Features vulkan12Features{};
+		vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+		vulkan12Features.timelineSemaphore = VK_TRUE;
+		BindlessHeap::enableFeatures(deviceFeatures, vulkan12Features);  // Checked by isDeviceSuitable.
+
+		// The profiler resets its queries from the CPU.  That is optional even in 1.2, so only ask for it when the
+		// GPU has it (and it is only worth asking for when profiling).
+		if (settings.gpuProfile) {
+			VkPhysicalDeviceVulkan12Features supported12Features{};
+			supported12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+			VkPhysicalDeviceFeatures2 supportedFeatures{};
+			supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+			supportedFeatures.pNext = &supported12Features;
+			vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures);
+			vulkan12Features.hostQueryReset = supported12Features.hostQueryReset;
+			hostQueryResetEnabled = supported12Features.hostQueryReset == VK_TRUE;
+		}
+		// The GPU-driven path draws with vkCmdDrawIndexedIndirectCount, more than one draw per call.  Without both
+		// features it falls back to recording every draw.
+		if (settings.gpuDriven) {
+			VkPhysicalDeviceVulkan12Features supported12Features{};
+			supported12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+			VkPhysicalDeviceFeatures2 supportedFeatures{};
+			supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+			supportedFeatures.pNext = &supported12Features;
+			vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures);
+			gpuDrivenEnabled = supported12Features.drawIndirectCount && supportedFeatures.features.multiDrawIndirect;
+			if (gpuDrivenEnabled) {
+				vulkan12Features.drawIndirectCount = VK_TRUE;
+				deviceFeatures.multiDrawIndirect = VK_TRUE;
+			}
+			else {
+				std::cerr << "gpu-driven rendering needs drawIndirectCount and multiDrawIndirect, which this GPU does not support" << std::endl;
+			}
+		}
+		createInfo.pNext = &vulkan12Features;
+
+		// The frame limiter needs both present extensions and their features.  Without them it falls back to timing.
+		std::vector<const char*> extensions = requiredDeviceExtensions();
+		VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures{};
+		presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+		VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures{};
+		presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+		if (settings.latencyLimitFrames > 0 && !settings.offscreen && checkDeviceExtensionSupport(physicalDevice, optionalDeviceExtensions)) {
+			presentIdFeatures.pNext = &presentWaitFeatures;
+			VkPhysicalDeviceFeatures2 supportedFeatures{};
+			supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+			supportedFeatures.pNext = &presentIdFeatures;
+			vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures);
+			presentWaitEnabled = presentIdFeatures.presentId && presentWaitFeatures.presentWait;
+		}
+		if (presentWaitEnabled) {
+			extensions.insert(extensions.end(), optionalDeviceExtensions.begin(), optionalDeviceExtensions.end());
+			presentWaitFeatures.pNext = nullptr;
+			vulkan12Features.pNext = &presentIdFeatures;
+		}
+
+		// Dynamic rendering falls back to the render pass when the extension or its feature is missing.
+		VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamicRenderingFeatures{};
+		dynamicRenderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+		if (settings.dynamicRendering && checkDeviceExtensionSupport(physicalDevice, dynamicRenderingExtensions)) {
+			VkPhysicalDeviceFeatures2 supportedFeatures{};
+			supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+			supportedFeatures.pNext = &dynamicRenderingFeatures;
+			vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures);
+			dynamicRenderingEnabled = dynamicRenderingFeatures.dynamicRendering;
+		}
+		if (dynamicRenderingEnabled) {
+			extensions.insert(extensions.end(), dynamicRenderingExtensions.begin(), dynamicRenderingExtensions.end());
+			dynamicRenderingFeatures.pNext = vulkan12Features.pNext;
+			vulkan12Features.pNext = &dynamicRenderingFeatures;
+		}
+		else if (settings.dynamicRendering) {
+			std::cerr << "dynamic rendering needs VK_KHR_dynamic_rendering, which this GPU does not support, using a render pass" << std::endl;
+		}
+		createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());  // Enable extensions here.
+		createInfo.ppEnabledExtensionNames = extensions.data();
+
+		// Span the whole device group, if one was picked.  Queues, memory and every other object are then shared by
+		// all of its GPUs.
+		VkDeviceGroupDeviceCreateInfo groupInfo{};
+		groupInfo.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_DEVICE_CREATE_INFO;
+		groupInfo.physicalDeviceCount = static_cast<uint32_t>(groupDevices.size());
+		groupInfo.pPhysicalDevices = groupDevices.data();
+		if (groupDevices.size() > 1) {
+			groupInfo.pNext = createInfo.pNext;
+			createInfo.pNext = &groupInfo;
+		}
 
 		if (enableValidationLayers) {
 			// Below two fields are no longer used in newer Vulkan releases.  However, they are set here in 
@@ -881,6 +3454,116 @@ private:
 		// parameters = logical device, queue family, queue index, and pointer to store the queue handle.
 		vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
 		vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+		if (indices.transferFamily.has_value()) {
+			vkGetDeviceQueue(device, indices.transferFamily.value(), 0, &transferQueue);
+		}
+		vkGetDeviceQueue(device, indices.computeFamily.value_or(indices.graphicsFamily.value()), 0, &computeQueue);
+		deviceQueueFamilies = indices;
+
+		if (presentWaitEnabled) {
+			pfnWaitForPresent = reinterpret_cast<PFN_vkWaitForPresentKHR>(vkGetDeviceProcAddr(device, "vkWaitForPresentKHR"));
+			presentWaitEnabled = pfnWaitForPresent != nullptr;
+		}
+		if (dynamicRenderingEnabled) {
+			pfnCmdBeginRendering = reinterpret_cast<PFN_vkCmdBeginRenderingKHR>(vkGetDeviceProcAddr(device, "vkCmdBeginRenderingKHR"));
+			pfnCmdEndRendering = reinterpret_cast<PFN_vkCmdEndRenderingKHR>(vkGetDeviceProcAddr(device, "vkCmdEndRenderingKHR"));
+			if (pfnCmdBeginRendering == nullptr || pfnCmdEndRendering == nullptr) {
+				throw std::runtime_error("failed to load the dynamic rendering functions!");
+			}
+		}
+		if (settings.latencyLimitFrames > 0) {
+			std::cout << "frame limiter: " << (presentWaitEnabled ? "present wait" : "timing fallback") << std::endl;
+		}
+
+		if (groupDevices.size() > 1) {
+			setUpDeviceGroupRendering();
+		}
+	}
+
+	// Decide which devices of the group take turns rendering.  A device can only render frames if its images can
+	// be presented, either by itself or by another device it is in the presentMask of, in a mode the surface
+	// supports.  If that does not hold for all of them, rendering stays on device 0.
+	void setUpDeviceGroupRendering() {
+		groupDeviceCount = static_cast<uint32_t>(groupDevices.size());
+		afrDeviceCount = groupDeviceCount;
+
+		if (!settings.offscreen) {
+			groupPresentCapabilities.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_PRESENT_CAPABILITIES_KHR;
+			if (vkGetDeviceGroupPresentCapabilitiesKHR(device, &groupPresentCapabilities) != VK_SUCCESS) {
+				throw std::runtime_error("failed to query device group present capabilities!");
+			}
+			// The device group may be able to do more than this surface can take.
+			VkDeviceGroupPresentModeFlagsKHR surfaceModes = 0;
+			if (vkGetDeviceGroupSurfacePresentModesKHR(device, surface, &surfaceModes) != VK_SUCCESS) {
+				throw std::runtime_error("failed to query device group surface present modes!");
+			}
+			groupPresentModeSupport = groupPresentCapabilities.modes & surfaceModes;
+			for (uint32_t i = 0; i < groupDeviceCount; i++) {
+				bool local = (groupPresentCapabilities.presentMask[i] & (1u << i)) &&
+					(groupPresentModeSupport & VK_DEVICE_GROUP_PRESENT_MODE_LOCAL_BIT_KHR);
+				bool remote = false;
+				for (uint32_t j = 0; j < groupDeviceCount; j++) {
+					remote = remote || (groupPresentCapabilities.presentMask[j] & (1u << i));
+				}
+				remote = remote && (groupPresentModeSupport & VK_DEVICE_GROUP_PRESENT_MODE_REMOTE_BIT_KHR);
+				if (!local && !remote && i == 0) {
+					throw std::runtime_error("failed to find a way to present images of device group device 0!");
+				}
+				if (!local && !remote) {
+					std::cerr << "device " << i << " of the group cannot present its images, rendering on device 0 only" << std::endl;
+					afrDeviceCount = 1;
+					groupPresentModes.resize(1);
+					break;
+				}
+				groupPresentModes.push_back(local ? VK_DEVICE_GROUP_PRESENT_MODE_LOCAL_BIT_KHR : VK_DEVICE_GROUP_PRESENT_MODE_REMOTE_BIT_KHR);
+			}
+		}
+
+		std::cout << "alternate frame rendering on " << afrDeviceCount << " of " << groupDeviceCount << " gpus" << std::endl;
+		if (settings.framesInFlight < afrDeviceCount) {
+			std::cerr << "only " << settings.framesInFlight << " frames in flight for " << afrDeviceCount
+				<< " gpus; some of them will sit idle (see --frames-in-flight)" << std::endl;
+		}
+	}
+
+	// The allocator lives next to the device it allocates from and is torn down right before it.
+	void createAllocator() {
+		allocator.init(physicalDevice, device);
+	}
+
+	// Timestamp queries are only valid on queues whose family reports timestampValidBits, so each region is
+	// registered with the bits of the queue it runs on.  Pipeline binds are not timed on their own: a timestamp
+	// pair around a state change measures nothing but the pipeline drain in between.
+	void createGpuProfiler() {
+		if (!settings.gpuProfile) {
+			return;
+		}
+		// Every device of a group writes its own instance of a query, and reading them back only sees one.
+		if (groupDeviceCount > 1) {
+			std::cerr << "gpu profiling is not supported with a device group" << std::endl;
+			return;
+		}
+		const uint32_t maxRegions = 5;
+		if (!gpuProfiler.init(physicalDevice, device, hostQueryResetEnabled, settings.framesInFlight, maxRegions,
+			GPU_PROFILE_REPORT_INTERVAL, settings.gpuProfileCsvPath)) {
+			std::cerr << "gpu profiling needs hostQueryReset, which this GPU does not support" << std::endl;
+			return;
+		}
+
+		uint32_t queueFamilyCount = 0;
+		vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+		std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+		vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+		uint32_t graphicsBits = queueFamilies[deviceQueueFamilies.graphicsFamily.value()].timestampValidBits;
+		uint32_t computeBits = queueFamilies[deviceQueueFamilies.computeFamily.value_or(deviceQueueFamilies.graphicsFamily.value())].timestampValidBits;
+		frameRegion = gpuProfiler.registerRegion("frame", graphicsBits);
+		renderPassRegion = gpuProfiler.registerRegion("render pass", graphicsBits);
+		drawsRegion = gpuProfiler.registerRegion("draws", graphicsBits);
+		computeRegion = gpuProfiler.registerRegion("compute", computeBits);
+		if (gpuDrivenEnabled) {
+			cullRegion = gpuProfiler.registerRegion("cull", computeBits);
+		}
 	}
 
 	// Resolution of swap chain images and it's almost exactly equal to the resolution of the window that
@@ -906,15 +3589,60 @@ private:
 		}
 	}
 
+	// Pick the present mode for settings.presentPolicy.  Each policy lists the modes it can live with, best first;
+	// FIFO always comes last since it is the one mode that is guaranteed to be there.
 	VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes) {
-		for (const auto& availablePresentMode : availablePresentModes) {
-			if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) { // Nice trade-off if energy use is not a concern.
-				return availablePresentMode;
+		std::vector<VkPresentModeKHR> preferred;
+		switch (settings.presentPolicy) {
+		case PresentPolicy::Uncapped:
+			preferred = { VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR };
+			break;
+		case PresentPolicy::LowLatency:
+			preferred = { VK_PRESENT_MODE_MAILBOX_KHR }; // Nice trade-off if energy use is not a concern.
+			break;
+		case PresentPolicy::VSync:
+			break;
+		case PresentPolicy::Adaptive:
+			preferred = { VK_PRESENT_MODE_FIFO_RELAXED_KHR };
+			break;
+		}
+		for (VkPresentModeKHR mode : preferred) {
+			if (std::find(availablePresentModes.begin(), availablePresentModes.end(), mode) != availablePresentModes.end()) {
+				return mode;
 			}
 		}
 		return VK_PRESENT_MODE_FIFO_KHR;
 	}
 
+	// The fewest images that let the chosen mode do its job:
+	// -- MAILBOX needs one image on screen, one waiting and one being rendered, or rendering blocks on the display.
+	// -- IMMEDIATE and FIFO_RELAXED get one more than the minimum so a frame can always be acquired right away.
+	// -- FIFO under VSync sticks to the minimum.  The application then waits for the display, which is the point.
+	uint32_t chooseSwapImageCount(VkPresentModeKHR presentMode, const VkSurfaceCapabilitiesKHR& capabilities) {
+		uint32_t imageCount = capabilities.minImageCount + 1;  // attempt 1 more than minimum for good performance
+		if (presentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
+			imageCount = std::max(capabilities.minImageCount, 3u);
+		}
+		else if (presentMode == VK_PRESENT_MODE_FIFO_KHR && settings.presentPolicy == PresentPolicy::VSync) {
+			imageCount = capabilities.minImageCount;
+		}
+		// Make sure not to exceed maximum....
+		if (capabilities.maxImageCount > 0 && imageCount > capabilities.maxImageCount) {
+			imageCount = capabilities.maxImageCount;
+		}
+		return imageCount;
+	}
+
+	static const char* presentModeName(VkPresentModeKHR presentMode) {
+		switch (presentMode) {
+		case VK_PRESENT_MODE_IMMEDIATE_KHR: return "IMMEDIATE";
+		case VK_PRESENT_MODE_MAILBOX_KHR: return "MAILBOX";
+		case VK_PRESENT_MODE_FIFO_KHR: return "FIFO";
+		case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+		default: return "other";
+		}
+	}
+
 	// Choose a format that suits our needs.
 	// The format indicates how the pixels are laid out and what size they are.
 	// We'll look for BGRA (blue green red alpha of 8 bits each and in that order): B8G8R8A8
@@ -953,6 +3681,12 @@ private:
 		return details;
 	}
 
+	// GPU selection
+	// -------------
+	// Laptops and servers often have more than one GPU, and the first one listed is frequently the integrated one.
+	// Every suitable GPU is scored instead and the best one wins, unless one is named explicitly through --gpu or
+	// the GPU_ENV_VAR environment variable, either by part of its name or by its UUID.  Every candidate and the
+	// final choice are logged, so it is always clear which GPU a run (or a benchmark result) came from.
 	void pickPhysicalDevice() {
 		uint32_t deviceCount = 0;
 		vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);  // typical query call to find number of devices 
@@ -964,16 +3698,167 @@ private:
 		std::vector<VkPhysicalDevice> devices(deviceCount);
 		vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data()); // get handles to all physical devices
 
+		std::string requested = settings.gpu;
+		if (requested.empty()) {
+			const char* environment = std::getenv(GPU_ENV_VAR);
+			requested = environment ? environment : "";
+		}
+
+		// UUIDs may be given with or without the usual dashes, in either case.
+		std::string requestedUUID = toLower(requested);
+		requestedUUID.erase(std::remove(requestedUUID.begin(), requestedUUID.end(), '-'), requestedUUID.end());
+
+		uint64_t bestScore = 0;
 		for (const auto& device : devices) {
-			if (isDeviceSuitable(device)) {
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(device, &properties);
+			std::string uuid = deviceUUID(device);
+			bool suitable = isDeviceSuitable(device);
+			uint64_t score = suitable ? rateDeviceSuitability(device) : 0;
+
+			std::cout << "gpu " << properties.deviceName << " (" << deviceTypeName(properties.deviceType) << ", uuid " << uuid << "): ";
+			if (suitable) {
+				std::cout << "score " << score << std::endl;
+			}
+			else {
+				std::cout << "not suitable" << std::endl;
+			}
+
+			if (!suitable) {
+				continue;
+			}
+			if (!requested.empty()) {
+				// An explicit choice beats any score; the first match wins.
+				bool matches = uuid == requestedUUID || std::string(properties.deviceName).find(requested) != std::string::npos;
+				if (matches && physicalDevice == VK_NULL_HANDLE) {
+					physicalDevice = device;
+				}
+			}
+			else if (physicalDevice == VK_NULL_HANDLE || score > bestScore) {
 				physicalDevice = device;
-				break;
+				bestScore = score;
 			}
 		}
 
 		if (physicalDevice == VK_NULL_HANDLE) {
+			if (!requested.empty()) {
+				throw std::runtime_error("failed to find a suitable GPU matching '" + requested + "'!");
+			}
 			throw std::runtime_error("failed to find a suitable GPU!");
 		}
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		std::cout << "using gpu " << properties.deviceName << (requested.empty() ? " (highest score)" : " (requested)") << std::endl;
+
+		if (settings.deviceGroup) {
+			pickDeviceGroup();
+		}
+	}
+
+	// Find the device group the chosen GPU belongs to.  Every GPU shows up in exactly one group, most of them in a
+	// group of their own, so only a group of two or more is of any use.  Devices in a group are the same model, so
+	// whatever made the chosen one suitable holds for the others too.
+	void pickDeviceGroup() {
+		uint32_t groupCount = 0;
+		vkEnumeratePhysicalDeviceGroups(instance, &groupCount, nullptr);
+		std::vector<VkPhysicalDeviceGroupProperties> groups(groupCount);
+		for (auto& group : groups) {
+			group.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GROUP_PROPERTIES;
+		}
+		vkEnumeratePhysicalDeviceGroups(instance, &groupCount, groups.data());
+
+		for (const auto& group : groups) {
+			const VkPhysicalDevice* first = group.physicalDevices;
+			const VkPhysicalDevice* last = group.physicalDevices + group.physicalDeviceCount;
+			if (group.physicalDeviceCount > 1 && std::find(first, last, physicalDevice) != last) {
+				groupDevices.assign(first, last);
+				std::cout << "using device group of " << groupDevices.size() << " gpus" << std::endl;
+				return;
+			}
+		}
+		std::cout << "the chosen gpu is not linked to any other, rendering on one gpu" << std::endl;
+	}
+
+	// Higher is better.  Only ever called for suitable devices.  The device type dominates: a discrete GPU has its
+	// own memory and far more bandwidth than anything sharing system memory.  Ties within a type are broken by how
+	// much device local memory there is, then by a few things this application can make use of.
+	uint64_t rateDeviceSuitability(VkPhysicalDevice device) {
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(device, &properties);
+
+		uint64_t score = 0;
+		switch (properties.deviceType) {
+		case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: score += 1000000; break;
+		case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score += 100000; break;
+		case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: score += 50000; break;
+		case VK_PHYSICAL_DEVICE_TYPE_CPU: score += 10000; break;
+		default: break;
+		}
+
+		// Largest device local heap, in MiB.
+		VkPhysicalDeviceMemoryProperties memoryProperties;
+		vkGetPhysicalDeviceMemoryProperties(device, &memoryProperties);
+		VkDeviceSize deviceLocal = 0;
+		for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++) {
+			if (memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+				deviceLocal = std::max(deviceLocal, memoryProperties.memoryHeaps[i].size);
+			}
+		}
+		score += deviceLocal / (1024 * 1024);
+
+		// Bigger limits usually mean a more capable GPU.
+		score += properties.limits.maxImageDimension2D / 16;
+
+		// Separate transfer and compute families let uploads and the compute pass run next to rendering.
+		QueueFamilyIndices indices = findQueueFamilies(device);
+		if (indices.transferFamily.has_value()) {
+			score += 1000;
+		}
+		if (indices.computeFamily.has_value()) {
+			score += 1000;
+		}
+
+		// The optional extensions are nice to have, never a reason to pick an otherwise weaker GPU.
+		for (const char* extension : optionalDeviceExtensions) {
+			if (checkDeviceExtensionSupport(device, { extension })) {
+				score += 500;
+			}
+		}
+		return score;
+	}
+
+	// The UUID identifies a GPU across runs and processes, unlike its index, which can change between boots.
+	std::string deviceUUID(VkPhysicalDevice device) {
+		VkPhysicalDeviceIDProperties idProperties{};
+		idProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+		VkPhysicalDeviceProperties2 properties{};
+		properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+		properties.pNext = &idProperties;
+		vkGetPhysicalDeviceProperties2(device, &properties);
+
+		static const char digits[] = "0123456789abcdef";
+		std::string uuid;
+		for (uint32_t i = 0; i < VK_UUID_SIZE; i++) {
+			uuid += digits[idProperties.deviceUUID[i] >> 4];
+			uuid += digits[idProperties.deviceUUID[i] & 0xf];
+		}
+		return uuid;
+	}
+
+	static std::string toLower(std::string text) {
+		std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		return text;
+	}
+
+	static const char* deviceTypeName(VkPhysicalDeviceType type) {
+		switch (type) {
+		case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return "discrete";
+		case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return "integrated";
+		case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return "virtual";
+		case VK_PHYSICAL_DEVICE_TYPE_CPU: return "cpu";
+		default: return "other";
+		}
 	}
 
 	// Modified to check if extensions are supported.  In this case it will look
@@ -984,25 +3869,54 @@ private:
 
 		bool extensionsSupported = checkDeviceExtensionSupport(device);
 
-		bool swapChainAdequate = false;
-		if (extensionsSupported) {
+		// Offscreen mode never presents, so there is no swap chain to be adequate for.
+		bool swapChainAdequate = settings.offscreen;
+		if (extensionsSupported && !settings.offscreen) {
 			SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
 			swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
 		}
 
-		return indices.isComplete() && extensionsSupported && swapChainAdequate;
+		// Timeline semaphores are core (and required) in Vulkan 1.2.  The descriptor indexing features the bindless
+		// heap needs are optional there, but every desktop driver has them.
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(device, &properties);
+		bool vulkan12Supported = properties.apiVersion >= VK_API_VERSION_1_2;
+		bool bindlessSupported = false;
+		if (vulkan12Supported) {
+			VkPhysicalDeviceVulkan12Features supported12Features{};
+			supported12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+			VkPhysicalDeviceFeatures2 supportedFeatures{};
+			supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+			supportedFeatures.pNext = &supported12Features;
+			vkGetPhysicalDeviceFeatures2(device, &supportedFeatures);
+			bindlessSupported = BindlessHeap::isSupported(supportedFeatures.features, supported12Features);
+		}
+
+		return indices.isComplete() && extensionsSupported && swapChainAdequate && vulkan12Supported && bindlessSupported;
+	}
+
+	// The swap chain extension is only needed when there is a window to present to.
+	std::vector<const char*> requiredDeviceExtensions() {
+		if (settings.offscreen) {
+			return {};
+		}
+		return deviceExtensions;
 	}
 
 	// Enumerate extensions and check if all required extensions are found.
 
 	bool checkDeviceExtensionSupport(VkPhysicalDevice device) {
+		return checkDeviceExtensionSupport(device, requiredDeviceExtensions());
+	}
+
+	bool checkDeviceExtensionSupport(VkPhysicalDevice device, const std::vector<const char*>& extensions) {
 		uint32_t extensionCount;
 		vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
 
 		std::vector<VkExtensionProperties> availableExtensions(extensionCount);
 		vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
 
-		std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+		std::set<std::string> requiredExtensions(extensions.begin(), extensions.end());
 
 		// Delete each required extension that was found.
 		// If requiredExtensions is fully empty then all extensions have been met.
@@ -1029,19 +3943,43 @@ private:
 		// should be preferred than having two different cards for each queue.  One card running
 		// the entire graphics program is more efficient.  However, it is possible to run different
 		// queues to different cards.
+		//
+		// All families are looked at rather than stopping at the first match.  A family that can both draw and
+		// present is preferred, since the swap chain images then never have to be shared between families.
+		//
+		// A family with TRANSFER but neither GRAPHICS nor COMPUTE is a dedicated copy engine (DMA).  Uploads
+		// issued there run alongside rendering instead of queuing up behind it on the graphics queue.  Likewise a
+		// COMPUTE family without GRAPHICS usually maps to separate hardware queues (async compute) that fill in
+		// ALUs left idle while the graphics queue is busy rasterizing.
 
 		int i = 0;
 		for (const auto& queueFamily : queueFamilies) {
-			if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+			bool graphicsSupport = (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+			VkBool32 presentSupport = false;
+			if (surface != VK_NULL_HANDLE) {
+				vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+			}
+			else {
+				presentSupport = graphicsSupport;  // Offscreen: nothing is presented, so the graphics family stands in.
+			}
+
+			if (graphicsSupport && presentSupport && !(indices.graphicsFamily.has_value() && indices.graphicsFamily == indices.presentFamily)) {
 				indices.graphicsFamily = i;
+				indices.presentFamily = i;
 			}
-			VkBool32 presentSupport = false;
-			vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
-			if (presentSupport) {
+			if (graphicsSupport && !indices.graphicsFamily.has_value()) {
+				indices.graphicsFamily = i;
+			}
+			if (presentSupport && !indices.presentFamily.has_value()) {
 				indices.presentFamily = i;
 			}
-			if (indices.isComplete()) {
-				break;
+
+			if ((queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamily.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) &&
+				!indices.transferFamily.has_value()) {
+				indices.transferFamily = i;
+			}
+			if ((queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT) && !graphicsSupport && !indices.computeFamily.has_value()) {
+				indices.computeFamily = i;
 			}
 			i++;
 		}
@@ -1101,7 +4039,7 @@ private:
 		appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
 		appInfo.pEngineName = "No Engine";
 		appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-		appInfo.apiVersion = VK_API_VERSION_1_0;
+		appInfo.apiVersion = VK_API_VERSION_1_2;  // Timeline semaphores are part of core Vulkan since 1.2.
 
 		VkInstanceCreateInfo createInfo{};  // Non-optional information which will specify global extensions and validation layers to use.
 		createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO; // Tell Vulkan type of struct, per usual...
@@ -1218,11 +4156,15 @@ private:
 	// macro and is used to avoid string typos.
 
 	std::vector<const char*> getRequiredExtensions() {
-		uint32_t glfwExtensionCount = 0;
-		const char** glfwExtensions;
-		glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-		std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+		std::vector<const char*> extensions;
+
+		// The surface extensions GLFW asks for are only needed when there is a window.
+		if (!settings.offscreen) {
+			uint32_t glfwExtensionCount = 0;
+			const char** glfwExtensions;
+			glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+			extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+		}
 
 		if (enableValidationLayers) {
 			extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -1278,37 +4220,122 @@ private:
 		return VK_FALSE;
 	}
 
-	// Helper function to load a shader.
-
-	static std::vector<char> readFile(const std::string& filename) {
-		// The ate option starts reading from the end of the file.
-		// It allows us to know how to allocate a byte vector for it.
-		// The input shader is bytecode and therefore is binary.
-		std::ifstream file(filename, std::ios::ate | std::ios::binary);
+	void mainLoop() {
+		uint64_t framesDrawn = 0;
+		bool measuring = false;
+		std::chrono::steady_clock::time_point measureStart;
+		// Offscreen runs have no window to close and always stop through the benchmark limits.
+		while (settings.offscreen || !glfwWindowShouldClose(window)) {
+			if (window) {
+				glfwPollEvents();
+			}
+			drawFrame();
 
-		if (!file.is_open()) {
-			throw std::runtime_error("failed to open file!");
+			if (!settings.benchmark()) {
+				continue;
+			}
+			// Throw away whatever the warm-up frames recorded and start the clock on the first measured one.
+			if (!measuring && ++framesDrawn >= settings.benchmarkWarmupFrames) {
+				frameStats.clear();
+				measureStart = std::chrono::steady_clock::now();
+				measuring = true;
+				continue;
+			}
+			double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - measureStart).count();
+			if (measuring && ((settings.benchmarkFrames > 0 && frameStats.frameCount() >= settings.benchmarkFrames) ||
+				(settings.benchmarkSeconds > 0.0 && elapsed >= settings.benchmarkSeconds))) {
+				break;
+			}
 		}
 
-		size_t fileSize = (size_t)file.tellg();
-		std::vector<char> buffer(fileSize);
-
-		file.seekg(0);
-		file.read(buffer.data(), fileSize);
+		// Do not close device while it is in use otherwise it will crash ungracefully.
+		vkDeviceWaitIdle(device);
 
-		file.close();
+		if (!readbackBuffers.empty()) {
+			writeReadbackImage();
+		}
+		if (measuring) {
+			writeBenchmarkSummary(std::chrono::duration<double>(std::chrono::steady_clock::now() - measureStart).count());
+		}
+	}
 
-		return buffer;
+	// The summary repeats the settings that change the workload so results from different runs can be compared.
+	void writeBenchmarkSummary(double seconds) {
+		std::ofstream file;
+		if (!settings.benchmarkJsonPath.empty()) {
+			file.open(settings.benchmarkJsonPath, std::ios::trunc);
+			if (!file.is_open()) {
+				throw std::runtime_error("failed to open benchmark output file!");
+			}
+		}
+		std::ostream& out = file.is_open() ? static_cast<std::ostream&>(file) : std::cout;
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+		out << "{\n";
+		out << "  \"gpu\": \"" << properties.deviceName << "\",\n";
+		out << "  \"frames_in_flight\": " << settings.framesInFlight << ",\n";
+		out << "  \"static_scene\": " << (settings.staticScene ? "true" : "false") << ",\n";
+		out << "  \"record_threads\": " << settings.recordThreads << ",\n";
+		out << "  \"draw_count\": " << settings.drawCount << ",\n";
+		out << "  \"msaa_samples\": " << msaaSamples << ",\n";
+		out << "  \"dynamic_rendering\": " << (dynamicRenderingEnabled ? "true" : "false") << ",\n";
+		out << "  \"pipelines_compiled_on_demand\": " << pipelineStates.stats().onDemand << ",\n";
+		out << "  \"offscreen\": " << (settings.offscreen ? "true" : "false") << ",\n";
+		out << "  \"present_policy\": \"" << presentPolicyName(settings.presentPolicy) << "\",\n";
+		out << "  \"frames\": " << frameStats.frameCount() << ",\n";
+		out << "  \"seconds\": " << seconds << ",\n";
+		out << "  \"fps\": " << (seconds > 0.0 ? frameStats.frameCount() / seconds : 0.0) << ",\n";
+		out << "  \"cpu\": ";
+		frameStats.writeJson(out, "  ");
+		out << "\n}" << std::endl;
 	}
 
-	void mainLoop() {
-		while (!glfwWindowShouldClose(window)) {
-			glfwPollEvents();
-			drawFrame();
+	// Frame limiter
+	// -------------
+	// Frames in flight let the CPU run ahead of the GPU, and the swap chain lets the GPU run ahead of the display.
+	// When the display is the bottleneck every queue in between fills up, and input read at the start of a frame
+	// only reaches the screen several refreshes later.  Holding the start of each frame back keeps those queues
+	// short:
+	// -- With present wait, wait until the frame latencyLimitFrames back is actually on screen.
+	// -- Without it, space frames out by the display refresh interval instead.
+	// On top of either, targetFrameRate caps how often a frame may start.
+	void limitFrameRate() {
+		if (settings.latencyLimitFrames == 0 && settings.targetFrameRate <= 0.0) {
+			return;
 		}
 
-		// Do not close device while it is in use otherwise it will crash ungracefully.
-		vkDeviceWaitIdle(device);
+		double interval = settings.targetFrameRate > 0.0 ? 1.0 / settings.targetFrameRate : 0.0;
+		if (settings.latencyLimitFrames > 0) {
+			const uint64_t waitFrame = submittedFrames + 1 > settings.latencyLimitFrames ? submittedFrames + 1 - settings.latencyLimitFrames : 0;
+			if (presentWaitEnabled) {
+				if (waitFrame >= firstPresentIdOfSwapChain) {
+					// The timeout keeps a present that never happens (window hidden, swap chain lost) from hanging us.
+					// Any result is fine here: the limiter only delays, it never fails the frame.
+					const uint64_t timeout = 100'000'000; // 100 ms
+					pfnWaitForPresent(device, swapChain, waitFrame, timeout);
+				}
+			}
+			else if (window) {
+				const GLFWvidmode* mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+				if (mode && mode->refreshRate > 0) {
+					interval = std::max(interval, 1.0 / mode->refreshRate);
+				}
+			}
+		}
+
+		// Sleeping is only accurate to a millisecond or so on most systems, so sleep most of the way and spin the rest.
+		if (interval > 0.0) {
+			auto deadline = lastFrameStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval));
+			auto now = std::chrono::steady_clock::now();
+			if (deadline - now > std::chrono::milliseconds(2)) {
+				std::this_thread::sleep_until(deadline - std::chrono::milliseconds(1));
+			}
+			while (std::chrono::steady_clock::now() < deadline) {
+			}
+		}
+		lastFrameStart = std::chrono::steady_clock::now();
 	}
 
 	void drawFrame() {
@@ -1326,54 +4353,168 @@ private:
 		// it must be explicitly stated.  To ensure one event finishes to a certain point before another can
 		// begin, semaphores are used.  The first event sends a 'signal' on its semaphore.  The receiving event
 		// does a 'wait' for this signal before it can start.
-		// Vulkan has binary and timeline semaphores.  For the tutorial only binary are used (aka, signal/wait).
-
-		// Fences (orders events on the CPU)
-		// ------
-	    // A fence has a similar purpose, in that it is used to synchronize execution, but it is for ordering 
-		// the execution on the CPU, otherwise known as the host.Simply put, if the host needs to know when the 
-		// GPU has finished something, we use a fence.
-		// 
-		// Similar to semaphores, fences are either in a signaled or unsignaled state. Whenever we submit work 
-		// to execute, we can attach a fence to that work.When the work is finished, the fence will be 
-		// signaled.Then we can make the host wait for the fence to be signaled, guaranteeing that the work has 
-		// finished before the host continues.
-
-		vkWaitForFences(device, 1, &inFlightFence, VK_TRUE, UINT64_MAX);
-
-		vkResetFences(device, 1, &inFlightFence);
+		// Vulkan has binary and timeline semaphores.  Binary ones are only used where the swap chain requires
+		// them (acquire and present); everything else is ordered by timeline semaphores.
+
+		// Waiting on the CPU (orders events on the host)
+		// ---------------------
+		// The tutorial uses a fence per frame for this, which has to be reset after every wait.  A timeline
+		// semaphore can be waited on from the CPU just as well: graphicsTimelines count finished frames, so waiting
+		// for frame N is waiting for its device's value to reach N, and nothing needs to be reset afterwards.
+
+		// Only wait for the frame that last used this frame's command buffer and semaphores.  With more than
+		// one frame in flight that frame was submitted a while ago, so the GPU is usually already done with it
+		// and the CPU does not stall here.
+		limitFrameRate();
+		if (settings.benchmark()) {
+			frameStats.beginFrame();
+		}
+		// Frames complete in submission order, so everything up to this slot's frame is done as well.
+		waitForFrame(frameNumbers[currentFrame]);
+		runDeferredDestroys();
+		releaseStagingRegions();
+		frameArena.begin(currentFrame);  // Nothing reads this slot's part of the arena any more either.
+		frameScratch.reset();  // Nor anything left over from building the last frame.
+		updateMarkers();
+		gpuProfiler.collect(currentFrame);  // This slot's queries are final now, so reading them cannot stall.
+		frameStats.mark(FramePhase::FenceWait);
+
+		// Nothing of this frame has been recorded yet, which makes this the place to swap in reloaded shaders and
+		// pick up streamed assets.
+		swapReloadedPipelines();
+		collectStreamedUploads();
+
+		// Grab the image we can draw on via the returned imageIndex.  Offscreen, every frame in flight simply owns
+		// the image with its own index.
+		// With a device group the image is acquired for the device that renders this frame.
+		const uint64_t frameNumber = submittedFrames + 1;
+		const uint32_t renderDevice = renderDeviceOf(frameNumber);
+		uint32_t imageIndex = currentFrame;
+		VkResult result = VK_SUCCESS;
+		if (!settings.offscreen && groupDeviceCount > 1) {
+			VkAcquireNextImageInfoKHR acquireInfo{};
+			acquireInfo.sType = VK_STRUCTURE_TYPE_ACQUIRE_NEXT_IMAGE_INFO_KHR;
+			acquireInfo.swapchain = swapChain;
+			acquireInfo.timeout = UINT64_MAX;
+			acquireInfo.semaphore = imageAvailableSemaphores[currentFrame];
+			acquireInfo.deviceMask = 1u << renderDevice;
+			result = vkAcquireNextImage2KHR(device, &acquireInfo, &imageIndex);
+		}
+		else if (!settings.offscreen) {
+			// Swap chain is an extension feature so KHR suffix is used.
+			result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+		}
+		frameStats.mark(FramePhase::Acquire);
+
+		// -- VK_ERROR_OUT_OF_DATE_KHR: The swap chain can no longer be used for rendering.  No image was acquired and the
+		//    semaphore will not be signaled, so recreate and try again next frame.  Nothing was submitted, so the same
+		//    frame number is simply used by the next attempt.
+		// -- VK_SUBOPTIMAL_KHR: The image was acquired and can still be presented, but the surface properties no longer
+		//    match exactly.  Finish this frame and recreate after presenting.
+		if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+			frameStats.discardFrame();
+			recreateSwapChain();
+			return;
+		}
+		else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+			throw std::runtime_error("failed to acquire swap chain image!");
+		}
 
-		// Grab the image we can draw on via the returned imageIndex.
-		uint32_t imageIndex;
-		// Swap chain is an extension feature so KHR suffix is used.
-		vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
-		
-		// Record the command buffer.
-		vkResetCommandBuffer(commandBuffer, 0);
-		recordCommandBuffer(commandBuffer, imageIndex);
+		// The swap chain does not have to hand out images in order, and it may have a different number of images
+		// than there are frames in flight.  If an older frame is still rendering to this image, wait for it too.
+		waitForFrame(imageFrames[imageIndex]);
+		imageFrames[imageIndex] = frameNumber;
+		frameStats.mark(FramePhase::FenceWait);
+
+		// Kick off the compute pass first so it can already run while this frame is being recorded.  Timeline values
+		// must only ever go up, which is why this happens after the acquire: an early return above would otherwise
+		// leave a value signaled that the next attempt at the same frame number would signal again.
+		submitComputePass(frameNumber);
+
+		// Record the command buffer, or in static scene mode pick the one recorded for this image.
+		VkCommandBuffer commandBuffer;
+		if (settings.staticScene) {
+			if (staticCommandBuffersDirty) {
+				recordStaticCommandBuffers();
+			}
+			commandBuffer = staticCommandBuffers[currentFrame * swapChainImages.size() + imageIndex];
+		}
+		else {
+			std::pmr::vector<VkCommandBuffer> secondaryBuffers(&frameScratch);
+			if (jobSystem) {
+				secondaryBuffers = recordSecondaryCommandBuffers(imageIndex);
+			}
+			commandBuffer = commandBuffers[currentFrame];
+			vkResetCommandBuffer(commandBuffer, 0);
+			recordCommandBuffer(commandBuffer, imageIndex, currentFrame, secondaryBuffers);
+		}
+		frameStats.mark(FramePhase::Record);
+
+		// Copies queued since the last frame go out in one upload submit.  The graphics side of it (the copies
+		// themselves, or the ownership acquire when a transfer queue did them) is the first batch of this frame's
+		// vkQueueSubmit.
+		std::pmr::vector<VkSubmitInfo> submitInfos(&frameScratch);
+		UploadSubmit uploadSubmit;
+		DeviceGroupSubmit uploadGroupSubmit(&frameScratch);
+		if (submitUploads(uploadCommandBuffers[currentFrame], acquireCommandBuffers[currentFrame], frameNumber, uploadSubmit)) {
+			submitInfos.push_back(uploadSubmit.submitInfo);
+			chainDeviceGroupSubmit(submitInfos.back(), uploadGroupSubmit, renderDevicesMask(), 0);
+		}
 
 		// Submit the command buffer.
 		VkSubmitInfo submitInfo{};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-		// Semaphore is signaled in GPU pipeline at color attachment stage.
-		VkSemaphore waitSemaphores[] = { imageAvailableSemaphore };
-		VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-		submitInfo.waitSemaphoreCount = 1;
-		submitInfo.pWaitSemaphores = waitSemaphores;
-		submitInfo.pWaitDstStageMask = waitStages;
-		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &commandBuffer;  // Submit the one command buffer we created.
+		// Semaphore is signaled in GPU pipeline at color attachment stage.  The compute pass output is first read by
+		// the indirect draw stage (commands and counts on the GPU-driven path, before the vertex shader reads the
+		// offsets), so the wait for it only has to hold back that stage and those after it.
+		VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[currentFrame], computeTimelines[renderDevice] };
+		VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT };
+		uint64_t waitValues[] = { 0, frameNumber }; // Ignored for the binary semaphore.
+
+		VkTimelineSemaphoreSubmitInfo timelineInfo{};
+		timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+		// Offscreen there is no acquire to wait for, only the compute pass.
+		const uint32_t firstWait = settings.offscreen ? 1 : 0;
+		timelineInfo.waitSemaphoreValueCount = 2 - firstWait;
+		timelineInfo.pWaitSemaphoreValues = waitValues + firstWait;
+		submitInfo.pNext = &timelineInfo;
 
 		// signalSemaphoreCount and pSignalSemaphores choose the semaphores to signal when the command
-		// buffer completes.
-		VkSemaphore signalSemaphores[] = { renderFinishedSemaphore };
-		submitInfo.signalSemaphoreCount = 1;
+		// buffer completes: the render device's graphicsTimelines entry with this frame's number, and the binary semaphore
+		// present waits for.  Nothing would wait for the latter offscreen, and a binary semaphore must not be signaled twice.
+		VkSemaphore signalSemaphores[] = { graphicsTimelines[renderDevice], renderFinishedSemaphores[currentFrame] };
+		uint64_t signalValues[] = { frameNumber, 0 }; // Ignored for the binary semaphore.
+		const uint32_t signalCount = settings.offscreen ? 1 : 2;
+		timelineInfo.signalSemaphoreValueCount = signalCount;
+		timelineInfo.pSignalSemaphoreValues = signalValues;
+
+		submitInfo.waitSemaphoreCount = 2 - firstWait;
+		submitInfo.pWaitSemaphores = waitSemaphores + firstWait;
+		submitInfo.pWaitDstStageMask = waitStages + firstWait;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &commandBuffer;  // Submit this frame's command buffer.
+		submitInfo.signalSemaphoreCount = signalCount;
 		submitInfo.pSignalSemaphores = signalSemaphores;
+		DeviceGroupSubmit renderGroupSubmit(&frameScratch);
+		chainDeviceGroupSubmit(submitInfo, renderGroupSubmit, 1u << renderDevice, renderDevice);
+		submitInfos.push_back(submitInfo);
 
-		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFence) != VK_SUCCESS) {
+		// A semaphore signal waits for everything submitted to the queue before it, so graphicsTimelines reaching
+		// frameNumber also covers the upload batch ahead of it (on the render device; see submitUploads for the others).
+		if (vkQueueSubmit(graphicsQueue, static_cast<uint32_t>(submitInfos.size()), submitInfos.data(), VK_NULL_HANDLE) != VK_SUCCESS) {
 			throw std::runtime_error("failed to submit draw command buffer!");
 		}
+		submittedFrames = frameNumber;
+		frameNumbers[currentFrame] = frameNumber;
+		frameStats.mark(FramePhase::Submit);
+
+		// Offscreen there is nothing to present; graphicsTimelines are all that is needed to reuse the frame.
+		if (settings.offscreen) {
+			frameStats.endFrame();
+			currentFrame = (currentFrame + 1) % settings.framesInFlight;
+			return;
+		}
 
 		// Presentation
 		// ------------
@@ -1385,7 +4526,7 @@ private:
 		presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 
 		presentInfo.waitSemaphoreCount = 1;
-		presentInfo.pWaitSemaphores = signalSemaphores;
+		presentInfo.pWaitSemaphores = &renderFinishedSemaphores[currentFrame];
 
 		VkSwapchainKHR swapChains[] = { swapChain };
 		presentInfo.swapchainCount = 1;
@@ -1393,41 +4534,132 @@ private:
 		presentInfo.pImageIndices = &imageIndex;
 		presentInfo.pResults = nullptr; // Optional
 
-		// Submit request to present the image (finally!).
-		// The vkQueuePresentKHR function submits the request to present an image to the swap chain. We'll add 
-		// error handling for both vkAcquireNextImageKHR and vkQueuePresentKHR in the next chapter, because their 
-		// failure does not necessarily mean that the program should terminate, unlike the functions we've seen so 
-		// far.
-		vkQueuePresentKHR(presentQueue, &presentInfo);
+		// Tag the present with the frame number so the frame limiter can wait for it to reach the display.
+		VkPresentIdKHR presentId{};
+		presentId.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+		presentId.swapchainCount = 1;
+		presentId.pPresentIds = &frameNumber;
+		if (presentWaitEnabled) {
+			presentInfo.pNext = &presentId;
+		}
+
+		// With a device group, say whose image this is.  A device that can present its own images does so (LOCAL);
+		// otherwise one that can reach it presents it (REMOTE).
+		const uint32_t renderDeviceMask = 1u << renderDevice;
+		VkDeviceGroupPresentInfoKHR groupPresentInfo{};
+		groupPresentInfo.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_PRESENT_INFO_KHR;
+		groupPresentInfo.swapchainCount = 1;
+		groupPresentInfo.pDeviceMasks = &renderDeviceMask;
+		if (groupDeviceCount > 1) {
+			groupPresentInfo.mode = groupPresentModes[renderDevice];
+			groupPresentInfo.pNext = presentInfo.pNext;
+			presentInfo.pNext = &groupPresentInfo;
+		}
 
+		// Submit request to present the image (finally!).
+		// The vkQueuePresentKHR function submits the request to present an image to the swap chain.  Out of date and
+		// suboptimal results are not fatal; they just mean the swap chain has to be recreated.
+		result = vkQueuePresentKHR(presentQueue, &presentInfo);
+		frameStats.mark(FramePhase::Present);
+		frameStats.endFrame();
+
+		// Move on to the next frame in flight.
+		currentFrame = (currentFrame + 1) % settings.framesInFlight;
+
+		if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized || presentPolicyChanged) {
+			framebufferResized = false;
+			presentPolicyChanged = false;
+			recreateSwapChain();
+		}
+		else if (result != VK_SUCCESS) {
+			throw std::runtime_error("failed to present swap chain image!");
+		}
 	}
 
 	void cleanup() {
-		vkDestroySemaphore(device, imageAvailableSemaphore, nullptr);
-		vkDestroySemaphore(device, renderFinishedSemaphore, nullptr);
-		vkDestroyFence(device, inFlightFence, nullptr);
+		// Wait for a pipeline rebuild in progress before anything it uses goes away.  Pipelines nobody took are
+		// simply dropped, along with the other states a graphics program rebuilt with them.
+		shaderManager.stop([this](VkPipeline pipeline) {
+			vkDestroyPipeline(device, pipeline, nullptr);
+		});
+		for (const ReloadedStates& reloaded : reloadedStates) {
+			for (size_t i = 1; i < reloaded.built.size(); i++) {
+				vkDestroyPipeline(device, reloaded.built[i].second, nullptr);
+			}
+		}
+		reloadedStates.clear();
+
+		// Streaming writes into the staging buffer, so it has to stop before the buffer goes away.
+		assetStreamer.reset();
+
+		// mainLoop waited for the device to go idle, so everything still queued is safe to destroy.
+		completedFrames = submittedFrames;
+		runDeferredDestroys();
+
+		for (uint32_t i = 0; i < settings.framesInFlight; i++) {
+			vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+			vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
+		}
+		if (transferTimeline != VK_NULL_HANDLE) {
+			vkDestroySemaphore(device, transferTimeline, nullptr);
+		}
+		for (uint32_t i = 0; i < afrDeviceCount; i++) {
+			vkDestroySemaphore(device, graphicsTimelines[i], nullptr);
+			vkDestroySemaphore(device, computeTimelines[i], nullptr);
+		}
 
+		// Destroying a command pool frees every command buffer allocated from it.
+		for (auto& frameContexts : threadContexts) {
+			for (auto& context : frameContexts) {
+				vkDestroyCommandPool(device, context.commandPool, nullptr);
+			}
+		}
+		jobSystem.reset();
 		vkDestroyCommandPool(device, commandPool, nullptr);
+		if (transferCommandPool != VK_NULL_HANDLE) {
+			vkDestroyCommandPool(device, transferCommandPool, nullptr);
+		}
+		vkDestroyCommandPool(device, computeCommandPool, nullptr);
 
-		// Destroy framebuffers.
-		for (auto framebuffer : swapChainFramebuffers) {
-			vkDestroyFramebuffer(device, framebuffer, nullptr);
+		// Report what the run ended up using while everything is still allocated.
+		allocator.printStats(std::cout);
+		for (auto& mesh : meshes) {
+			destroyMesh(mesh);
+		}
+		for (uint32_t i = 0; i < instanceOffsetBuffers.size(); i++) {
+			destroyBuffer(instanceOffsetBuffers[i], instanceOffsetBufferMemory[i]);
+		}
+		if (objectBuffer != VK_NULL_HANDLE) {
+			destroyBuffer(objectBuffer, objectBufferMemory);
+		}
+		destroyBuffer(frameArenaBuffer, frameArenaMemory);
+		for (uint32_t i = 0; i < indirectCommandBuffers.size(); i++) {
+			destroyBuffer(indirectCommandBuffers[i], indirectCommandBufferMemory[i]);
+			destroyBuffer(drawCountBuffers[i], drawCountBufferMemory[i]);
 		}
+		destroyBuffer(stagingBuffer, stagingBufferMemory);
 
+		// Destroy framebuffers, image views and the swap chain itself.
+		cleanupSwapChain();
 
-		// Destroy the pipeline.
-		vkDestroyPipeline(device, graphicsPipeline, nullptr);
-		vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+		// Destroy the pipeline.  The owning handles would do this on their own, but only after the device is gone.
+		pipelineStates.printStats(std::cout);
+		pipelineStates.destroy();
+		pipelineLayout.reset();
 
-		vkDestroyRenderPass(device, renderPass, nullptr);
+		computePipeline.reset();
+		cullPipeline.reset();
+		computePipelineLayout.reset();
+		bindlessHeap.destroy();
 
-		// Clean up the image views that were created for us.
-		for (auto imageView : swapChainImageViews) {
-			vkDestroyImageView(device, imageView, nullptr);
-		}
+		renderPass.reset();
 
-		// Clean the swap chain.
-		vkDestroySwapchainKHR(device, swapChain, nullptr);
+		// Persist the pipeline cache before the device that owns it goes away.
+		savePipelineCache();
+		vkDestroyPipelineCache(device, pipelineCache, nullptr);
+
+		gpuProfiler.destroy();
+		allocator.destroy();
 
 		// Logical devices must be cleaned up.
 		vkDestroyDevice(device, nullptr);
@@ -1440,16 +4672,205 @@ private:
 		vkDestroySurfaceKHR(instance, surface, nullptr);
 		vkDestroyInstance(instance, nullptr);
 
-		glfwDestroyWindow(window);
+		if (window) {
+			glfwDestroyWindow(window);
 
-		glfwTerminate();
+			glfwTerminate();
+		}
 	}
 };
 
-int main() {
-	HelloTriangleApplication app;
+void printUsage() {
+	std::cout << "usage: TutorialSolution [options]\n"
+		<< "  --frames-in-flight N      frames the CPU may run ahead of the GPU (1-" << MAX_FRAMES_IN_FLIGHT << ")\n"
+		<< "  --pipeline-cache PATH     pipeline cache file, empty to disable\n"
+		<< "  --static-scene            reuse pre-recorded command buffers\n"
+		<< "  --record-threads N        record draws on N worker threads\n"
+		<< "  --draw-count N            draws issued per frame\n"
+		<< "  --gpu-profile             report GPU timestamp timings\n"
+		<< "  --gpu-profile-csv PATH    write GPU timings to a CSV file instead of stdout\n"
+		<< "  --benchmark-frames N      benchmark mode: exit after N measured frames\n"
+		<< "  --benchmark-seconds S     benchmark mode: exit after S measured seconds\n"
+		<< "  --benchmark-warmup N      frames drawn before measuring starts (default 30)\n"
+		<< "  --benchmark-json PATH     write the benchmark summary to PATH instead of stdout\n"
+		<< "  --present-policy MODE     uncapped, low-latency (default), vsync or adaptive\n"
+		<< "  --latency-limit N         wait for the present N frames back before starting a frame\n"
+		<< "  --target-fps F            never start frames faster than F per second\n"
+		<< "  --gpu NAME|UUID           use the GPU whose name contains NAME or whose UUID matches (or set " << GPU_ENV_VAR << ")\n"
+		<< "  --offscreen               render without a window (needs --benchmark-frames or --benchmark-seconds)\n"
+		<< "  --readback PATH           offscreen: copy frames back and write the last one to PATH as PPM\n"
+		<< "  --device-group            alternate frames between the GPUs linked to the chosen one\n"
+		<< "  --hot-reload              recompile and swap in shaders as they are edited\n"
+		<< "  --msaa N                  anti-alias with N samples per pixel (2, 4 or 8)\n"
+		<< "  --sample-shading          with --msaa, shade every sample instead of every pixel\n"
+		<< "  --dynamic-rendering       render without a render pass or framebuffers (VK_KHR_dynamic_rendering)\n"
+		<< "  --markers N               draw N instanced markers with a single draw\n"
+		<< "  --gpu-driven              cull on the GPU and draw each mesh with one indirect draw\n"
+		<< "  --assets PATH             load shaders and meshes from an asset archive\n"
+		<< "  --pack-assets PATH        write the shaders and the scene to an asset archive and exit\n";
+}
+
+// Write the loose shader files and the built-in scene into one archive for --assets.  Shaders are stored as they
+// are, since they are small and can then be handed to the driver straight from the mapping; meshes are compressed.
+void packAssets(const std::string& path) {
+	AssetArchiveWriter writer;
+	for (const char* shader : { "vert.spv", "frag.spv", "marker_vert.spv", "draw_layout.spv", "cull_draws.spv" }) {
+		MappedFile file(shader);
+		writer.add(shader, file.data(), file.size(), false);
+	}
+	writer.add("triangle.vertices", TRIANGLE_VERTICES.data(), sizeof(Vertex) * TRIANGLE_VERTICES.size());
+	writer.add("triangle.indices", TRIANGLE_INDICES.data(), sizeof(uint32_t) * TRIANGLE_INDICES.size());
+	float bounds = 0.0f;
+	for (const auto& vertex : TRIANGLE_VERTICES) {
+		bounds = std::max(bounds, glm::length(vertex.pos));
+	}
+	writer.add("triangle.bounds", &bounds, sizeof(bounds), false);
+	writer.write(path);
+	std::cout << "wrote " << path << std::endl;
+}
+
+// Turn the command line into AppSettings.  Anything not recognized is an error rather than silently ignored, so a
+// typo in a benchmark script does not produce numbers for the wrong configuration.  Returns false after --help and
+// --pack-assets, which have nothing left to run.
+bool parseCommandLine(int argc, char* argv[], AppSettings& settings) {
+	for (int i = 1; i < argc; i++) {
+		const std::string option = argv[i];
+		auto value = [&]() -> std::string {
+			if (i + 1 >= argc) {
+				throw std::runtime_error("missing value for " + option + "!");
+			}
+			return argv[++i];
+		};
+		auto number = [&]() -> double {
+			std::string text = value();
+			try {
+				size_t used = 0;
+				double parsed = std::stod(text, &used);
+				if (used == text.size() && parsed >= 0.0) {
+					return parsed;
+				}
+			}
+			catch (const std::exception&) {
+			}
+			throw std::runtime_error("invalid value '" + text + "' for " + option + "!");
+		};
+
+		if (option == "--help" || option == "-h") {
+			printUsage();
+			return false;
+		}
+		else if (option == "--frames-in-flight") {
+			settings.framesInFlight = static_cast<uint32_t>(number());
+		}
+		else if (option == "--pipeline-cache") {
+			settings.pipelineCachePath = value();
+		}
+		else if (option == "--static-scene") {
+			settings.staticScene = true;
+		}
+		else if (option == "--record-threads") {
+			settings.recordThreads = static_cast<uint32_t>(number());
+		}
+		else if (option == "--draw-count") {
+			settings.drawCount = std::max(static_cast<uint32_t>(number()), 1u);
+		}
+		else if (option == "--gpu-profile") {
+			settings.gpuProfile = true;
+		}
+		else if (option == "--gpu-profile-csv") {
+			settings.gpuProfile = true;
+			settings.gpuProfileCsvPath = value();
+		}
+		else if (option == "--benchmark-frames") {
+			settings.benchmarkFrames = static_cast<uint32_t>(number());
+		}
+		else if (option == "--benchmark-seconds") {
+			settings.benchmarkSeconds = number();
+		}
+		else if (option == "--benchmark-warmup") {
+			settings.benchmarkWarmupFrames = static_cast<uint32_t>(number());
+		}
+		else if (option == "--benchmark-json") {
+			settings.benchmarkJsonPath = value();
+		}
+		else if (option == "--present-policy") {
+			std::string name = value();
+			bool found = false;
+			for (PresentPolicy policy : { PresentPolicy::Uncapped, PresentPolicy::LowLatency, PresentPolicy::VSync, PresentPolicy::Adaptive }) {
+				if (name == presentPolicyName(policy)) {
+					settings.presentPolicy = policy;
+					found = true;
+				}
+			}
+			if (!found) {
+				throw std::runtime_error("invalid value '" + name + "' for " + option + "!");
+			}
+		}
+		else if (option == "--latency-limit") {
+			settings.latencyLimitFrames = static_cast<uint32_t>(number());
+		}
+		else if (option == "--target-fps") {
+			settings.targetFrameRate = number();
+		}
+		else if (option == "--gpu") {
+			settings.gpu = value();
+		}
+		else if (option == "--offscreen") {
+			settings.offscreen = true;
+		}
+		else if (option == "--readback") {
+			settings.readbackPath = value();
+		}
+		else if (option == "--device-group") {
+			settings.deviceGroup = true;
+		}
+		else if (option == "--hot-reload") {
+			settings.shaderHotReload = true;
+		}
+		else if (option == "--msaa") {
+			settings.msaaSamples = std::max(static_cast<uint32_t>(number()), 1u);
+		}
+		else if (option == "--sample-shading") {
+			settings.sampleShading = true;
+		}
+		else if (option == "--dynamic-rendering") {
+			settings.dynamicRendering = true;
+		}
+		else if (option == "--markers") {
+			settings.markerCount = static_cast<uint32_t>(number());
+		}
+		else if (option == "--gpu-driven") {
+			settings.gpuDriven = true;
+		}
+		else if (option == "--assets") {
+			settings.assetArchivePath = value();
+		}
+		else if (option == "--pack-assets") {
+			packAssets(value());
+			return false;
+		}
+		else {
+			throw std::runtime_error("unknown option " + option + "!");
+		}
+	}
+
+	// Without a window the benchmark limits are the only way the main loop ends.
+	if (settings.offscreen && !settings.benchmark()) {
+		throw std::runtime_error("--offscreen needs --benchmark-frames or --benchmark-seconds!");
+	}
+	if (!settings.offscreen && !settings.readbackPath.empty()) {
+		throw std::runtime_error("--readback is only supported with --offscreen!");
+	}
+	return true;
+}
 
+int main(int argc, char* argv[]) {
 	try {
+		AppSettings settings;
+		if (!parseCommandLine(argc, argv, settings)) {
+			return EXIT_SUCCESS;
+		}
+		HelloTriangleApplication app(settings);
 		app.run();
 	}
 	catch (const std::exception& e) {
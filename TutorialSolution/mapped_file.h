@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapped file.
+//
+// Reading a file the usual way copies it twice before the driver even sees it: once from the page cache into the
+// stream's buffer and once more into a std::vector.  Mapping it lets the data be read straight out of the page
+// cache, so vkCreateShaderModule or a staging upload can take the file contents as they are, and pages the
+// application never touches are never read from disk at all.
+//
+// Mappings start on a page boundary, which makes words() safe to hand to VkShaderModuleCreateInfo::pCode; a plain
+// char buffer only happens to be aligned well enough.
+//
+// The file must not be truncated while it is mapped (on POSIX systems touching the missing pages raises SIGBUS),
+// so only map files nothing else writes to while they are in use.
+class MappedFile {
+public:
+	MappedFile() = default;
+
+	// Throws if the file cannot be opened or mapped.  An empty file maps to an empty view.
+	explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error("failed to open " + path + "!");
+		}
+		LARGE_INTEGER fileSize{};
+		if (!GetFileSizeEx(file, &fileSize)) {
+			close();
+			throw std::runtime_error("failed to open " + path + "!");
+		}
+		length = static_cast<size_t>(fileSize.QuadPart);
+		if (length > 0) {
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+			if (view == nullptr) {
+				close();
+				throw std::runtime_error("failed to map " + path + "!");
+			}
+			bytes = static_cast<const uint8_t*>(view);
+		}
+#else
+		int descriptor = ::open(path.c_str(), O_RDONLY);
+		if (descriptor < 0) {
+			throw std::runtime_error("failed to open " + path + "!");
+		}
+		struct stat status {};
+		if (fstat(descriptor, &status) != 0) {
+			::close(descriptor);
+			throw std::runtime_error("failed to open " + path + "!");
+		}
+		length = static_cast<size_t>(status.st_size);
+		if (length > 0) {
+			void* view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+			if (view == MAP_FAILED) {
+				::close(descriptor);
+				throw std::runtime_error("failed to map " + path + "!");
+			}
+			bytes = static_cast<const uint8_t*>(view);
+		}
+		// The mapping keeps the file contents reachable on its own.
+		::close(descriptor);
+#endif
+	}
+
+	~MappedFile() {
+		close();
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	MappedFile(MappedFile&& other) noexcept {
+		*this = std::move(other);
+	}
+
+	MappedFile& operator=(MappedFile&& other) noexcept {
+		if (this != &other) {
+			close();
+			std::swap(bytes, other.bytes);
+			std::swap(length, other.length);
+#ifdef _WIN32
+			std::swap(file, other.file);
+			std::swap(mapping, other.mapping);
+#endif
+		}
+		return *this;
+	}
+
+	const uint8_t* data() const {
+		return bytes;
+	}
+
+	size_t size() const {
+		return length;
+	}
+
+	bool empty() const {
+		return length == 0;
+	}
+
+	// The contents as 32-bit words, as SPIR-V wants them.  size() is still in bytes.
+	const uint32_t* words() const {
+		return reinterpret_cast<const uint32_t*>(bytes);
+	}
+
+private:
+	const uint8_t* bytes = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+
+	void close() {
+#ifdef _WIN32
+		if (bytes != nullptr) {
+			UnmapViewOfFile(bytes);
+		}
+		if (mapping != nullptr) {
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+		file = INVALID_HANDLE_VALUE;
+		mapping = nullptr;
+#else
+		if (bytes != nullptr) {
+			munmap(const_cast<uint8_t*>(bytes), length);
+		}
+#endif
+		bytes = nullptr;
+		length = 0;
+	}
+};
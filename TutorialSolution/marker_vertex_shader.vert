@@ -0,0 +1,18 @@
+#version 450
+#extension GL_KHR_vulkan_glsl : enable
+
+// Instanced markers.  The mesh comes in per vertex as usual; everything else steps once per instance, one
+// attribute per vertex binding (see MarkerInstances in main.cpp).
+layout(location = 0) in vec2 inPosition;
+layout(location = 1) in vec3 inColor;
+layout(location = 2) in float inInstanceX;
+layout(location = 3) in float inInstanceY;
+layout(location = 4) in float inInstanceScale;
+layout(location = 5) in vec4 inInstanceColor;
+
+layout(location = 0) out vec3 fragColor;
+
+void main() {
+	gl_Position = vec4(inPosition * inInstanceScale + vec2(inInstanceX, inInstanceY), 0.0, 1.0);
+	fragColor = inColor * inInstanceColor.rgb;
+}
\ No newline at end of file
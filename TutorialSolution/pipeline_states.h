@@ -0,0 +1,309 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "job_system.h"
+#include "vulkan_handle.h"
+
+// Pipeline permutations.
+//
+// A graphics pipeline is fully determined by its shaders and a handful of fixed-function settings.  Describing
+// those as one plain struct gives every permutation a key: draw code asks for the pipeline of a description, and
+// it is compiled the first time anybody asks for it and looked up every time after that.  Compiling is what
+// causes hitches, so descriptions known at load time are compiled up front (prewarm), spread over the job
+// system's threads.  Either way the driver sees the shared VkPipelineCache through the build function, so a
+// permutation compiled in an earlier run is cheap even the first time.
+//
+// Shaders are part of the key by the hash of their SPIR-V, so the same file loaded twice is the same shader and
+// an edited one is a different one.  addShader keeps a copy of the code for the build function, shared by every
+// cached pipeline that uses it: once the last of those is removed (the old pipelines of a hot reload), the copy
+// goes with it.
+
+// Keep this free of padding: descriptions are hashed and compared as raw bytes.
+struct PipelineStateDesc {
+	uint64_t vertexShader = 0;   // PipelineStateCache::addShader hashes.
+	uint64_t fragmentShader = 0;
+	VkRenderPass renderPass = VK_NULL_HANDLE; // What the pipeline has to be compatible with.  VK_NULL_HANDLE with dynamic rendering.
+	uint32_t subpass = 0;
+	uint32_t vertexLayout = 0; // Which vertex input layout; only the build function knows what the numbers mean.
+	VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL;
+	VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+	VkFrontFace frontFace = VK_FRONT_FACE_CLOCKWISE;
+	VkBool32 depthTest = VK_FALSE;
+	VkBool32 depthWrite = VK_FALSE;
+	VkCompareOp depthCompare = VK_COMPARE_OP_LESS_OR_EQUAL;
+	VkBool32 blendEnable = VK_FALSE;
+	VkBlendFactor srcBlendFactor = VK_BLEND_FACTOR_ONE; // Color and alpha alike; the blend op is always ADD.
+	VkBlendFactor dstBlendFactor = VK_BLEND_FACTOR_ZERO;
+	VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+	VkBool32 sampleShading = VK_FALSE;
+	VkFormat colorFormat = VK_FORMAT_UNDEFINED;
+	VkFormat depthFormat = VK_FORMAT_UNDEFINED; // VK_FORMAT_UNDEFINED: no depth attachment.
+
+	bool operator==(const PipelineStateDesc& other) const {
+		return std::memcmp(this, &other, sizeof(PipelineStateDesc)) == 0;
+	}
+};
+
+static_assert(std::has_unique_object_representations_v<PipelineStateDesc>, "PipelineStateDesc must not have padding");
+
+class PipelineStateCache {
+public:
+	using BuildFunction = std::function<VkPipeline(const PipelineStateDesc& state)>;
+
+	struct Stats {
+		uint32_t pipelines = 0;
+		uint32_t prewarmed = 0; // Compiled by prewarm.
+		uint32_t onDemand = 0;  // Compiled by get, i.e. by whoever needed it first.  Each of these may have been a hitch.
+		uint64_t lookups = 0;
+	};
+
+	PipelineStateCache() = default;
+	PipelineStateCache(const PipelineStateCache&) = delete;
+	PipelineStateCache& operator=(const PipelineStateCache&) = delete;
+
+	// build may be called from any thread, several at a time.  It returns a pipeline or throws.
+	void init(VkDevice owner, BuildFunction build) {
+		device = owner;
+		buildPipeline = std::move(build);
+	}
+
+	// FNV-1a.  Not cryptographic, but SPIR-V files that differ and still collide are not something to plan for.
+	static uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for (size_t i = 0; i < size; i++) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+	using ShaderCode = std::shared_ptr<const std::vector<uint32_t>>;
+
+	// A registered shader.  The cache only remembers code somebody still holds, so keep this until the pipelines
+	// using the shader have been asked for (get, prewarm or insert); from then on they hold it.
+	struct Shader {
+		uint64_t hash = 0; // What stands for the shader in descriptions.
+		ShaderCode code;
+	};
+
+	// Register SPIR-V.  Thread safe.
+	Shader addShader(const uint32_t* code, size_t codeSize) {
+		uint64_t hash = hashBytes(code, codeSize);
+		std::lock_guard<std::mutex> lock(shaderMutex);
+		for (auto it = shaders.begin(); it != shaders.end();) {
+			it = it->second.expired() ? shaders.erase(it) : std::next(it);
+		}
+		ShaderCode shared = shaders[hash].lock();
+		if (!shared) {
+			shared = std::make_shared<const std::vector<uint32_t>>(code, code + codeSize / sizeof(uint32_t));
+			shaders[hash] = shared;
+		}
+		return { hash, shared };
+	}
+
+	// The code of a registered shader.  Shared, so it stays valid while a build uses it.
+	ShaderCode shader(uint64_t hash) const {
+		std::lock_guard<std::mutex> lock(shaderMutex);
+		auto found = shaders.find(hash);
+		ShaderCode shared = found != shaders.end() ? found->second.lock() : nullptr;
+		if (!shared) {
+			throw std::runtime_error("failed to find shader of pipeline state!");
+		}
+		return shared;
+	}
+
+	// The pipeline for state, compiled now if nobody has asked for it before.  Thread safe.  A thread that asks for
+	// a pipeline another thread is still compiling waits for that compile instead of starting its own.
+	VkPipeline get(const PipelineStateDesc& state) {
+		return find(state, false);
+	}
+
+	// Compile every state not compiled yet, on the job system's threads if there is one.  Blocks until done.
+	void prewarm(const std::vector<PipelineStateDesc>& states, JobSystem* jobs) {
+		if (jobs != nullptr) {
+			jobs->parallelFor(static_cast<uint32_t>(states.size()), [&](uint32_t index, uint32_t) {
+				find(states[index], true);
+			});
+			return;
+		}
+		for (const auto& state : states) {
+			find(state, true);
+		}
+	}
+
+	// Adopt a pipeline built elsewhere (a hot reload, say).  If state already has one, that one is kept and
+	// pipeline is destroyed; it was never used, so that is safe.
+	void insert(const PipelineStateDesc& state, UniquePipeline pipeline) {
+		Shard& shard = shardOf(state);
+		Entry entry = makeEntry(state);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (shard.entries.count(state) != 0) {
+			return;
+		}
+		std::promise<VkPipeline> built;
+		built.set_value(pipeline);
+		entry.pipeline = built.get_future().share();
+		shard.entries.emplace(state, std::move(entry));
+		shard.owned.push_back(std::move(pipeline));
+		pipelineCount++;
+	}
+
+	// Take state's pipeline out of the cache and hand it over, since frames in flight may still use it.  Empty if
+	// there is none.  Not while another thread may still be compiling state.
+	UniquePipeline remove(const PipelineStateDesc& state) {
+		Shard& shard = shardOf(state);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto found = shard.entries.find(state);
+		if (found == shard.entries.end()) {
+			return {};
+		}
+		VkPipeline handle = found->second.pipeline.get();
+		shard.entries.erase(found);
+		for (auto it = shard.owned.begin(); it != shard.owned.end(); ++it) {
+			if (it->get() == handle) {
+				UniquePipeline removed = std::move(*it);
+				shard.owned.erase(it);
+				pipelineCount--;
+				return removed;
+			}
+		}
+		return {};
+	}
+
+	// Empty the cache and hand over its pipelines, which frames in flight may still use.  Not while other
+	// threads use the cache.
+	std::vector<UniquePipeline> release() {
+		std::vector<UniquePipeline> pipelines;
+		for (Shard& shard : shards) {
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			for (auto& pipeline : shard.owned) {
+				pipelines.push_back(std::move(pipeline));
+			}
+			shard.owned.clear();
+			shard.entries.clear();
+		}
+		pipelineCount = 0;
+		return pipelines;
+	}
+
+	// Destroy everything.  Only once no submitted work uses any of it.
+	void destroy() {
+		release();
+		std::lock_guard<std::mutex> lock(shaderMutex);
+		shaders.clear();
+	}
+
+	Stats stats() const {
+		return { pipelineCount.load(), prewarmedCount.load(), onDemandCount.load(), lookupCount.load() };
+	}
+
+	void printStats(std::ostream& out) const {
+		Stats statistics = stats();
+		out << "pipeline states: " << statistics.pipelines << " cached, " << statistics.prewarmed << " prewarmed, "
+			<< statistics.onDemand << " compiled on demand, " << statistics.lookups << " lookups" << std::endl;
+	}
+
+private:
+	struct DescHash {
+		size_t operator()(const PipelineStateDesc& state) const {
+			return static_cast<size_t>(hashBytes(&state, sizeof(PipelineStateDesc)));
+		}
+	};
+
+	// The map is split into shards, each with its own lock, so threads looking up different pipelines rarely
+	// wait for each other.  Locks are only held for the lookup, never for a compile.
+	struct Entry {
+		std::shared_future<VkPipeline> pipeline;
+		ShaderCode vertexShader;  // Keeps the code registered for as long as the entry is cached.
+		ShaderCode fragmentShader;
+	};
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<PipelineStateDesc, Entry, DescHash> entries;
+		std::vector<UniquePipeline> owned;
+	};
+	static constexpr size_t SHARD_COUNT = 16;
+
+	VkDevice device = VK_NULL_HANDLE;
+	BuildFunction buildPipeline;
+	Shard shards[SHARD_COUNT];
+	mutable std::mutex shaderMutex;
+	std::unordered_map<uint64_t, std::weak_ptr<const std::vector<uint32_t>>> shaders;
+	std::atomic<uint32_t> pipelineCount{ 0 };
+	std::atomic<uint32_t> prewarmedCount{ 0 };
+	std::atomic<uint32_t> onDemandCount{ 0 };
+	std::atomic<uint64_t> lookupCount{ 0 };
+
+	Shard& shardOf(const PipelineStateDesc& state) {
+		return shards[DescHash()(state) % SHARD_COUNT];
+	}
+
+	Entry makeEntry(const PipelineStateDesc& state) const {
+		Entry entry;
+		entry.vertexShader = shader(state.vertexShader);
+		entry.fragmentShader = shader(state.fragmentShader);
+		return entry;
+	}
+
+	VkPipeline find(const PipelineStateDesc& state, bool prewarming) {
+		if (!prewarming) {
+			lookupCount.fetch_add(1, std::memory_order_relaxed);
+		}
+		Shard& shard = shardOf(state);
+		std::promise<VkPipeline> built;
+		std::shared_future<VkPipeline> existing;
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto found = shard.entries.find(state);
+			if (found != shard.entries.end()) {
+				existing = found->second.pipeline;
+			}
+			else {
+				Entry entry = makeEntry(state);
+				entry.pipeline = built.get_future().share();
+				shard.entries.emplace(state, std::move(entry));
+			}
+		}
+		if (existing.valid()) {
+			return existing.get();  // Waits if another thread is still compiling it.
+		}
+
+		// This thread compiles it.  If that fails, the entry goes again so that a later call can retry, and every
+		// thread waiting for it gets the error.
+		UniquePipeline pipeline;
+		try {
+			pipeline = UniquePipeline(device, buildPipeline(state));
+		}
+		catch (...) {
+			{
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				shard.entries.erase(state);
+			}
+			built.set_exception(std::current_exception());
+			throw;
+		}
+		VkPipeline handle = pipeline;
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.owned.push_back(std::move(pipeline));
+		}
+		built.set_value(handle);
+		pipelineCount.fetch_add(1, std::memory_order_relaxed);
+		(prewarming ? prewarmedCount : onDemandCount).fetch_add(1, std::memory_order_relaxed);
+		return handle;
+	}
+};
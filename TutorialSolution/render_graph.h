@@ -0,0 +1,629 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "gpu_allocator.h"
+
+// Render graph.
+//
+// Every pass of a frame says which images and buffers it reads and writes, and how (as a color attachment, as a
+// copy source, ...).  Compiling the graph then works out everything that is tedious and easy to get wrong by
+// hand:
+// -- The pipeline barriers between passes.  A barrier is only placed where a hazard actually exists (a read after
+//    a write, a write after a read or write, or a layout change), with exactly the stages and accesses involved,
+//    and all barriers in front of a pass go out in one vkCmdPipelineBarrier.
+// -- Layout transitions, including those into and out of the graph for imported resources such as the swap chain
+//    image.  Render passes used inside the graph keep their attachments in the layout the graph put them in.
+// -- Passes whose results nothing uses are dropped.  A pass is kept if it writes an imported resource (which
+//    lives on after the frame) or is marked as having side effects, or if a kept pass reads what it writes.
+// -- Images that only live within the frame (transient images) are created by the graph.  Transient images whose
+//    lifetimes do not overlap share memory, and attachments that are never read outside of a render pass are
+//    created as transient attachments in lazily allocated memory where the device has it: on tile-based GPUs they
+//    then never get any memory of their own.
+//
+// Passes run in the order they were added; the graph does not reorder them.  Compile once, then execute every
+// frame.  Imported resources may be swapped for others of the same kind between executes (the swap chain image
+// changes every frame), which leaves the compiled barriers valid.
+class RenderGraph {
+	struct Pass;
+
+public:
+	using ResourceId = uint32_t;
+	using PassId = uint32_t;
+	using ExecuteFunction = std::function<void(VkCommandBuffer commandBuffer)>;
+
+	// Where an imported resource stands before the graph's first pass, or has to be after its last.
+	struct ResourceState {
+		VkImageLayout layout;       // Ignored for buffers.
+		VkPipelineStageFlags stages;
+		VkAccessFlags access;
+	};
+
+	struct TransientImageInfo {
+		VkFormat format;
+		VkExtent2D extent;
+		VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+		VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+	};
+
+	struct Stats {
+		uint32_t passes = 0;         // Kept passes.
+		uint32_t culledPasses = 0;
+		uint32_t barriers = 0;       // vkCmdPipelineBarrier calls per execute.
+		uint32_t transientImages = 0;
+		VkDeviceSize transientBytes = 0;  // Sum of the transient images' sizes,
+		VkDeviceSize allocatedBytes = 0;  // and what they take up with aliasing.
+	};
+
+	// Declares the resources a pass uses.  Handed to the setup function of addPass.
+	class PassBuilder {
+	public:
+		// Rendered to.  load says whether the render pass loads the old contents (LOAD_OP_LOAD) or not.
+		void colorAttachment(ResourceId image, bool load = false) {
+			use(image, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+				VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | (load ? VK_ACCESS_COLOR_ATTACHMENT_READ_BIT : 0),
+				VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, true, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+		}
+
+		void depthAttachment(ResourceId image, bool load = false) {
+			use(image, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+				VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | (load ? VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT : 0),
+				VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, true, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
+		}
+
+		// Multisample resolve target of a color attachment.  Written in the color attachment output stage.
+		void resolveAttachment(ResourceId image) {
+			use(image, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+				VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, true, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+		}
+
+		void sampledImage(ResourceId image, VkPipelineStageFlags stages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT) {
+			use(image, stages, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false,
+				VK_IMAGE_USAGE_SAMPLED_BIT);
+		}
+
+		void copySource(ResourceId image) {
+			use(image, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				false, VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+		}
+
+		void copyDestination(ResourceId resource) {
+			use(resource, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				true, VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+		}
+
+		void storageBufferRead(ResourceId buffer, VkPipelineStageFlags stages) {
+			use(buffer, stages, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_UNDEFINED, false, 0);
+		}
+
+		void storageBufferWrite(ResourceId buffer, VkPipelineStageFlags stages) {
+			use(buffer, stages, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, true, 0);
+		}
+
+		// Anything the helpers above do not cover.
+		void use(ResourceId resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout, bool write,
+			VkImageUsageFlags usage) {
+			pass.uses.push_back({ resource, stages, access, layout, write, usage });
+		}
+
+		// Keep the pass even if nothing reads what it writes.
+		void sideEffects() {
+			pass.sideEffects = true;
+		}
+
+	private:
+		friend class RenderGraph;
+		explicit PassBuilder(Pass& target) : pass(target) {}
+		Pass& pass;
+	};
+
+	RenderGraph() = default;
+	RenderGraph(const RenderGraph&) = delete;
+	RenderGraph& operator=(const RenderGraph&) = delete;
+
+	~RenderGraph() {
+		destroy();
+	}
+
+	// A resource that exists outside the graph.  final is where the graph leaves it after its last pass.
+	ResourceId importImage(const std::string& name, VkImageAspectFlags aspect, ResourceState initial, ResourceState final) {
+		Resource resource;
+		resource.name = name;
+		resource.imported = true;
+		resource.aspect = aspect;
+		resource.initial = initial;
+		resource.final = final;
+		resources.push_back(resource);
+		return static_cast<ResourceId>(resources.size() - 1);
+	}
+
+	ResourceId importBuffer(const std::string& name, ResourceState initial, ResourceState final) {
+		Resource resource;
+		resource.name = name;
+		resource.imported = true;
+		resource.isBuffer = true;
+		resource.initial = initial;
+		resource.final = final;
+		resources.push_back(resource);
+		return static_cast<ResourceId>(resources.size() - 1);
+	}
+
+	// An image that lives within the frame only.  The graph creates it in compile, with the usage its passes need.
+	ResourceId createImage(const std::string& name, const TransientImageInfo& info) {
+		Resource resource;
+		resource.name = name;
+		resource.aspect = info.aspect;
+		resource.transient = info;
+		resource.initial = { VK_IMAGE_LAYOUT_UNDEFINED, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0 };
+		resources.push_back(resource);
+		return static_cast<ResourceId>(resources.size() - 1);
+	}
+
+	// Point an imported resource at the object to use from the next execute on.
+	void setImportedImage(ResourceId id, VkImage image) {
+		resources[id].image = image;
+	}
+
+	void setImportedBuffer(ResourceId id, VkBuffer buffer) {
+		resources[id].buffer = buffer;
+	}
+
+	PassId addPass(const std::string& name, const std::function<void(PassBuilder&)>& setup, ExecuteFunction execute) {
+		passes.push_back({});
+		Pass& pass = passes.back();
+		pass.name = name;
+		pass.execute = std::move(execute);
+		PassBuilder builder(pass);
+		setup(builder);
+		return static_cast<PassId>(passes.size() - 1);
+	}
+
+	// Cull, work out the barriers, and create and alias the transient images.
+	void compile(VkDevice logicalDevice, GpuAllocator& gpuAllocator) {
+		device = logicalDevice;
+		allocator = &gpuAllocator;
+		cullPasses();
+		createTransientImages();
+		planBarriers();
+	}
+
+	// Record every kept pass, with its barriers in front of it, and the final transitions of imported resources.
+	void execute(VkCommandBuffer commandBuffer) {
+		for (const Pass& pass : passes) {
+			if (pass.culled) {
+				continue;
+			}
+			recordBarrier(commandBuffer, pass.barrier);
+			pass.execute(commandBuffer);
+		}
+		recordBarrier(commandBuffer, finalBarrier);
+	}
+
+	VkImage image(ResourceId id) const {
+		return resources[id].image;
+	}
+
+	// Transient images only; imported images bring their own views.
+	VkImageView imageView(ResourceId id) const {
+		return resources[id].view;
+	}
+
+	bool isCulled(PassId id) const {
+		return passes[id].culled;
+	}
+
+	const Stats& stats() const {
+		return statistics;
+	}
+
+	void printStats(std::ostream& out) const {
+		out << "render graph: " << statistics.passes << " passes (" << statistics.culledPasses << " culled), "
+			<< statistics.barriers << " barriers, " << statistics.transientImages << " transient images in "
+			<< statistics.allocatedBytes / 1024 << " KiB (" << statistics.transientBytes / 1024 << " KiB without aliasing)" << std::endl;
+	}
+
+	// Destroy the transient images and their memory.  Only once no submitted work uses them.
+	void destroy() {
+		if (device == VK_NULL_HANDLE) {
+			return;
+		}
+		for (Resource& resource : resources) {
+			if (!resource.imported && resource.image != VK_NULL_HANDLE) {
+				vkDestroyImageView(device, resource.view, nullptr);
+				vkDestroyImage(device, resource.image, nullptr);
+				resource.image = VK_NULL_HANDLE;
+			}
+		}
+		for (MemorySlot& slot : memorySlots) {
+			allocator->free(slot.memory);
+		}
+		memorySlots.clear();
+		device = VK_NULL_HANDLE;
+	}
+
+private:
+	struct Use {
+		ResourceId resource;
+		VkPipelineStageFlags stages;
+		VkAccessFlags access;
+		VkImageLayout layout;
+		bool write;
+		VkImageUsageFlags usage;
+	};
+
+	// One vkCmdPipelineBarrier.  Image barriers name their resource rather than the image, so swapping imported
+	// images does not invalidate them.
+	struct ImageBarrier {
+		ResourceId resource;
+		VkAccessFlags srcAccess;
+		VkAccessFlags dstAccess;
+		VkImageLayout oldLayout;
+		VkImageLayout newLayout;
+	};
+	struct Barrier {
+		VkPipelineStageFlags srcStages = 0;
+		VkPipelineStageFlags dstStages = 0;
+		VkAccessFlags memorySrcAccess = 0; // Global memory barrier, which covers every buffer hazard.
+		VkAccessFlags memoryDstAccess = 0;
+		std::vector<ImageBarrier> images;
+
+		bool empty() const {
+			return srcStages == 0 && dstStages == 0;
+		}
+	};
+
+	struct Pass {
+		std::string name;
+		std::vector<Use> uses;
+		ExecuteFunction execute;
+		bool sideEffects = false;
+		bool culled = false;
+		Barrier barrier;
+	};
+
+	struct Resource {
+		std::string name;
+		bool imported = false;
+		bool isBuffer = false;
+		VkImageAspectFlags aspect = 0;
+		TransientImageInfo transient{};
+		ResourceState initial{};
+		ResourceState final{};
+		VkImage image = VK_NULL_HANDLE;
+		VkImageView view = VK_NULL_HANDLE;
+		VkBuffer buffer = VK_NULL_HANDLE;
+		// Transient images only.
+		uint32_t firstPass = UINT32_MAX; // Lifetime in pass indices, kept passes only.
+		uint32_t lastPass = 0;
+		uint32_t memorySlot = UINT32_MAX;
+		ResourceId previousOccupant = UINT32_MAX; // Image that used the same memory before this one, maybe in the last execute.
+		VkPipelineStageFlags usedStages = 0; // Every stage and write of all its uses.
+		VkAccessFlags writtenAccess = 0;
+	};
+
+	// Memory shared by transient images with disjoint lifetimes.  Every image in a slot starts at its beginning.
+	struct MemorySlot {
+		VkMemoryRequirements requirements;
+		bool lazy;
+		std::vector<ResourceId> occupants; // In lifetime order.
+		GpuAllocation memory;
+	};
+
+	// Synchronization state of a resource while the passes are walked through in order.
+	struct Tracking {
+		VkImageLayout layout;
+		VkPipelineStageFlags writeStages;  // Of the last write (or layout transition).
+		VkAccessFlags writeAccess;
+		VkPipelineStageFlags readStages;   // Reads since the last write.
+		VkPipelineStageFlags visibleStages; // Stages and accesses the last write has been made visible to.
+		VkAccessFlags visibleAccess;
+	};
+
+	static constexpr VkAccessFlags WRITE_ACCESS = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT |
+		VK_ACCESS_MEMORY_WRITE_BIT;
+
+	VkDevice device = VK_NULL_HANDLE;
+	GpuAllocator* allocator = nullptr;
+	std::vector<Resource> resources;
+	std::vector<Pass> passes;
+	std::vector<MemorySlot> memorySlots;
+	Barrier finalBarrier; // Imported resources into their final state.
+	Stats statistics;
+	std::vector<VkImageMemoryBarrier> imageBarriers; // Reused by every recordBarrier.
+
+	// Walk backwards from what leaves the graph.  A resource is needed once a kept pass reads it, and every pass
+	// that writes a needed resource is kept.  That is conservative (a pass whose output is completely overwritten
+	// before anyone reads it is still kept), but never drops anything that matters.
+	void cullPasses() {
+		std::vector<bool> needed(resources.size(), false);
+		for (size_t i = 0; i < resources.size(); i++) {
+			needed[i] = resources[i].imported;
+		}
+		for (size_t p = passes.size(); p-- > 0;) {
+			Pass& pass = passes[p];
+			bool keep = pass.sideEffects;
+			for (const Use& use : pass.uses) {
+				keep = keep || (use.write && needed[use.resource]);
+			}
+			pass.culled = !keep;
+			if (keep) {
+				for (const Use& use : pass.uses) {
+					if (!use.write || (use.access & ~WRITE_ACCESS) != 0) {
+						needed[use.resource] = true;
+					}
+				}
+			}
+		}
+		statistics.passes = statistics.culledPasses = 0;
+		for (const Pass& pass : passes) {
+			(pass.culled ? statistics.culledPasses : statistics.passes)++;
+		}
+	}
+
+	void createTransientImages() {
+		std::vector<VkImageUsageFlags> usage(resources.size(), 0);
+		for (uint32_t p = 0; p < passes.size(); p++) {
+			if (passes[p].culled) {
+				continue;
+			}
+			for (const Use& use : passes[p].uses) {
+				Resource& resource = resources[use.resource];
+				usage[use.resource] |= use.usage;
+				resource.usedStages |= use.stages;
+				resource.writtenAccess |= use.access & WRITE_ACCESS;
+				resource.firstPass = std::min(resource.firstPass, p);
+				resource.lastPass = std::max(resource.lastPass, p);
+			}
+		}
+
+		std::vector<ResourceId> transients;
+		for (ResourceId id = 0; id < resources.size(); id++) {
+			if (!resources[id].imported && resources[id].firstPass != UINT32_MAX) {
+				transients.push_back(id);
+			}
+		}
+		statistics.transientImages = static_cast<uint32_t>(transients.size());
+		statistics.transientBytes = statistics.allocatedBytes = 0;
+
+		// Create the images first, their sizes decide how they are packed.
+		std::vector<VkMemoryRequirements> requirements(resources.size());
+		std::vector<bool> lazy(resources.size(), false);
+		const VkImageUsageFlags attachmentUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+			VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+		for (ResourceId id : transients) {
+			Resource& resource = resources[id];
+			VkImageCreateInfo imageInfo{};
+			imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+			imageInfo.imageType = VK_IMAGE_TYPE_2D;
+			imageInfo.format = resource.transient.format;
+			imageInfo.extent = { resource.transient.extent.width, resource.transient.extent.height, 1 };
+			imageInfo.mipLevels = 1;
+			imageInfo.arrayLayers = 1;
+			imageInfo.samples = resource.transient.samples;
+			imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+			imageInfo.usage = usage[id];
+			// Never read or written outside of render passes: its contents need not ever reach memory.
+			lazy[id] = (usage[id] & ~attachmentUsage) == 0;
+			if (lazy[id]) {
+				imageInfo.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+			}
+			imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+			imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			if (vkCreateImage(device, &imageInfo, nullptr, &resource.image) != VK_SUCCESS) {
+				throw std::runtime_error("failed to create image!");
+			}
+			vkGetImageMemoryRequirements(device, resource.image, &requirements[id]);
+			statistics.transientBytes += requirements[id].size;
+		}
+
+		// Biggest first, each into the first slot it fits in: one of the same kind whose occupants are all done
+		// before it starts.  Occupants are appended in lifetime order because passes run in order.
+		std::sort(transients.begin(), transients.end(), [&](ResourceId a, ResourceId b) {
+			return requirements[a].size > requirements[b].size;
+		});
+		for (ResourceId id : transients) {
+			Resource& resource = resources[id];
+			uint32_t chosen = UINT32_MAX;
+			for (uint32_t s = 0; s < memorySlots.size() && chosen == UINT32_MAX; s++) {
+				MemorySlot& slot = memorySlots[s];
+				bool fits = slot.lazy == lazy[id] && (slot.requirements.memoryTypeBits & requirements[id].memoryTypeBits) != 0;
+				for (ResourceId occupant : slot.occupants) {
+					const Resource& other = resources[occupant];
+					fits = fits && (other.lastPass < resource.firstPass || resource.lastPass < other.firstPass);
+				}
+				if (fits) {
+					chosen = s;
+				}
+			}
+			if (chosen == UINT32_MAX) {
+				memorySlots.push_back({ requirements[id], lazy[id], {}, {} });
+				chosen = static_cast<uint32_t>(memorySlots.size() - 1);
+			}
+			MemorySlot& slot = memorySlots[chosen];
+			slot.requirements.size = std::max(slot.requirements.size, requirements[id].size);
+			slot.requirements.alignment = std::max(slot.requirements.alignment, requirements[id].alignment);
+			slot.requirements.memoryTypeBits &= requirements[id].memoryTypeBits;
+			auto position = std::find_if(slot.occupants.begin(), slot.occupants.end(),
+				[&](ResourceId occupant) { return resources[occupant].firstPass > resource.firstPass; });
+			slot.occupants.insert(position, id);
+			resource.memorySlot = chosen;
+		}
+
+		for (MemorySlot& slot : memorySlots) {
+			// Every slot gets a vkAllocateMemory of its own: lazily allocated memory is only ever committed as tiles
+			// spill, so it must not be shared with anything else.  An image alone in its slot gets a true dedicated
+			// allocation, which render targets compress better in.  Memory several images alias cannot be
+			// dedicated to any one of them, so that is just a separate allocation.
+			VkMemoryPropertyFlags preferred = slot.lazy ? VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT : 0;
+			if (slot.occupants.size() == 1) {
+				slot.memory = allocator->allocateImage(resources[slot.occupants[0]].image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+					GpuResourceKind::Optimal, true, preferred);
+			}
+			else {
+				slot.memory = allocator->allocate(slot.requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GpuResourceKind::Optimal,
+					true, preferred);
+			}
+			statistics.allocatedBytes += slot.requirements.size;
+			for (size_t i = 0; i < slot.occupants.size(); i++) {
+				Resource& resource = resources[slot.occupants[i]];
+				// Every execute reuses the same memory, so the first occupant follows the last one of the execute before.
+				resource.previousOccupant = slot.occupants[i > 0 ? i - 1 : slot.occupants.size() - 1];
+				if (vkBindImageMemory(device, resource.image, slot.memory.memory, slot.memory.offset) != VK_SUCCESS) {
+					throw std::runtime_error("failed to bind image memory!");
+				}
+
+				VkImageViewCreateInfo viewInfo{};
+				viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+				viewInfo.image = resource.image;
+				viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+				viewInfo.format = resource.transient.format;
+				viewInfo.subresourceRange.aspectMask = resource.aspect;
+				viewInfo.subresourceRange.levelCount = 1;
+				viewInfo.subresourceRange.layerCount = 1;
+				if (vkCreateImageView(device, &viewInfo, nullptr, &resource.view) != VK_SUCCESS) {
+					throw std::runtime_error("failed to create image views!");
+				}
+			}
+		}
+	}
+
+	void planBarriers() {
+		std::vector<Tracking> tracking(resources.size());
+		for (size_t i = 0; i < resources.size(); i++) {
+			const ResourceState& initial = resources[i].initial;
+			// Whatever happened before the graph counts as a write that nothing has seen yet.
+			tracking[i] = { initial.layout, initial.stages, initial.access & WRITE_ACCESS, 0, 0, 0 };
+		}
+
+		statistics.barriers = 0;
+		for (Pass& pass : passes) {
+			if (pass.culled) {
+				continue;
+			}
+			pass.barrier = {};
+			for (const Use& use : pass.uses) {
+				Resource& resource = resources[use.resource];
+				Tracking& state = tracking[use.resource];
+				if (!resource.imported && state.writeStages == VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT) {
+					// First use of a transient image: whoever had the memory before, possibly this very image in the
+					// previous frame, must be completely done with it.
+					const Resource& previous = resources[resource.previousOccupant];
+					state.writeStages = previous.usedStages;
+					state.writeAccess = previous.writtenAccess;
+				}
+				addHazard(pass.barrier, use.resource, state, use);
+			}
+			statistics.barriers += pass.barrier.empty() ? 0 : 1;
+		}
+
+		finalBarrier = {};
+		for (ResourceId id = 0; id < resources.size(); id++) {
+			const Resource& resource = resources[id];
+			if (!resource.imported) {
+				continue;
+			}
+			Tracking& state = tracking[id];
+			Use finalUse{ id, resource.final.stages, resource.final.access, resource.final.layout,
+				(resource.final.access & WRITE_ACCESS) != 0, 0 };
+			addHazard(finalBarrier, id, state, finalUse);
+		}
+		statistics.barriers += finalBarrier.empty() ? 0 : 1;
+	}
+
+	// Add whatever use needs after state to barrier, and move state past use.
+	void addHazard(Barrier& barrier, ResourceId id, Tracking& state, const Use& use) {
+		const Resource& resource = resources[id];
+		const VkAccessFlags useWrites = use.access & WRITE_ACCESS;
+		const bool transition = !resource.isBuffer && use.layout != state.layout;
+
+		if (transition) {
+			// A layout transition reads and writes the whole image, so it waits for everything before it.
+			barrier.srcStages |= state.writeStages | state.readStages;
+			barrier.dstStages |= use.stages;
+			barrier.images.push_back({ id, state.writeAccess, use.access, state.layout, use.layout });
+			state = { use.layout, use.stages, useWrites, 0, use.stages, use.access };
+			return;
+		}
+
+		if (use.write) {
+			if (state.readStages != 0) {
+				// Write after read: the reads only have to be done, no memory needs to move.
+				barrier.srcStages |= state.readStages;
+				barrier.dstStages |= use.stages;
+			}
+			else if (state.writeStages != 0) {
+				// Write after write.
+				barrier.srcStages |= state.writeStages;
+				barrier.dstStages |= use.stages;
+				addMemoryDependency(barrier, id, state, use);
+			}
+			state = { state.layout, use.stages, useWrites, 0, use.stages, use.access };
+			return;
+		}
+
+		// Read after write, unless an earlier barrier already made the write visible to this kind of read.
+		bool visible = (use.stages & ~state.visibleStages) == 0 && (use.access & ~state.visibleAccess) == 0;
+		if (state.writeStages != 0 && !visible) {
+			barrier.srcStages |= state.writeStages;
+			barrier.dstStages |= use.stages;
+			addMemoryDependency(barrier, id, state, use);
+			state.visibleStages |= use.stages;
+			state.visibleAccess |= use.access;
+		}
+		state.readStages |= use.stages;
+	}
+
+	void addMemoryDependency(Barrier& barrier, ResourceId id, const Tracking& state, const Use& use) {
+		if (resources[id].isBuffer) {
+			barrier.memorySrcAccess |= state.writeAccess;
+			barrier.memoryDstAccess |= use.access;
+		}
+		else {
+			barrier.images.push_back({ id, state.writeAccess, use.access, state.layout, state.layout });
+		}
+	}
+
+	void recordBarrier(VkCommandBuffer commandBuffer, const Barrier& barrier) {
+		if (barrier.empty()) {
+			return;
+		}
+		imageBarriers.clear();
+		for (const ImageBarrier& planned : barrier.images) {
+			const Resource& resource = resources[planned.resource];
+			VkImageMemoryBarrier imageBarrier{};
+			imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			imageBarrier.srcAccessMask = planned.srcAccess;
+			imageBarrier.dstAccessMask = planned.dstAccess;
+			imageBarrier.oldLayout = planned.oldLayout;
+			imageBarrier.newLayout = planned.newLayout;
+			imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			imageBarrier.image = resource.image;
+			imageBarrier.subresourceRange.aspectMask = resource.aspect;
+			imageBarrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+			imageBarrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+			imageBarriers.push_back(imageBarrier);
+		}
+
+		VkMemoryBarrier memoryBarrier{};
+		memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		memoryBarrier.srcAccessMask = barrier.memorySrcAccess;
+		memoryBarrier.dstAccessMask = barrier.memoryDstAccess;
+		const uint32_t memoryBarrierCount = barrier.memoryDstAccess != 0 ? 1 : 0;
+
+		// An empty source scope (nothing happened before) is TOP_OF_PIPE; presenting waits on nothing, BOTTOM_OF_PIPE.
+		VkPipelineStageFlags srcStages = barrier.srcStages != 0 ? barrier.srcStages : VkPipelineStageFlags(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+		VkPipelineStageFlags dstStages = barrier.dstStages != 0 ? barrier.dstStages : VkPipelineStageFlags(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+		vkCmdPipelineBarrier(commandBuffer, srcStages, dstStages, 0, memoryBarrierCount, &memoryBarrier, 0, nullptr,
+			static_cast<uint32_t>(imageBarriers.size()), imageBarriers.data());
+	}
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// Shader hot reload.
+//
+// A program is a pipeline plus the shaders it is built from.  A background thread polls the modification times
+// of every program's GLSL sources and SPIR-V files.  A source that is newer than its SPIR-V is compiled with the
+// configured compiler (glslc), and once a program's SPIR-V has changed its pipeline is rebuilt through the
+// program's build function, still on the background thread.  The render loop never waits for any of this: it
+// calls takeReady once per frame, which hands over the pipelines finished since the last call.
+//
+// A build only ever creates a new pipeline.  Replacing the one in use, and destroying the old one once no frame
+// uses it any more, is up to the caller.  Failed compiles and builds are reported and leave the program alone, so
+// a typo in a shader never takes the running pipeline down.
+//
+// Build functions run on the background thread, so they may only read state that the render loop does not change
+// while builds can run.  pauseBuilds returns a lock that holds off builds while such state is being replaced.
+class ShaderManager {
+public:
+	struct ShaderFile {
+		std::string sourcePath; // GLSL source.  Empty if only the SPIR-V is watched.
+		std::string spirvPath;
+	};
+	// Gets the SPIR-V of every file, in the order given to addProgram.  Returns VK_NULL_HANDLE or throws on failure.
+	using BuildFunction = std::function<VkPipeline(const std::vector<std::vector<uint32_t>>& spirv)>;
+	using SwapFunction = std::function<void(uint32_t program, VkPipeline pipeline)>;
+
+	ShaderManager() = default;
+	ShaderManager(const ShaderManager&) = delete;
+	ShaderManager& operator=(const ShaderManager&) = delete;
+
+	~ShaderManager() {
+		stop();
+	}
+
+	// Register a program before start.  Returns its index, which takeReady passes back with every new pipeline.
+	uint32_t addProgram(const std::string& name, const std::vector<ShaderFile>& files, BuildFunction build) {
+		Program program;
+		program.name = name;
+		program.files = files;
+		program.build = std::move(build);
+		program.sourceTimes.assign(files.size(), FileTime::min());
+		program.spirvTimes.resize(files.size());
+		for (size_t i = 0; i < files.size(); i++) {
+			program.spirvTimes[i] = modificationTime(files[i].spirvPath);
+		}
+		programs.push_back(std::move(program));
+		return static_cast<uint32_t>(programs.size() - 1);
+	}
+
+	// compiler is the GLSL to SPIR-V compiler executable; empty only watches the SPIR-V files.
+	void start(const std::string& compilerPath, std::chrono::milliseconds pollInterval) {
+		compiler = compilerPath;
+		interval = pollInterval;
+		stopping = false;
+		watcher = std::thread([this]() { watchLoop(); });
+	}
+
+	// Stop watching and wait for a build in progress.  Pipelines that were finished but never taken are passed
+	// to discard so they can be destroyed.
+	void stop(const std::function<void(VkPipeline pipeline)>& discard = {}) {
+		if (watcher.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			watcher.join();
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const auto& result : ready) {
+			if (discard) {
+				discard(result.pipeline);
+			}
+		}
+		ready.clear();
+	}
+
+	// Hand every pipeline finished since the last call to swap, oldest first.  Never waits for a build.
+	void takeReady(const SwapFunction& swap) {
+		std::vector<Result> results;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			results.swap(ready);
+		}
+		for (const auto& result : results) {
+			swap(result.program, result.pipeline);
+		}
+	}
+
+	// No build starts or runs while the returned lock is held.
+	std::unique_lock<std::mutex> pauseBuilds() {
+		return std::unique_lock<std::mutex>(buildMutex);
+	}
+
+	// Find the glslc that comes with the Vulkan SDK, or fall back to whatever is on the PATH.
+	static std::string defaultCompiler() {
+		const char* sdk = std::getenv("VULKAN_SDK");
+		if (sdk != nullptr) {
+#ifdef _WIN32
+			std::filesystem::path path = std::filesystem::path(sdk) / "Bin" / "glslc.exe";
+#else
+			std::filesystem::path path = std::filesystem::path(sdk) / "bin" / "glslc";
+#endif
+			std::error_code error;
+			if (std::filesystem::exists(path, error)) {
+				return path.string();
+			}
+		}
+		return "glslc";
+	}
+
+private:
+	using FileTime = std::filesystem::file_time_type;
+
+	struct Program {
+		std::string name;
+		std::vector<ShaderFile> files;
+		BuildFunction build;
+		std::vector<FileTime> sourceTimes; // Source modification times of the last compile attempt.
+		std::vector<FileTime> spirvTimes; // SPIR-V modification times of the last build (or the initial one).
+	};
+	struct Result {
+		uint32_t program;
+		VkPipeline pipeline;
+	};
+
+	std::vector<Program> programs; // Fixed once started, and then only touched by the watcher thread.
+	std::string compiler;
+	std::chrono::milliseconds interval{ 250 };
+	std::thread watcher;
+	std::mutex mutex; // Guards stopping and ready.
+	std::mutex buildMutex; // Held by the watcher for the whole build, see pauseBuilds.
+	std::condition_variable wake;
+	bool stopping = false;
+	std::vector<Result> ready;
+
+	// Missing files (an editor halfway through saving, say) read as the oldest possible time.
+	static FileTime modificationTime(const std::string& path) {
+		std::error_code error;
+		FileTime time = std::filesystem::last_write_time(path, error);
+		return error ? FileTime::min() : time;
+	}
+
+	void watchLoop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!wake.wait_for(lock, interval, [this]() { return stopping; })) {
+			lock.unlock();
+			for (uint32_t i = 0; i < programs.size(); i++) {
+				checkProgram(i);
+			}
+			lock.lock();
+		}
+	}
+
+	void checkProgram(uint32_t index) {
+		Program& program = programs[index];
+
+		// Sources first, so a compile is picked up by the SPIR-V check right below.  A source that failed to compile
+		// is only tried again once it has been saved again.
+		if (!compiler.empty()) {
+			for (size_t i = 0; i < program.files.size(); i++) {
+				const ShaderFile& file = program.files[i];
+				if (file.sourcePath.empty()) {
+					continue;
+				}
+				FileTime sourceTime = modificationTime(file.sourcePath);
+				if (sourceTime != program.sourceTimes[i] && sourceTime > modificationTime(file.spirvPath)) {
+					compile(file);
+				}
+				program.sourceTimes[i] = sourceTime;
+			}
+		}
+
+		bool changed = false;
+		std::vector<FileTime> times(program.files.size());
+		for (size_t i = 0; i < program.files.size(); i++) {
+			times[i] = modificationTime(program.files[i].spirvPath);
+			changed = changed || times[i] != program.spirvTimes[i];
+		}
+		if (!changed) {
+			return;
+		}
+		// Take the new times even if the build fails, so a broken shader is reported once rather than every poll.
+		program.spirvTimes = times;
+
+		try {
+			std::vector<std::vector<uint32_t>> spirv;
+			for (const auto& file : program.files) {
+				spirv.push_back(readSpirv(file.spirvPath));
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			VkPipeline pipeline = VK_NULL_HANDLE;
+			{
+				std::lock_guard<std::mutex> buildLock(buildMutex);
+				pipeline = program.build(spirv);
+			}
+			if (pipeline == VK_NULL_HANDLE) {
+				throw std::runtime_error("failed to create pipeline!");
+			}
+			double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "reloaded " << program.name << " pipeline in " << milliseconds << " ms" << std::endl;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			ready.push_back({ index, pipeline });
+		}
+		catch (const std::exception& e) {
+			std::cerr << "failed to reload " << program.name << " pipeline: " << e.what() << std::endl;
+		}
+	}
+
+	void compile(const ShaderFile& file) {
+		std::string command = "\"" + compiler + "\" \"" + file.sourcePath + "\" -o \"" + file.spirvPath + "\"";
+#ifdef _WIN32
+		command = "\"" + command + "\"";  // cmd.exe strips the outer pair of quotes.
+#endif
+		std::cout << "compiling " << file.sourcePath << std::endl;
+		if (std::system(command.c_str()) != 0) {
+			// The compiler has printed the errors.  Touch nothing, so the old SPIR-V stays in use.
+			std::cerr << "failed to compile " << file.sourcePath << std::endl;
+		}
+	}
+
+	// Copied rather than mapped (see MappedFile): the compiler may rewrite the file at any moment while it is watched.
+	static std::vector<uint32_t> readSpirv(const std::string& path) {
+		std::ifstream file(path, std::ios::ate | std::ios::binary);
+		if (!file.is_open()) {
+			throw std::runtime_error("failed to open " + path + "!");
+		}
+		size_t size = static_cast<size_t>(file.tellg());
+		// SPIR-V is a stream of 32-bit words.  Anything else is a file caught halfway through being written.
+		if (size == 0 || size % 4 != 0) {
+			throw std::runtime_error(path + " is not valid SPIR-V!");
+		}
+		std::vector<uint32_t> words(size / 4);
+		file.seekg(0);
+		file.read(reinterpret_cast<char*>(words.data()), size);
+		return words;
+	}
+};
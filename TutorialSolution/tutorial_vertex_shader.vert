@@ -1,21 +1,26 @@
 #version 450
 #extension GL_KHR_vulkan_glsl : enable
+#extension GL_EXT_nonuniform_qualifier : enable  // Unsized descriptor arrays.
 
-layout(location = 0) out vec3 fragColor;
+// Per-vertex inputs, laid out as described by Vertex::getAttributeDescriptions().
+layout(location = 0) in vec2 inPosition;
+layout(location = 1) in vec3 inColor;
+
+// The buffer array of the bindless heap (BindlessHeap::BUFFER_BINDING).  Each element is one storage buffer.
+layout(std430, set = 0, binding = 0) readonly buffer InstanceOffsets {
+	vec2 offsets[];
+} buffers[];
 
-vec2 positions[3] = vec2[](
-	vec2(0.0,-0.5),
-	vec2(0.5,0.5),
-	vec2(-0.5,0.5)
-);
+// DrawConstants in main.cpp.
+layout(push_constant) uniform DrawConstants {
+	uint instanceBuffer;
+} draw;
 
-vec3 colors[3] = vec3[](
-	vec3(1.0, 0.0, 0.0),
-	vec3(0.0, 1.0, 0.0),
-	vec3(0.0, 0.0, 1.0)
-);
+layout(location = 0) out vec3 fragColor;
 
 void main() {
-	gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-	fragColor = colors[gl_VertexIndex];
+	// Offsets written by draw_layout.comp, one per instance (see InstanceOffset).
+	vec2 offset = buffers[draw.instanceBuffer].offsets[gl_InstanceIndex];
+	gl_Position = vec4(inPosition + offset, 0.0, 1.0);
+	fragColor = inColor;
 }
\ No newline at end of file
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// Owning Vulkan handles and a queue that destroys them once the GPU is done with them.
+//
+// A DeviceHandle destroys its object when it goes out of scope or is given a new one, and can be moved but not
+// copied, so every object has exactly one owner.  It converts to the raw handle, so it can be passed to vkCmd* and
+// filled into create info structs as if it were one.  Create into a local handle and construct the owner from it
+// only once vkCreate* returned VK_SUCCESS: a failed call leaves its output undefined, and the owner would destroy
+// whatever ended up there.
+//
+// Destroying an object that frames in flight still use is not allowed, and waiting for the device to go idle
+// before replacing one (a reloaded pipeline, the swap chain's image views, ...) stalls the render loop.  Instead
+// the old owner is moved into a DeletionQueue together with the last frame that may use it, and the queue
+// destroys it once that frame has completed.
+
+template <typename T, auto Destroy>
+class DeviceHandle {
+public:
+	DeviceHandle() = default;
+	DeviceHandle(VkDevice owner, T handle) : device(owner), handle(handle) {}
+
+	DeviceHandle(const DeviceHandle&) = delete;
+	DeviceHandle& operator=(const DeviceHandle&) = delete;
+
+	DeviceHandle(DeviceHandle&& other) noexcept : device(other.device), handle(other.release()) {}
+
+	DeviceHandle& operator=(DeviceHandle&& other) noexcept {
+		if (this != &other) {
+			reset();
+			device = other.device;
+			handle = other.release();
+		}
+		return *this;
+	}
+
+	~DeviceHandle() {
+		reset();
+	}
+
+	T get() const {
+		return handle;
+	}
+
+	operator T() const {
+		return handle;
+	}
+
+	explicit operator bool() const {
+		return handle != VK_NULL_HANDLE;
+	}
+
+	// Gives up ownership without destroying anything.
+	T release() {
+		T released = handle;
+		handle = VK_NULL_HANDLE;
+		return released;
+	}
+
+	void reset() {
+		if (handle != VK_NULL_HANDLE) {
+			Destroy(device, handle, nullptr);
+			handle = VK_NULL_HANDLE;
+		}
+	}
+
+private:
+	VkDevice device = VK_NULL_HANDLE;
+	T handle = VK_NULL_HANDLE;
+};
+
+using UniquePipeline = DeviceHandle<VkPipeline, vkDestroyPipeline>;
+using UniquePipelineLayout = DeviceHandle<VkPipelineLayout, vkDestroyPipelineLayout>;
+using UniqueRenderPass = DeviceHandle<VkRenderPass, vkDestroyRenderPass>;
+using UniqueFramebuffer = DeviceHandle<VkFramebuffer, vkDestroyFramebuffer>;
+using UniqueImageView = DeviceHandle<VkImageView, vkDestroyImageView>;
+using UniqueShaderModule = DeviceHandle<VkShaderModule, vkDestroyShaderModule>;
+using UniqueSwapchain = DeviceHandle<VkSwapchainKHR, vkDestroySwapchainKHR>;
+
+// Buffers and images are not wrapped: each comes with a GpuAllocation that has to go back to the allocator
+// together with it (see destroyBuffer).  Semaphores, command pools and the live swap chain are created once and
+// passed around by address in submit and present infos, so they stay raw handles freed in cleanup.
+
+// Destruction keyed on frame numbers: an entry queued with lastUsedFrame N runs once collect is told that frame N
+// has completed.  Frames complete in order and entries are queued with the frame count at the time, so the queue
+// stays sorted and collect only ever looks at its front.  Entries with the same frame run in the order they were
+// queued, so an object that depends on another (an image view on a swap chain image) is queued before it.
+class DeletionQueue {
+public:
+	DeletionQueue() = default;
+	DeletionQueue(const DeletionQueue&) = delete;
+	DeletionQueue& operator=(const DeletionQueue&) = delete;
+
+	~DeletionQueue() {
+		flush();
+	}
+
+	void push(uint64_t lastUsedFrame, std::function<void()> destroy) {
+		entries.push_back({ lastUsedFrame, std::move(destroy) });
+	}
+
+	// Take over an owner (a DeviceHandle, a vector of them, a unique_ptr, ...) and destroy it with the entry.
+	// std::function has to be copyable, so the owner is kept in a shared_ptr that only the entry holds.
+	template <typename Owner>
+	void retire(uint64_t lastUsedFrame, Owner&& owner) {
+		static_assert(!std::is_lvalue_reference_v<Owner>, "retire takes ownership, pass it with std::move");
+		auto kept = std::make_shared<std::decay_t<Owner>>(std::move(owner));
+		push(lastUsedFrame, [kept]() mutable {
+			kept.reset();
+		});
+	}
+
+	// Run every entry whose frame is at or before completedFrame.
+	void collect(uint64_t completedFrame) {
+		while (!entries.empty() && entries.front().lastUsedFrame <= completedFrame) {
+			Entry entry = std::move(entries.front());
+			entries.pop_front();
+			entry.destroy();
+		}
+	}
+
+	// Run everything.  Only once the device is idle.
+	void flush() {
+		collect(UINT64_MAX);
+	}
+
+	size_t size() const {
+		return entries.size();
+	}
+
+private:
+	struct Entry {
+		uint64_t lastUsedFrame;
+		std::function<void()> destroy;
+	};
+	std::deque<Entry> entries;
+};